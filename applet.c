@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "applet.h"
+#include "chipid.h"
+#include "comm.h"
+#include "eefc.h"
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * Thumb code of the applet, started by the monitor 'G' command.  The first
+ * two words are the initial stack pointer and entry point, filled in by
+ * applet_load.  The mailbox is located right after the code, at offset
+ * 0x200.  Commands are writing pages to flash and computing the CRC-32 of
+ * consecutive flash regions.
+ *
+ *   entry:       push  {r4-r11, lr}
+ *                adr   r0, mailbox
+ *                ldr   r1, [r0, #0]       @ command
+ *                movs  r2, #0
+ *                str   r2, [r0, #8]       @ result
+ *                cmp   r1, #1
+ *                beq   write_pages
+ *                cmp   r1, #2
+ *                beq   crc32
+ *                mvns  r6, r2             @ unknown command
+ *                b     done
+ *   write_pages: ldr   r1, [r0, #16]      @ EEFC base
+ *                ldr   r2, [r0, #20]      @ latch buffer address
+ *                ldr   r3, [r0, #24]      @ first page
+ *                ldr   r4, [r0, #28]      @ number of pages
+ *                ldr   r5, [r0, #32]      @ source buffer
+ *   page_loop:   movs  r6, #0
+ *                cmp   r4, #0
+ *                beq   done
+ *                movs  r6, #128
+ *   copy:        ldm   r5!, {r7}          @ word copy to latch buffer
+ *                stm   r2!, {r7}
+ *                subs  r6, #1
+ *                bne   copy
+ *                dsb   sy
+ *                lsls  r6, r3, #8
+ *                ldr   r7, [r0, #36]      @ FKEY | FCMD
+ *                orrs  r6, r7
+ *                str   r6, [r1, #4]       @ EEFC_FCR
+ *   wait:        ldr   r6, [r1, #8]       @ EEFC_FSR
+ *                lsls  r7, r6, #31
+ *                beq   wait
+ *                movs  r7, #0x0e          @ CMDE | FLOCKE | FLERR
+ *                ands  r6, r7
+ *                bne   done
+ *                ldr   r7, [r0, #8]
+ *                adds  r7, #1
+ *                str   r7, [r0, #8]
+ *                adds  r3, #1
+ *                subs  r4, #1
+ *                b     page_loop
+ *   crc32:       ldr   r1, [r0, #16]      @ start address
+ *                ldr   r2, [r0, #20]      @ region size
+ *                ldr   r3, [r0, #24]      @ number of regions
+ *                ldr   r4, [r0, #28]      @ destination buffer
+ *                ldr   r5, [r0, #32]      @ table buffer
+ *                ldr   r9, poly
+ *                movs  r6, #0
+ *   table_loop:  mov   r7, r6
+ *                mov   r8, #8
+ *   table_bit:   lsrs  r7, r7, #1
+ *                it    cs
+ *                eorcs r7, r7, r9
+ *                subs  r8, r8, #1
+ *                bne   table_bit
+ *                str   r7, [r5, r6, lsl #2]
+ *                adds  r6, #1
+ *                cmp   r6, #256
+ *                bne   table_loop
+ *   region_loop: movs  r6, #0
+ *                cmp   r3, #0
+ *                beq   done
+ *                mvn   r7, #0
+ *                mov   r6, r2
+ *   byte_loop:   ldrb  r8, [r1], #1
+ *                eor   r8, r8, r7
+ *                uxtb  r8, r8
+ *                ldr   r8, [r5, r8, lsl #2]
+ *                eor   r7, r8, r7, lsr #8
+ *                subs  r6, #1
+ *                bne   byte_loop
+ *                mvns  r7, r7
+ *                str   r7, [r4], #4
+ *                ldr   r7, [r0, #8]
+ *                adds  r7, #1
+ *                str   r7, [r0, #8]
+ *                subs  r3, #1
+ *                b     region_loop
+ *   done:        str   r6, [r0, #4]       @ status
+ *                pop   {r4-r11, pc}
+ *   poly:        .word 0xedb88320
+ */
+const uint8_t applet_code[] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2d, 0xe9, 0xf0, 0x4f,
+	0x7c, 0xa0, 0x01, 0x68, 0x00, 0x22, 0x82, 0x60, 0x01, 0x29, 0x03, 0xd0,
+	0x02, 0x29, 0x20, 0xd0, 0xd6, 0x43, 0x50, 0xe0, 0x01, 0x69, 0x42, 0x69,
+	0x83, 0x69, 0xc4, 0x69, 0x05, 0x6a, 0x00, 0x26, 0x00, 0x2c, 0x48, 0xd0,
+	0x80, 0x26, 0x80, 0xcd, 0x80, 0xc2, 0x01, 0x3e, 0xfb, 0xd1, 0xbf, 0xf3,
+	0x4f, 0x8f, 0x1e, 0x02, 0x47, 0x6a, 0x3e, 0x43, 0x4e, 0x60, 0x8e, 0x68,
+	0xf7, 0x07, 0xfc, 0xd0, 0x0e, 0x27, 0x3e, 0x40, 0x37, 0xd1, 0x87, 0x68,
+	0x01, 0x37, 0x87, 0x60, 0x01, 0x33, 0x01, 0x3c, 0xe5, 0xe7, 0x01, 0x69,
+	0x42, 0x69, 0x83, 0x69, 0xc4, 0x69, 0x05, 0x6a, 0xdf, 0xf8, 0x5c, 0x90,
+	0x00, 0x26, 0x37, 0x46, 0x4f, 0xf0, 0x08, 0x08, 0x7f, 0x08, 0x28, 0xbf,
+	0x87, 0xea, 0x09, 0x07, 0xb8, 0xf1, 0x01, 0x08, 0xf8, 0xd1, 0x45, 0xf8,
+	0x26, 0x70, 0x01, 0x36, 0xb6, 0xf5, 0x80, 0x7f, 0xef, 0xd1, 0x00, 0x26,
+	0x00, 0x2b, 0x16, 0xd0, 0x6f, 0xf0, 0x00, 0x07, 0x16, 0x46, 0x11, 0xf8,
+	0x01, 0x8b, 0x88, 0xea, 0x07, 0x08, 0x5f, 0xfa, 0x88, 0xf8, 0x55, 0xf8,
+	0x28, 0x80, 0x88, 0xea, 0x17, 0x27, 0x01, 0x3e, 0xf3, 0xd1, 0xff, 0x43,
+	0x44, 0xf8, 0x04, 0x7b, 0x87, 0x68, 0x01, 0x37, 0x87, 0x60, 0x01, 0x3b,
+	0xe5, 0xe7, 0x46, 0x60, 0xbd, 0xe8, 0xf0, 0x8f, 0x20, 0x83, 0xb8, 0xed,
+};
+
+const uint32_t applet_code_size = sizeof(applet_code);
+
+static bool applet_run(int fd, struct _applet_mailbox* mailbox)
+{
+	struct _stats* stats = samba_get_stats(fd);
+	uint64_t start = stats_start(stats);
+
+	// send command and arguments, status and result are written back by
+	// the applet
+	if (!samba_write(fd, (const uint8_t*)mailbox, APPLET_MAILBOX,
+				sizeof(*mailbox)))
+		return false;
+
+	if (!samba_go(fd, APPLET_ADDR))
+		return false;
+
+	// the monitor does not answer until the applet returns
+	uint32_t result[2];
+	if (!samba_read(fd, (uint8_t*)result,
+				APPLET_MAILBOX + offsetof(struct _applet_mailbox, status),
+				sizeof(result)))
+		return false;
+	mailbox->status = result[0];
+	mailbox->result = result[1];
+	stats_record(stats, STATS_APPLET, 0, start, 0);
+	return true;
+}
+
+bool applet_load(int fd)
+{
+	uint8_t code[sizeof(applet_code)];
+	memcpy(code, applet_code, sizeof(code));
+
+	// fill initial stack pointer and entry point (thumb)
+	uint32_t* header = (uint32_t*)code;
+	header[0] = APPLET_STACK;
+	header[1] = (APPLET_ADDR + 8) | 1;
+
+	if (!samba_write(fd, code, APPLET_ADDR, sizeof(code))) {
+		fprintf(stderr, "Could not upload applet\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool applet_write(int fd, const struct _chip* chip,
+		const uint8_t* buffer, uint32_t addr, uint32_t size)
+{
+	uint8_t pages[APPLET_MAX_PAGES * EEFC_PAGE_SIZE];
+
+	if (addr + size > chip->flash_size * 1024)
+		return false;
+
+	while (size > 0) {
+		uint32_t first_page = addr / EEFC_PAGE_SIZE;
+		uint32_t head = addr & (EEFC_PAGE_SIZE - 1);
+		uint32_t count = MIN(size, sizeof(pages) - head);
+		uint32_t nb_pages = (head + count + EEFC_PAGE_SIZE - 1) / EEFC_PAGE_SIZE;
+
+		// build whole pages, padding with 0xff leaves the flash
+		// content outside of the written range unchanged; whole pages
+		// are sent in place
+		const uint8_t* data = buffer;
+		if (head || count & (EEFC_PAGE_SIZE - 1)) {
+			memset(pages, 0xff, nb_pages * EEFC_PAGE_SIZE);
+			memcpy(pages + head, buffer, count);
+			data = pages;
+		}
+		if (!samba_write(fd, data, APPLET_BUFFER, nb_pages * EEFC_PAGE_SIZE))
+			return false;
+
+		struct _applet_mailbox mailbox;
+		memset(&mailbox, 0, sizeof(mailbox));
+		mailbox.command = APPLET_CMD_WRITE_PAGES;
+		mailbox.args[0] = chip->eefc_base;
+		mailbox.args[1] = chip->flash_addr + first_page * EEFC_PAGE_SIZE;
+		mailbox.args[2] = first_page;
+		mailbox.args[3] = nb_pages;
+		mailbox.args[4] = APPLET_BUFFER;
+		mailbox.args[5] = EEFC_FCR_FKEY | EEFC_FCR_FCMD_WP;
+		if (!applet_run(fd, &mailbox))
+			return false;
+
+		uint32_t page = first_page + mailbox.result;
+		if (mailbox.status & EEFC_FSR_FLOCKE) {
+			fprintf(stderr, "Write error on page %d: page locked\n", page);
+			return false;
+		}
+		if (mailbox.status & (EEFC_FSR_FLERR | EEFC_FSR_CMDE)) {
+			fprintf(stderr, "Write error on page %d: flash error\n", page);
+			return false;
+		}
+		if (mailbox.status || mailbox.result != nb_pages) {
+			fprintf(stderr, "Write error on page %d: applet error 0x%08x\n",
+					page, mailbox.status);
+			return false;
+		}
+
+		buffer += count;
+		addr += count;
+		size -= count;
+	}
+
+	return true;
+}
+
+bool applet_crc32(int fd, const struct _chip* chip, uint32_t addr,
+		uint32_t region_size, uint32_t count, uint32_t* crcs)
+{
+	if (!region_size || addr + region_size * count > chip->flash_size * 1024)
+		return false;
+
+	while (count > 0) {
+		uint32_t regions = MIN(count, APPLET_MAX_CRCS);
+
+		struct _applet_mailbox mailbox;
+		memset(&mailbox, 0, sizeof(mailbox));
+		mailbox.command = APPLET_CMD_CRC32;
+		mailbox.args[0] = chip->flash_addr + addr;
+		mailbox.args[1] = region_size;
+		mailbox.args[2] = regions;
+		mailbox.args[3] = APPLET_BUFFER;
+		mailbox.args[4] = APPLET_TABLE;
+		if (!applet_run(fd, &mailbox))
+			return false;
+		if (mailbox.status || mailbox.result != regions) {
+			fprintf(stderr, "CRC error at 0x%08x: applet error 0x%08x\n",
+					addr, mailbox.status);
+			return false;
+		}
+
+		if (!samba_read(fd, (uint8_t*)crcs, APPLET_BUFFER, regions * 4))
+			return false;
+
+		addr += regions * region_size;
+		crcs += regions;
+		count -= regions;
+	}
+
+	return true;
+}
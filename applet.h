@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef APPLET_H_
+#define APPLET_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "eefc.h"
+
+// SRAM layout used by the applet: code, mailbox, CRC table, stack (growing
+// down from the buffer) and data buffer
+#define APPLET_ADDR    0x20401000
+#define APPLET_MAILBOX (APPLET_ADDR + 0x200)
+#define APPLET_TABLE   (APPLET_ADDR + 0x400)
+#define APPLET_STACK   (APPLET_ADDR + 0x1000)
+#define APPLET_BUFFER  (APPLET_ADDR + 0x1000)
+
+#define APPLET_MAX_PAGES 64
+
+#define APPLET_MAX_CRCS (APPLET_MAX_PAGES * EEFC_PAGE_SIZE / 4)
+
+#define APPLET_CMD_WRITE_PAGES 1
+#define APPLET_CMD_CRC32       2
+
+struct _applet_mailbox {
+	uint32_t command;
+	uint32_t status;
+	uint32_t result;
+	uint32_t reserved;
+	uint32_t args[8];
+};
+
+struct _chip;
+
+extern const uint8_t applet_code[];
+
+extern const uint32_t applet_code_size;
+
+extern bool applet_load(int fd);
+
+extern bool applet_write(int fd, const struct _chip* chip,
+		const uint8_t* buffer, uint32_t addr, uint32_t size);
+
+extern bool applet_crc32(int fd, const struct _chip* chip, uint32_t addr,
+		uint32_t region_size, uint32_t count, uint32_t* crcs);
+
+#endif /* APPLET_H_ */
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Command encoding micro-benchmark
+ *
+ * Measures the host CPU cost of encoding monitor commands with snprintf and
+ * with the command module, and of sending 'S' commands with their data to
+ * /dev/null in separate writes and batched with writev:
+ *
+ *     ./cmdbench [<commands>]
+ */
+
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "command.h"
+
+#define CHUNK_SIZE 1024
+#define BATCH 8
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// the encoders must produce the same commands
+static bool check_encoding(void)
+{
+	char expected[COMMAND_SIZE + 1], cmd[COMMAND_SIZE];
+	for (uint32_t i = 0; i < 100000; i++) {
+		uint32_t addr = rand() ^ (rand() << 16), value = i * 0x9e3779b9;
+		snprintf(expected, sizeof(expected), "W%08x,%08x#", addr, value);
+		if (command_encode(cmd, 'W', addr, value) != COMMAND_SIZE ||
+				memcmp(cmd, expected, COMMAND_SIZE)) {
+			fprintf(stderr, "Encoding mismatch for 0x%08x 0x%08x\n", addr, value);
+			return false;
+		}
+		snprintf(expected, sizeof(expected), "w%08x,#", addr);
+		if (command_encode_query(cmd, 'w', addr) != COMMAND_QUERY_SIZE ||
+				memcmp(cmd, expected, COMMAND_QUERY_SIZE)) {
+			fprintf(stderr, "Encoding mismatch for 0x%08x\n", addr);
+			return false;
+		}
+		snprintf(expected, sizeof(expected), "G%08x#", addr);
+		if (command_encode_addr(cmd, 'G', addr) != COMMAND_ADDR_SIZE ||
+				memcmp(cmd, expected, COMMAND_ADDR_SIZE)) {
+			fprintf(stderr, "Encoding mismatch for 0x%08x\n", addr);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void bench_encoding(uint32_t count)
+{
+	char cmd[COMMAND_SIZE + 1];
+	uint32_t sink = 0;
+
+	double start = now_ns();
+	for (uint32_t i = 0; i < count; i++) {
+		snprintf(cmd, sizeof(cmd), "W%08x,%08x#", 0x400000 + 4 * i, i);
+		sink += strlen(cmd);
+	}
+	double printf_ns = (now_ns() - start) / count;
+
+	start = now_ns();
+	for (uint32_t i = 0; i < count; i++)
+		sink += command_encode(cmd, 'W', 0x400000 + 4 * i, i);
+	double table_ns = (now_ns() - start) / count;
+
+	printf("Encoding %u 'W' commands (checksum %u):\n", count, sink);
+	printf("    snprintf        %8.1f ns/command\n", printf_ns);
+	printf("    command_encode  %8.1f ns/command (%.1fx)\n", table_ns,
+			printf_ns / table_ns);
+}
+
+static bool bench_framing(uint32_t count)
+{
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		perror("Could not open /dev/null");
+		return false;
+	}
+	uint8_t data[CHUNK_SIZE];
+	memset(data, 0x5a, sizeof(data));
+
+	// header then data, each in its own write
+	char cmd[BATCH][COMMAND_SIZE + 1];
+	uint64_t syscalls = 0;
+	double start = now_ns();
+	for (uint32_t i = 0; i < count; i++) {
+		snprintf(cmd[0], sizeof(cmd[0]), "S%08x,%08x#", 0x20401000 + i, CHUNK_SIZE);
+		if (write(fd, cmd[0], strlen(cmd[0])) < 0 || write(fd, data, CHUNK_SIZE) < 0)
+			break;
+		syscalls += 2;
+	}
+	double split_ns = (now_ns() - start) / count;
+	double split_calls = (double)syscalls / count;
+
+	// BATCH commands with their data in one writev
+	struct iovec iov[2 * BATCH];
+	syscalls = 0;
+	start = now_ns();
+	for (uint32_t i = 0; i < count; i += BATCH) {
+		int n = 0;
+		for (uint32_t j = 0; j < BATCH && i + j < count; j++) {
+			iov[n].iov_base = cmd[j];
+			iov[n++].iov_len = command_encode(cmd[j], 'S', 0x20401000 + i + j, CHUNK_SIZE);
+			iov[n].iov_base = data;
+			iov[n++].iov_len = CHUNK_SIZE;
+		}
+		if (writev(fd, iov, n) < 0)
+			break;
+		syscalls++;
+	}
+	double batch_ns = (now_ns() - start) / count;
+	double batch_calls = (double)syscalls / count;
+	close(fd);
+
+	printf("Sending %u 'S' commands of %d bytes to /dev/null:\n", count, CHUNK_SIZE);
+	printf("    write + write   %8.1f ns/command, %.3f system calls/command\n",
+			split_ns, split_calls);
+	printf("    writev x%-2d      %8.1f ns/command, %.3f system calls/command\n",
+			BATCH, batch_ns, batch_calls);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+	if (!count) {
+		fprintf(stderr, "Usage: %s [<commands>]\n", argv[0]);
+		return -1;
+	}
+
+	if (!check_encoding())
+		return -1;
+	bench_encoding(count);
+	return bench_framing(count / 10 ? count / 10 : 1) ? 0 : -1;
+}
@@ -13,16 +13,198 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include "command.h"
 #include "comm.h"
+#include "framing.h"
+#include "stats.h"
 #include "utils.h"
 
-static bool configure_tty(int fd, int speed)
+#define MAX_PORTS 256
+
+#define MAX_WRITE_WORDS 128
+
+// 'R' transfers are cut by the framing planner, in chunks of up to the
+// largest transfer the monitor answers in time to a probe at open, or
+// MIN_TRANSFER.  A too large 'S' would only show as data missing in flash,
+// so 'S' chunks stay at MIN_TRANSFER which all monitors accept.
+#define MIN_TRANSFER 1024
+#define MAX_TRANSFER 4096
+#define PROBE_TIMEOUT_MS 200
+
+static const uint32_t probe_sizes[] = { MAX_TRANSFER, 2048 };
+
+// marker ending each batch of 'R' commands, two 'N' commands
+#define READ_MARKER_CMD "N#N#"
+#define READ_MARKER_ANSWER "\n\r\n\r"
+#define READ_MARKER_SIZE 4
+
+// chunks and markers in flight, there is at most one marker per chunk plus
+// the marker of a batch whose chunks were all received
+#define READ_PENDING_SIZE (2 * SAMBA_MAX_READ_WINDOW + 1)
+
+// WRITE_BATCH 'S' commands are sent together with their data in one system
+// call
+#define WRITE_BATCH 8
+
+// A failed command is retried up to SAMBA_MAX_RETRIES times, after waiting
+// RETRY_DELAY_US, doubled at each retry, and resynchronizing the monitor.
+// The line is considered quiet when nothing was received for DRAIN_MS.
+#define SAMBA_MAX_RETRIES 5
+#define RETRY_DELAY_US 2000
+#define DRAIN_MS 20
+
+struct _samba_port {
+	struct _samba_counters counters;
+	struct _stats* stats;
+	uint32_t read_window;
+	uint32_t timeout_ms;
+	int io_mode;
+	struct _framing framing;
+};
+
+static struct _samba_port _ports[MAX_PORTS];
+
+static ssize_t port_write(int fd, const void* buffer, size_t size)
+{
+	struct _samba_counters* counters = &_ports[fd].counters;
+	ssize_t count = write(fd, buffer, size);
+	counters->syscalls++;
+	if (count > 0)
+		counters->bytes_sent += count;
+	return count;
+}
+
+static ssize_t port_read(int fd, void* buffer, size_t size)
+{
+	struct _samba_counters* counters = &_ports[fd].counters;
+	ssize_t count = read(fd, buffer, size);
+	counters->syscalls++;
+	if (count > 0)
+		counters->bytes_received += count;
+	return count;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Wait up to timeout_ms for data to read, returns false on timeout
+static bool port_wait(int fd, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	for (;;) {
+		int ready = poll(&pfd, 1, timeout_ms);
+		_ports[fd].counters.syscalls++;
+		if (ready >= 0 || errno != EINTR)
+			return ready > 0;
+	}
+}
+
+// Read exactly size bytes, failing if nothing comes for the timeout of the
+// port.  In buffered mode reads do not block (VMIN is 0), and when the
+// response is likely there already (queued is set), it is read before
+// waiting.
+static bool port_read_all(int fd, void* buffer, uint32_t size, bool queued)
+{
+	struct _samba_port* port = &_ports[fd];
+	uint8_t* ptr = buffer;
+	uint64_t deadline = now_ms() + port->timeout_ms;
+	bool wait = port->io_mode != SAMBA_IO_BUFFERED || !queued;
+	while (size > 0) {
+		if (wait) {
+			uint64_t now = now_ms();
+			if (now >= deadline || !port_wait(fd, deadline - now)) {
+				port->counters.timeouts++;
+				return false;
+			}
+		}
+		ssize_t count = port_read(fd, ptr, size);
+		if (count < 0 && errno == EINTR)
+			continue;
+		// nothing to read on a port reported readable: it was closed
+		if ((count < 0 && errno != EAGAIN) || (count <= 0 && wait))
+			return false;
+		// what was not read has not arrived yet
+		wait = true;
+		if (count > 0) {
+			deadline = now_ms() + port->timeout_ms;
+			ptr += count;
+			size -= count;
+		}
+	}
+	return true;
+}
+
+static bool port_write_all(int fd, const void* buffer, uint32_t size)
+{
+	return port_write(fd, buffer, size) == size;
+}
+
+static bool port_writev_all(int fd, const struct iovec* iov, int count,
+		uint32_t size)
+{
+	struct _samba_counters* counters = &_ports[fd].counters;
+	ssize_t written = writev(fd, iov, count);
+	counters->syscalls++;
+	if (written > 0)
+		counters->bytes_sent += written;
+	return written == size;
+}
+
+// Bring the monitor back to a known state: discard anything still queued or
+// in flight, complete a 'S' command that may still be waiting for its data
+// with newlines (ignored between commands), then check that a 'N' command
+// gets its answer.
+static bool port_resync(int fd)
+{
+	tcflush(fd, TCIOFLUSH);
+
+	uint8_t padding[MIN_TRANSFER];
+	memset(padding, '\n', sizeof(padding));
+	if (!port_write_all(fd, padding, _ports[fd].framing.max_write))
+		return false;
+
+	uint8_t discard[256];
+	while (port_wait(fd, DRAIN_MS))
+		if (port_read(fd, discard, sizeof(discard)) <= 0)
+			break;
+
+	char answer[2];
+	return port_write_all(fd, "N#", 2) &&
+		port_read_all(fd, answer, 2, false) &&
+		!memcmp(answer, "\n\r", 2);
+}
+
+// Called when a command failed, with the number of times it was already
+// retried.  Returns true once the monitor is resynchronized and the command
+// can be sent again, false when the retries are exhausted.
+static bool port_recover(int fd, uint32_t* retries)
+{
+	struct _samba_port* port = &_ports[fd];
+	while (*retries < SAMBA_MAX_RETRIES) {
+		usleep(RETRY_DELAY_US << *retries);
+		(*retries)++;
+		port->counters.retries++;
+		if (port_resync(fd))
+			return true;
+	}
+	fprintf(stderr, "Communication failed after %d retries\n", SAMBA_MAX_RETRIES);
+	return false;
+}
+
+static bool configure_tty(int fd, int speed, int io_mode)
 {
 	struct termios tty;
 
@@ -42,8 +224,13 @@ static bool configure_tty(int fd, int speed)
 	tty.c_cflag |= CS8 | CLOCAL | CREAD;
 	tty.c_lflag = 0;
 	tty.c_oflag = 0;
-	tty.c_cc[VMIN] = 1;
-	tty.c_cc[VTIME] = 5;
+	if (io_mode == SAMBA_IO_BUFFERED) {
+		tty.c_cc[VMIN] = 0;
+		tty.c_cc[VTIME] = 0;
+	} else {
+		tty.c_cc[VMIN] = 1;
+		tty.c_cc[VTIME] = 5;
+	}
 	tty.c_iflag &= ~(ICRNL | IGNBRK | IXON | IXOFF | IXANY);
 
 	if (tcsetattr(fd, TCSANOW, &tty) != 0) {
@@ -54,23 +241,70 @@ static bool configure_tty(int fd, int speed)
 	return true;
 }
 
+// A previous session may have left the monitor in the middle of a command,
+// it is then resynchronized
 static bool switch_to_binary(int fd)
 {
-	char cmd[] = "N#";
-	if (write(fd, cmd, strlen(cmd)) != strlen(cmd))
-		return false;
-	return read(fd, cmd, 2) == 2;
+	char answer[2];
+	if (port_write_all(fd, "N#", 2) && port_read_all(fd, answer, 2, false) &&
+			!memcmp(answer, "\n\r", 2))
+		return true;
+	uint32_t retries = 0;
+	return port_recover(fd, &retries);
 }
 
-int samba_open(const char* device)
+// Largest 'R' transfer answered completely and in time, reading from
+// address 0 which is always mapped
+static uint32_t probe_max_transfer(int fd)
 {
-	int fd = open(device, O_RDWR | O_NOCTTY | O_SYNC);
+	struct _samba_port* port = &_ports[fd];
+	uint32_t timeout_ms = port->timeout_ms;
+	uint8_t buffer[MAX_TRANSFER];
+	uint32_t max_transfer = MIN_TRANSFER;
+
+	port->timeout_ms = PROBE_TIMEOUT_MS;
+	for (int i = 0; i < ARRAY_SIZE(probe_sizes); i++) {
+		char cmd[COMMAND_SIZE];
+		uint32_t size = command_encode(cmd, 'R', 0, probe_sizes[i]);
+		if (port_write_all(fd, cmd, size) &&
+				port_read_all(fd, buffer, probe_sizes[i], false)) {
+			max_transfer = probe_sizes[i];
+			break;
+		}
+		if (!port_resync(fd))
+			break;
+	}
+	port->timeout_ms = timeout_ms;
+	return max_transfer;
+}
+
+int samba_open(const char* device, int io_mode)
+{
+	int flags = O_RDWR | O_NOCTTY;
+	if (io_mode != SAMBA_IO_BUFFERED)
+		flags |= O_SYNC;
+	int fd = open(device, flags);
 	if (fd < 0) {
 		perror("Could not open device");
 		return -1;
 	}
 
-	if (!configure_tty(fd, B4000000)) {
+	if (fd >= MAX_PORTS) {
+		fprintf(stderr, "Too many open files\n");
+		close(fd);
+		return -1;
+	}
+	memset(&_ports[fd], 0, sizeof(_ports[fd]));
+	_ports[fd].read_window = SAMBA_DEFAULT_READ_WINDOW;
+	_ports[fd].timeout_ms = SAMBA_DEFAULT_TIMEOUT_MS;
+	_ports[fd].io_mode = io_mode;
+	_ports[fd].framing.packet_size = framing_detect_packet_size(device);
+	if (!_ports[fd].framing.packet_size)
+		_ports[fd].framing.packet_size = FRAMING_HIGH_SPEED_PACKET;
+	_ports[fd].framing.max_read = MIN_TRANSFER;
+	_ports[fd].framing.max_write = MIN_TRANSFER;
+
+	if (!configure_tty(fd, B4000000, io_mode)) {
 		close(fd);
 		return -1;
 	}
@@ -79,6 +313,7 @@ int samba_open(const char* device)
 		close(fd);
 		return -1;
 	}
+	_ports[fd].framing.max_read = probe_max_transfer(fd);
 
 	return fd;
 }
@@ -88,57 +323,283 @@ void samba_close(int fd)
 	close(fd);
 }
 
+int samba_parse_io_mode(const char* name)
+{
+	if (!strcmp(name, "sync"))
+		return SAMBA_IO_SYNC;
+	if (!strcmp(name, "buffered"))
+		return SAMBA_IO_BUFFERED;
+	return -1;
+}
+
+bool samba_drain(int fd)
+{
+	struct _samba_port* port = &_ports[fd];
+	if (port->io_mode != SAMBA_IO_BUFFERED)
+		return true;
+	port->counters.syscalls++;
+	return tcdrain(fd) == 0;
+}
+
 bool samba_read_word(int fd, uint32_t addr, uint32_t* value)
 {
-	char cmd[12];
-	snprintf(cmd, sizeof(cmd), "w%08x,#", addr);
-	if (write(fd, cmd, strlen(cmd)) != strlen(cmd))
-		return false;
-	return read(fd, value, 4) == 4;
+	struct _stats* stats = _ports[fd].stats;
+	uint64_t start = stats_start(stats);
+	char cmd[COMMAND_QUERY_SIZE];
+	uint32_t size = command_encode_query(cmd, 'w', addr);
+	uint32_t retries = 0;
+	while (!port_write_all(fd, cmd, size) || !port_read_all(fd, value, 4, false))
+		if (!port_recover(fd, &retries))
+			return false;
+	stats_record(stats, STATS_READ_WORD, 4, start, 0);
+	return true;
 }
 
 bool samba_write_word(int fd, uint32_t addr, uint32_t value)
 {
-	char cmd[20];
-	snprintf(cmd, sizeof(cmd), "W%08x,%08x#", addr, value);
-	return write(fd, cmd, strlen(cmd)) == strlen(cmd);
+	struct _stats* stats = _ports[fd].stats;
+	uint64_t start = stats_start(stats);
+	char cmd[COMMAND_SIZE];
+	uint32_t size = command_encode(cmd, 'W', addr, value);
+	uint32_t retries = 0;
+	while (!port_write_all(fd, cmd, size))
+		if (!port_recover(fd, &retries))
+			return false;
+	stats_record(stats, STATS_WRITE_WORD, 4, start, 0);
+	return true;
+}
+
+bool samba_write_words(int fd, uint32_t addr, const uint32_t* values, uint32_t count)
+{
+	struct _stats* stats = _ports[fd].stats;
+	uint64_t start = stats_start(stats);
+	uint64_t bytes = count * 4;
+	char cmd[MAX_WRITE_WORDS * COMMAND_SIZE];
+	while (count > 0) {
+		// encode as many 'W' commands as possible and send them at once
+		uint32_t words = MIN(count, MAX_WRITE_WORDS);
+		char* ptr = cmd;
+		for (uint32_t i = 0; i < words; i++) {
+			ptr += command_encode(ptr, 'W', addr, values[i]);
+			addr += 4;
+		}
+		uint32_t retries = 0;
+		while (!port_write_all(fd, cmd, ptr - cmd))
+			if (!port_recover(fd, &retries))
+				return false;
+		values += words;
+		count -= words;
+	}
+	stats_record(stats, STATS_WRITE_WORDS, bytes, start, 0);
+	return true;
+}
+
+bool samba_write_word_list(int fd, const struct _samba_word* words, uint32_t count)
+{
+	struct _stats* stats = _ports[fd].stats;
+	uint64_t start = stats_start(stats);
+	uint64_t bytes = count * 4;
+	char cmd[MAX_WRITE_WORDS * COMMAND_SIZE];
+	while (count > 0) {
+		uint32_t nb_words = MIN(count, MAX_WRITE_WORDS);
+		char* ptr = cmd;
+		for (uint32_t i = 0; i < nb_words; i++)
+			ptr += command_encode(ptr, 'W', words[i].addr, words[i].value);
+		uint32_t retries = 0;
+		while (!port_write_all(fd, cmd, ptr - cmd))
+			if (!port_recover(fd, &retries))
+				return false;
+		words += nb_words;
+		count -= nb_words;
+	}
+	stats_record(stats, STATS_WRITE_WORDS, bytes, start, 0);
+	return true;
+}
+
+static void port_plan_chunk(struct _samba_port* port, uint32_t bytes)
+{
+	bool is_short;
+	uint32_t packets = framing_packets(&port->framing, bytes, &is_short);
+	stats_framing(port->stats, packets, is_short);
 }
 
 bool samba_read(int fd, uint8_t* buffer, uint32_t addr, uint32_t size)
 {
-	char cmd[20];
-	while (size > 0) {
-		uint32_t count = MIN(size, 1024);
-		// workaround for bug when size is exactly 512
-		if (count == 512)
-			count = 1;
-		snprintf(cmd, sizeof(cmd), "R%08x,%08x#", addr, count);
-		if (write(fd, cmd, strlen(cmd)) != strlen(cmd))
-			return false;
-		if (read(fd, buffer, count) != count)
-			return false;
-		addr += count;
-		buffer += count;
-		size -= count;
+	struct _samba_port* port = &_ports[fd];
+	struct _stats* stats = port->stats;
+	uint64_t start = stats_start(stats);
+	uint64_t bytes = size;
+
+	// keep up to read_window 'R' commands in flight, the responses come
+	// back in order so each one is received in place in the buffer.  The
+	// window is refilled when half empty, so that commands are sent in
+	// batches rather than one transfer per response.
+	//
+	// A lost byte would shift all the following responses, so each batch
+	// ends with a marker whose answer is known (a zero entry in pending).
+	// When a response or a marker is missing or wrong, the monitor is
+	// resynchronized and the read resumes after the last good marker.  The
+	// window is halved after each failure and grows back by one chunk per
+	// good marker, so that fewer chunks are lost on a noisy line.
+	char cmd[SAMBA_MAX_READ_WINDOW * COMMAND_SIZE + READ_MARKER_SIZE];
+	uint32_t pending[READ_PENDING_SIZE];
+	uint32_t first = 0, queued = 0, in_flight = 0;
+	uint32_t requested = 0, received = 0, checked = 0;
+	uint32_t retries = 0;
+	uint32_t window = port->read_window;
+	while (checked < size) {
+		char* ptr = cmd;
+		if (in_flight <= window / 2 && requested < size) {
+			while (in_flight < window && requested < size) {
+				uint32_t count = framing_next_read(&port->framing,
+						size - requested);
+				port_plan_chunk(port, count);
+				ptr += command_encode(ptr, 'R', addr + requested, count);
+				pending[(first + queued++) % READ_PENDING_SIZE] = count;
+				in_flight++;
+				requested += count;
+			}
+			memcpy(ptr, READ_MARKER_CMD, READ_MARKER_SIZE);
+			ptr += READ_MARKER_SIZE;
+			pending[(first + queued++) % READ_PENDING_SIZE] = 0;
+		}
+
+		// in buffered mode, the chunks up to the next marker are received
+		// together, but no more than half the window so that it is
+		// refilled before running dry
+		bool ok = ptr == cmd || port_write_all(fd, cmd, ptr - cmd);
+		uint32_t count = pending[first], chunks = 1;
+		if (port->io_mode == SAMBA_IO_BUFFERED) {
+			while (count && chunks < MAX(window / 2, 1) && chunks < queued &&
+					pending[(first + chunks) % READ_PENDING_SIZE])
+				count += pending[(first + chunks++) % READ_PENDING_SIZE];
+		}
+		if (ok && count) {
+			ok = port_read_all(fd, buffer + received, count, true);
+			received += count;
+			in_flight -= chunks;
+		} else if (ok) {
+			char answer[READ_MARKER_SIZE];
+			ok = port_read_all(fd, answer, READ_MARKER_SIZE, true) &&
+				!memcmp(answer, READ_MARKER_ANSWER, READ_MARKER_SIZE);
+			if (ok) {
+				checked = received;
+				retries = 0;
+				window = MIN(window + 1, port->read_window);
+			}
+		}
+		if (!ok) {
+			if (!port_recover(fd, &retries))
+				return false;
+			first = queued = in_flight = 0;
+			requested = received = checked;
+			window = MAX(window / 2, 1);
+			continue;
+		}
+		first = (first + chunks) % READ_PENDING_SIZE;
+		queued -= chunks;
 	}
+	stats_record(stats, STATS_READ, bytes, start, 0);
 	return true;
 }
 
-bool samba_write(int fd, uint8_t* buffer, uint32_t addr, uint32_t size)
+bool samba_write(int fd, const uint8_t* buffer, uint32_t addr, uint32_t size)
 {
-	char cmd[20];
+	struct _samba_port* port = &_ports[fd];
+	struct _stats* stats = port->stats;
+	uint64_t start = stats_start(stats);
+	uint64_t bytes = size;
+	char cmd[WRITE_BATCH][COMMAND_SIZE];
+	struct iovec iov[2 * WRITE_BATCH];
 	while (size > 0) {
-		uint32_t count = MIN(size, 1024);
-		// workaround for bug when size is exactly 512
-		if (count == 512)
-			count = 1;
-		snprintf(cmd, sizeof(cmd), "S%08x,%08x#", addr, count);
-		if (write(fd, cmd, strlen(cmd)) != strlen(cmd))
-			return false;
-		if (write(fd, buffer, count) != count)
+		// each 'S' command is followed by its data, several of them are
+		// sent in one system call without copying the data
+		uint32_t nb_iov = 0, sent = 0, total = 0;
+		for (uint32_t i = 0; i < WRITE_BATCH && sent < size; i++) {
+			uint32_t count = framing_next_write(&port->framing,
+					size - sent, COMMAND_SIZE);
+			port_plan_chunk(port, COMMAND_SIZE + count);
+			iov[nb_iov].iov_base = cmd[i];
+			iov[nb_iov++].iov_len = command_encode(cmd[i], 'S', addr + sent, count);
+			iov[nb_iov].iov_base = (void*)(buffer + sent);
+			iov[nb_iov++].iov_len = count;
+			total += COMMAND_SIZE + count;
+			sent += count;
+		}
+		uint32_t retries = 0;
+		while (!port_writev_all(fd, iov, nb_iov, total))
+			if (!port_recover(fd, &retries))
+				return false;
+		addr += sent;
+		buffer += sent;
+		size -= sent;
+	}
+	stats_record(stats, STATS_WRITE, bytes, start, 0);
+	return true;
+}
+
+bool samba_go(int fd, uint32_t addr)
+{
+	struct _stats* stats = _ports[fd].stats;
+	uint64_t start = stats_start(stats);
+	char cmd[COMMAND_ADDR_SIZE];
+	uint32_t size = command_encode_addr(cmd, 'G', addr);
+	uint32_t retries = 0;
+	while (!port_write_all(fd, cmd, size))
+		if (!port_recover(fd, &retries))
 			return false;
-		buffer += count;
-		size -= count;
+	stats_record(stats, STATS_GO, 0, start, 0);
+	return true;
+}
+
+void samba_get_counters(int fd, struct _samba_counters* counters)
+{
+	*counters = _ports[fd].counters;
+}
+
+void samba_set_stats(int fd, struct _stats* stats)
+{
+	struct _samba_port* port = &_ports[fd];
+	port->stats = stats;
+	stats_set_framing(stats, port->framing.packet_size, port->framing.max_read);
+}
+
+bool samba_set_packet_size(int fd, uint32_t packet_size)
+{
+	struct _samba_port* port = &_ports[fd];
+	if (packet_size != FRAMING_FULL_SPEED_PACKET &&
+			packet_size != FRAMING_HIGH_SPEED_PACKET) {
+		fprintf(stderr, "Invalid packet size %d (%d or %d)\n", packet_size,
+				FRAMING_FULL_SPEED_PACKET, FRAMING_HIGH_SPEED_PACKET);
+		return false;
+	}
+	port->framing.packet_size = packet_size;
+	stats_set_framing(port->stats, packet_size, port->framing.max_read);
+	return true;
+}
+
+struct _stats* samba_get_stats(int fd)
+{
+	return _ports[fd].stats;
+}
+
+bool samba_set_read_window(int fd, uint32_t window)
+{
+	if (window < 1 || window > SAMBA_MAX_READ_WINDOW) {
+		fprintf(stderr, "Invalid read window %d (1 to %d)\n",
+				window, SAMBA_MAX_READ_WINDOW);
+		return false;
+	}
+	_ports[fd].read_window = window;
+	return true;
+}
+
+bool samba_set_timeout(int fd, uint32_t timeout_ms)
+{
+	if (timeout_ms < 1) {
+		fprintf(stderr, "Invalid timeout %d ms\n", timeout_ms);
+		return false;
 	}
+	_ports[fd].timeout_ms = timeout_ms;
 	return true;
 }
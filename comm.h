@@ -17,16 +17,79 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-extern int samba_open(const char* device);
+// Number of 'R' commands kept in flight by samba_read
+#define SAMBA_DEFAULT_READ_WINDOW 16
+#define SAMBA_MAX_READ_WINDOW 64
+
+// Time allowed for a response before the command is retried
+#define SAMBA_DEFAULT_TIMEOUT_MS 1000
+
+// I/O modes of the port
+enum {
+	// writes complete when sent (O_SYNC), reads block for each response
+	SAMBA_IO_SYNC = 0,
+	// writes are buffered, with explicit tcdrain barriers where the
+	// protocol needs them, and reads of whole batches are polled
+	SAMBA_IO_BUFFERED,
+};
+
+struct _stats;
+
+struct _samba_word {
+	uint32_t addr;
+	uint32_t value;
+};
+
+struct _samba_counters {
+	uint64_t syscalls;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t timeouts;
+	uint64_t retries;
+};
+
+extern int samba_open(const char* device, int io_mode);
 
 extern void samba_close(int fd);
 
+// Returns the I/O mode named "sync" or "buffered", or -1
+extern int samba_parse_io_mode(const char* name);
+
+// Wait until everything written is sent, needed before timing the execution
+// of a command in buffered mode
+extern bool samba_drain(int fd);
+
 extern bool samba_read_word(int fd, uint32_t addr, uint32_t* value);
 
 extern bool samba_write_word(int fd, uint32_t addr, uint32_t value);
 
+extern bool samba_write_words(int fd, uint32_t addr, const uint32_t* values,
+		uint32_t count);
+
+// Write words at independent addresses, the 'W' commands being sent together
+// in as few transfers as possible
+extern bool samba_write_word_list(int fd, const struct _samba_word* words,
+		uint32_t count);
+
 extern bool samba_read(int fd, uint8_t* buffer, uint32_t addr, uint32_t size);
 
-extern bool samba_write(int fd, uint8_t* buffer, uint32_t addr, uint32_t size);
+extern bool samba_set_read_window(int fd, uint32_t window);
+
+extern bool samba_set_timeout(int fd, uint32_t timeout_ms);
+
+// USB bulk packet size the transfers are aligned to, detected at open for USB
+// devices and 512 otherwise
+extern bool samba_set_packet_size(int fd, uint32_t packet_size);
+
+extern bool samba_write(int fd, const uint8_t* buffer, uint32_t addr, uint32_t size);
+
+extern bool samba_go(int fd, uint32_t addr);
+
+extern void samba_get_counters(int fd, struct _samba_counters* counters);
+
+// Statistics are recorded for all operations on the port when set
+extern void samba_set_stats(int fd, struct _stats* stats);
+
+extern struct _stats* samba_get_stats(int fd);
 
 #endif /* COMM_H_ */
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <string.h>
+#include "command.h"
+
+// "00" to "ff", the two digits of byte n are at 2 * n
+#define HEX_ROW(h) \
+	h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+	h "8" h "9" h "a" h "b" h "c" h "d" h "e" h "f"
+
+static const char hex_pairs[] =
+	HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3")
+	HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+	HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b")
+	HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+
+// same output as "%08x"
+static inline char* encode_hex(char* ptr, uint32_t value)
+{
+	memcpy(ptr, hex_pairs + 2 * (value >> 24), 2);
+	memcpy(ptr + 2, hex_pairs + 2 * ((value >> 16) & 0xff), 2);
+	memcpy(ptr + 4, hex_pairs + 2 * ((value >> 8) & 0xff), 2);
+	memcpy(ptr + 6, hex_pairs + 2 * (value & 0xff), 2);
+	return ptr + 8;
+}
+
+uint32_t command_encode(char* buffer, char cmd, uint32_t addr, uint32_t arg)
+{
+	char* ptr = buffer;
+	*ptr++ = cmd;
+	ptr = encode_hex(ptr, addr);
+	*ptr++ = ',';
+	ptr = encode_hex(ptr, arg);
+	*ptr++ = '#';
+	return ptr - buffer;
+}
+
+uint32_t command_encode_query(char* buffer, char cmd, uint32_t addr)
+{
+	char* ptr = buffer;
+	*ptr++ = cmd;
+	ptr = encode_hex(ptr, addr);
+	*ptr++ = ',';
+	*ptr++ = '#';
+	return ptr - buffer;
+}
+
+uint32_t command_encode_addr(char* buffer, char cmd, uint32_t addr)
+{
+	char* ptr = buffer;
+	*ptr++ = cmd;
+	ptr = encode_hex(ptr, addr);
+	*ptr++ = '#';
+	return ptr - buffer;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef COMMAND_H_
+#define COMMAND_H_
+
+#include <stdint.h>
+
+// Encoding of the monitor commands into buffers owned by the caller, using a
+// table of hexadecimal digit pairs rather than the formatting functions.
+// The commands are not NUL-terminated.
+
+// "<cmd><addr>,<arg>#", as 'W', 'R' and 'S'
+#define COMMAND_SIZE 19
+
+// "<cmd><addr>,#", as 'w'
+#define COMMAND_QUERY_SIZE 11
+
+// "<cmd><addr>#", as 'G'
+#define COMMAND_ADDR_SIZE 10
+
+// Each function returns the size of the encoded command
+extern uint32_t command_encode(char* buffer, char cmd, uint32_t addr, uint32_t arg);
+
+extern uint32_t command_encode_query(char* buffer, char cmd, uint32_t addr);
+
+extern uint32_t command_encode_addr(char* buffer, char cmd, uint32_t addr);
+
+#endif /* COMMAND_H_ */
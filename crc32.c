@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+#include "crc32.h"
+
+#define CRC32_POLY 0xedb88320
+
+static uint32_t _table[256];
+static pthread_once_t _table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int bit = 0; bit < 8; bit++)
+			c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		_table[i] = c;
+	}
+}
+
+uint32_t crc32(const uint8_t* buffer, uint32_t size)
+{
+	pthread_once(&_table_once, crc32_init_table);
+
+	uint32_t crc = 0xffffffff;
+	for (uint32_t i = 0; i < size; i++)
+		crc = _table[(crc ^ buffer[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "daemon.h"
+
+// requests and replies are single messages
+#define DAEMON_SOCKET_TYPE SOCK_SEQPACKET
+
+#define MAX_REPLY_SIZE 64
+
+static bool socket_address(const char* path, struct sockaddr_un* addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long\n", path);
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+int daemon_listen(const char* path)
+{
+	struct sockaddr_un addr;
+	if (!socket_address(path, &addr))
+		return -1;
+
+	int fd = socket(AF_UNIX, DAEMON_SOCKET_TYPE | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Could not create socket");
+		return -1;
+	}
+
+	// a socket left by a daemon that did not exit cleanly is removed, but
+	// not the socket of a running daemon
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+			fprintf(stderr, "A daemon is already listening on '%s'\n", path);
+			close(fd);
+			return -1;
+		}
+		unlink(path);
+	}
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+		fprintf(stderr, "Could not listen on '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void close_request(struct _daemon_request* request)
+{
+	for (int i = 0; i < 3; i++) {
+		if (request->fds[i] >= 0)
+			close(request->fds[i]);
+		request->fds[i] = -1;
+	}
+	if (request->client >= 0)
+		close(request->client);
+	request->client = -1;
+}
+
+bool daemon_receive(int server, struct _daemon_request* request)
+{
+	memset(request, 0, sizeof(*request));
+	request->fds[0] = request->fds[1] = request->fds[2] = -1;
+	request->client = accept(server, NULL, NULL);
+	if (request->client < 0)
+		return false;
+	fcntl(request->client, F_SETFD, FD_CLOEXEC);
+
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct iovec iov = {
+		.iov_base = request->buffer,
+		.iov_len = sizeof(request->buffer) - 1,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.data,
+		.msg_controllen = sizeof(control.data),
+	};
+	ssize_t size = recvmsg(request->client, &msg, MSG_CMSG_CLOEXEC);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+			cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+		memcpy(request->fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+	if (size <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+			request->fds[0] < 0 || request->fds[1] < 0 || request->fds[2] < 0) {
+		fprintf(stderr, "Invalid request received\n");
+		close_request(request);
+		return false;
+	}
+
+	// the request is the working directory followed by the arguments,
+	// all NUL terminated
+	request->buffer[size] = '\0';
+	request->cwd = request->buffer;
+	char* end = request->buffer + size;
+	for (char* arg = request->buffer + strlen(request->cwd) + 1; arg < end;
+			arg += strlen(arg) + 1) {
+		if (request->argc == DAEMON_MAX_ARGS) {
+			fprintf(stderr, "Invalid request received\n");
+			close_request(request);
+			return false;
+		}
+		request->argv[request->argc++] = arg;
+	}
+	request->argv[request->argc] = NULL;
+	return true;
+}
+
+void daemon_reply(struct _daemon_request* request, bool ok, double elapsed)
+{
+	char reply[MAX_REPLY_SIZE];
+	int size = snprintf(reply, sizeof(reply), "%s %.3f", ok ? "ok" : "failed", elapsed);
+	if (request->client >= 0)
+		send(request->client, reply, size, MSG_NOSIGNAL);
+	close_request(request);
+}
+
+int daemon_client(const char* path, int argc, char** argv, FILE* out)
+{
+	struct sockaddr_un addr;
+	if (!socket_address(path, &addr))
+		return -1;
+
+	static char buffer[DAEMON_MAX_REQUEST_SIZE];
+	if (!getcwd(buffer, PATH_MAX)) {
+		perror("Could not get the current directory");
+		return -1;
+	}
+	size_t size = strlen(buffer) + 1;
+	for (int i = 0; i < argc; i++) {
+		size_t length = strlen(argv[i]) + 1;
+		if (size + length >= sizeof(buffer)) {
+			fprintf(stderr, "Error: command line too long\n");
+			return -1;
+		}
+		memcpy(buffer + size, argv[i], length);
+		size += length;
+	}
+
+	int fd = socket(AF_UNIX, DAEMON_SOCKET_TYPE, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Could not connect to the daemon on '%s': %s\n",
+				path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	// the daemon writes the job output to our own standard output and
+	// error
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(sizeof(fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = {
+		.iov_base = buffer,
+		.iov_len = size,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.data,
+		.msg_controllen = sizeof(control.data),
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	fflush(stdout);
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != size) {
+		fprintf(stderr, "Could not send the request to the daemon\n");
+		close(fd);
+		return -1;
+	}
+
+	char reply[MAX_REPLY_SIZE];
+	ssize_t count;
+	do {
+		count = recv(fd, reply, sizeof(reply) - 1, 0);
+	} while (count < 0 && errno == EINTR);
+	close(fd);
+	if (count <= 0) {
+		fprintf(stderr, "Connection to the daemon lost\n");
+		return -1;
+	}
+	reply[count] = '\0';
+
+	double elapsed = 0;
+	char status[16];
+	if (sscanf(reply, "%15s %lf", status, &elapsed) != 2) {
+		fprintf(stderr, "Invalid reply from the daemon\n");
+		return -1;
+	}
+	if (strcmp(status, "ok")) {
+		fprintf(stderr, "Operation failed after %.3fs\n", elapsed);
+		return -1;
+	}
+	fprintf(out, "Done in %.3fs\n", elapsed);
+	return 0;
+}
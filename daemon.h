@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define DAEMON_MAX_REQUEST_SIZE 16384
+#define DAEMON_MAX_ARGS 64
+
+// Job request received from a client over the daemon socket: the working
+// directory and the command line of the client, with its standard input,
+// output and error, so that the job output goes straight to the client.
+struct _daemon_request {
+	int client;
+	int fds[3];
+	const char* cwd;
+	int argc;
+	char* argv[DAEMON_MAX_ARGS + 1];
+	char buffer[DAEMON_MAX_REQUEST_SIZE];
+};
+
+extern int daemon_listen(const char* path);
+
+extern bool daemon_receive(int server, struct _daemon_request* request);
+
+// Send the result of the job and close the request
+extern void daemon_reply(struct _daemon_request* request, bool ok, double elapsed);
+
+// Send a command line to the daemon and wait for its result, printed to out.
+// Returns the exit code of the client.
+extern int daemon_client(const char* path, int argc, char** argv, FILE* out);
+
+#endif /* DAEMON_H_ */
@@ -11,72 +11,174 @@
  * more details.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "chipid.h"
 #include "comm.h"
 #include "eefc.h"
+#include "stats.h"
 #include "utils.h"
 
-#define PAGE_SIZE 512
-
-#define EEFC_FMR  0x00000000
-#define EEFC_FCR  0x00000004
-#define EEFC_FSR  0x00000008
-#define EEFC_FRR  0x0000000c
-
-#define EEFC_FCR_FKEY      (0x5a << 24)
-#define EEFC_FCR_FCMD_GETD 0x00 // Get Flash descriptor
-#define EEFC_FCR_FCMD_WP   0x01 // Write page
-#define EEFC_FCR_FCMD_WPL  0x02 // Write page and lock
-#define EEFC_FCR_FCMD_EWP  0x03 // Erase page and write page
-#define EEFC_FCR_FCMD_EWPL 0x04 // Erase page and write page then lock
-#define EEFC_FCR_FCMD_EA   0x05 // Erase all
-#define EEFC_FCR_FCMD_EPA  0x07 // Erase pages
-#define EEFC_FCR_FCMD_SLB  0x08 // Set lock bit
-#define EEFC_FCR_FCMD_CLB  0x09 // Clear lock bit
-#define EEFC_FCR_FCMD_GLB  0x0A // Get lock bit
-#define EEFC_FCR_FCMD_SGPB 0x0B // Set GPNVM bit
-#define EEFC_FCR_FCMD_CGPB 0x0C // Clear GPNVM bit
-#define EEFC_FCR_FCMD_GGPB 0x0D // Get GPNVM bit
-
-#define EEFC_FSR_FRDY   (1 << 0)
-#define EEFC_FSR_CMDE   (1 << 1)
-#define EEFC_FSR_FLOCKE (1 << 2)
-#define EEFC_FSR_FLERR  (1 << 3)
-
-static bool eefc_wait_ready(int fd, const struct _chip* chip, uint32_t* status)
+// Typical duration of the flash controller commands, used to decide when to
+// poll FSR.  The poll counts reported by --stats show how well they match.
+#define EEFC_WP_US        1500 // WP, WPL, EWP and EWPL (plus erase time)
+#define EEFC_ERASE_US     2000 // EPA, per erased page
+#define EEFC_ERASE_ALL_US 4500 // EA, per KB of flash
+#define EEFC_BIT_US       500  // SLB, CLB, SGPB and CGPB
+
+// Minimum delay between two polls and timeout added to the expected duration
+#define EEFC_MIN_POLL_US  20
+#define EEFC_TIMEOUT_US   1000000
+
+// Reading FSR clears its error flags and each read of FRR moves to the next
+// result, so when the transport had to retry one of these reads, something
+// may have been lost: the command is then sent again, up to EEFC_MAX_RETRIES
+// times.  WP is safe to repeat as it can only clear bits.  A pass over the
+// results of a command fails if any of its reads is retried, so commands with
+// many results (GETD reads about 140 words) get one more attempt per word.
+#define EEFC_MAX_RETRIES  8
+
+static uint32_t eefc_expected_duration(const struct _chip* chip, uint8_t cmd,
+		uint16_t arg)
 {
+	switch (cmd) {
+		case EEFC_FCR_FCMD_WP:
+		case EEFC_FCR_FCMD_WPL:
+			return EEFC_WP_US;
+		case EEFC_FCR_FCMD_EWP:
+		case EEFC_FCR_FCMD_EWPL:
+			return EEFC_WP_US + EEFC_ERASE_US;
+		case EEFC_FCR_FCMD_EPA:
+			return EEFC_ERASE_US * (4 << (arg & 3));
+		case EEFC_FCR_FCMD_EA:
+			return EEFC_ERASE_ALL_US * chip->flash_size;
+		case EEFC_FCR_FCMD_SLB:
+		case EEFC_FCR_FCMD_CLB:
+		case EEFC_FCR_FCMD_SGPB:
+		case EEFC_FCR_FCMD_CGPB:
+			return EEFC_BIT_US;
+		default:
+			// GETD, GLB and GGPB complete immediately
+			return 0;
+	}
+}
+
+static void sleep_us(uint32_t us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Wait for the end of a command expected to last about expected_us: sleep for
+// three quarters of it, then poll FSR with an exponential backoff capped to a
+// quarter of the expected duration, so that the end of the command is detected
+// with a few polls and little delay.
+static bool eefc_wait_ready(int fd, const struct _chip* chip, uint32_t expected_us,
+		uint32_t* status, uint32_t* polls)
+{
+	uint64_t deadline = now_us() + EEFC_TIMEOUT_US + 4 * (uint64_t)expected_us;
+	uint32_t interval = MAX(expected_us / 16, EEFC_MIN_POLL_US);
+	uint32_t max_interval = MAX(expected_us / 4, EEFC_MIN_POLL_US);
 	uint32_t value;
-	do {
+
+	*polls = 0;
+	if (expected_us)
+		sleep_us(expected_us / 4 * 3);
+	for (;;) {
 		if (!samba_read_word(fd, chip->eefc_base + EEFC_FSR, &value))
 			return false;
-	} while (!(value & EEFC_FSR_FRDY));
+		(*polls)++;
+		if (value & EEFC_FSR_FRDY)
+			break;
+
+		if (now_us() >= deadline) {
+			fprintf(stderr, "Flash controller timeout after %d polls\n", *polls);
+			return false;
+		}
+		sleep_us(interval);
+		interval = MIN(interval * 2, max_interval);
+	}
 	if (status)
 		*status = value;
 	return true;
 }
 
+static uint64_t transport_retries(int fd)
+{
+	struct _samba_counters counters;
+	samba_get_counters(fd, &counters);
+	return counters.retries;
+}
+
+// Fails when the read had to be retried, as a result may have been skipped
 static bool eefc_read_result(int fd, const struct _chip* chip, uint32_t* result)
 {
-	return samba_read_word(fd, chip->eefc_base + EEFC_FRR, result);
+	uint64_t retries = transport_retries(fd);
+	return samba_read_word(fd, chip->eefc_base + EEFC_FRR, result) &&
+		transport_retries(fd) == retries;
 }
 
-static bool eefc_send_command(int fd, const struct _chip* chip, uint8_t cmd,
-		uint16_t arg, uint32_t* status)
+// Called when reading the nb_results results of a command failed, returns true
+// when the command should be sent again because a read was retried
+static bool eefc_results_lost(int fd, uint64_t retries, int attempt,
+		uint32_t nb_results)
 {
-	if (!samba_write_word(fd, chip->eefc_base + EEFC_FCR,
-				EEFC_FCR_FKEY | (arg << 8) | cmd))
+	if (transport_retries(fd) == retries)
 		return false;
+	if (attempt < EEFC_MAX_RETRIES + nb_results)
+		return true;
+	fprintf(stderr, "Flash controller results lost after %d attempts\n", attempt + 1);
+	return false;
+}
 
-	if (!eefc_wait_ready(fd, chip, status))
-		return false;
+static bool eefc_send_command(int fd, const struct _chip* chip, uint8_t cmd,
+		uint16_t arg, uint32_t* status)
+{
+	struct _stats* stats = samba_get_stats(fd);
+	uint64_t start = stats_start(stats);
+
+	uint32_t expected_us = eefc_expected_duration(chip, cmd, arg);
+	uint32_t polls;
+	for (int attempt = 0; ; attempt++) {
+		uint64_t retries = transport_retries(fd);
+		if (!samba_write_word(fd, chip->eefc_base + EEFC_FCR,
+					EEFC_FCR_FKEY | (arg << 8) | cmd))
+			return false;
+		// the command must have reached the device before its expected
+		// duration is waited for
+		if (expected_us && !samba_drain(fd))
+			return false;
+		if (!eefc_wait_ready(fd, chip, expected_us, status, &polls))
+			return false;
+		if (transport_retries(fd) == retries)
+			break;
+		if (attempt == EEFC_MAX_RETRIES) {
+			fprintf(stderr, "Flash controller status lost after %d attempts\n",
+					attempt + 1);
+			return false;
+		}
+	}
 
+	stats_record(stats, STATS_EEFC + cmd, 0, start, polls);
 	return true;
 }
 
-bool eefc_read_flash_info(int fd, const struct _chip* chip,
-		struct _eefc_locks* locks)
+// nb_results is set to the size of the answer once known
+static bool read_flash_info(int fd, const struct _chip* chip,
+		struct _eefc_locks* locks, uint32_t* nb_results)
 {
 	// send GETD command
 	if (!eefc_send_command(fd, chip, EEFC_FCR_FCMD_GETD, 0, NULL))
@@ -101,9 +203,9 @@ bool eefc_read_flash_info(int fd, const struct _chip* chip,
 	uint32_t page_size;
 	if (!eefc_read_result(fd, chip, &page_size))
 		return false;
-	if (page_size != PAGE_SIZE) {
+	if (page_size != EEFC_PAGE_SIZE) {
 		fprintf(stderr, "Invalid page size: detected %d bytes but expected %d bytes\n",
-				page_size, PAGE_SIZE);
+				page_size, EEFC_PAGE_SIZE);
 		return false;
 	}
 
@@ -111,6 +213,9 @@ bool eefc_read_flash_info(int fd, const struct _chip* chip,
 	uint32_t nb_planes, plane_size;
 	if (!eefc_read_result(fd, chip, &nb_planes))
 		return false;
+	if (nb_planes > MAX_EEFC_LOCKS)
+		return false;
+	*nb_results = MAX(*nb_results, 5 + nb_planes);
 	for (int i = 0; i < nb_planes; i++)
 		if (!eefc_read_result(fd, chip, &plane_size))
 			return false;
@@ -120,67 +225,136 @@ bool eefc_read_flash_info(int fd, const struct _chip* chip,
 		return false;
 	if (locks->count > MAX_EEFC_LOCKS)
 		return false;
-	for (int i = 0; i < locks->count; i++)
+	*nb_results = MAX(*nb_results, 6 + nb_planes + locks->count);
+	locks->offset[0] = 0;
+	for (int i = 0; i < locks->count; i++) {
 		if (!eefc_read_result(fd, chip, &locks->size[i]))
 			return false;
+		locks->offset[i + 1] = locks->offset[i] + locks->size[i];
+	}
+	locks->bits_valid = false;
 
 	return true;
 }
 
-static bool set_page_lock(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t lock, bool enable)
+bool eefc_read_flash_info(int fd, const struct _chip* chip,
+		struct _eefc_locks* locks)
+{
+	uint32_t nb_results = 0;
+	for (int attempt = 0; ; attempt++) {
+		uint64_t retries = transport_retries(fd);
+		if (read_flash_info(fd, chip, locks, &nb_results))
+			return true;
+		if (!eefc_results_lost(fd, retries, attempt, nb_results))
+			return false;
+	}
+}
+
+static bool read_lock_bits(int fd, const struct _chip* chip,
+		struct _eefc_locks* locks)
 {
-	if (lock > locks->count)
+	if (!eefc_send_command(fd, chip, EEFC_FCR_FCMD_GLB, 0, NULL))
 		return false;
+	for (uint32_t i = 0; i < (locks->count + 31) / 32; i++)
+		if (!eefc_read_result(fd, chip, &locks->bits[i]))
+			return false;
+	return true;
+}
 
-	uint8_t cmd = enable ? EEFC_FCR_FCMD_SLB : EEFC_FCR_FCMD_CLB;
-	return eefc_send_command(fd, chip, cmd, lock, NULL);
+bool eefc_read_locks(int fd, const struct _chip* chip,
+		struct _eefc_locks* locks)
+{
+	if (locks->bits_valid)
+		return true;
+
+	for (int attempt = 0; ; attempt++) {
+		uint64_t retries = transport_retries(fd);
+		if (read_lock_bits(fd, chip, locks)) {
+			locks->bits_valid = true;
+			return true;
+		}
+		if (!eefc_results_lost(fd, retries, attempt, (locks->count + 31) / 32))
+			return false;
+	}
 }
 
-bool eefc_lock_page(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t lock)
+uint32_t eefc_lock_region(const struct _eefc_locks* locks, uint32_t offset)
 {
-	return set_page_lock(fd, chip, locks, lock, true);
+	// last region starting at or before the offset
+	uint32_t low = 0, high = locks->count;
+	while (high - low > 1) {
+		uint32_t mid = (low + high) / 2;
+		if (locks->offset[mid] <= offset)
+			low = mid;
+		else
+			high = mid;
+	}
+	return low;
 }
 
-bool eefc_unlock_page(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t lock)
+bool eefc_is_locked(const struct _eefc_locks* locks, uint32_t lock)
 {
-	return set_page_lock(fd, chip, locks, lock, false);
+	return (locks->bits[lock / 32] >> (lock % 32)) & 1;
+}
+
+static bool set_region_lock(int fd, const struct _chip* chip,
+		struct _eefc_locks* locks, uint32_t lock, bool enable)
+{
+	if (lock >= locks->count)
+		return false;
+
+	// the command argument is a page of the region
+	uint8_t cmd = enable ? EEFC_FCR_FCMD_SLB : EEFC_FCR_FCMD_CLB;
+	if (!eefc_send_command(fd, chip, cmd, locks->offset[lock] / EEFC_PAGE_SIZE, NULL))
+		return false;
+
+	if (enable)
+		locks->bits[lock / 32] |= 1u << (lock % 32);
+	else
+		locks->bits[lock / 32] &= ~(1u << (lock % 32));
+	return true;
 }
 
 static bool set_lock(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t addr, uint32_t size,
+		struct _eefc_locks* locks, uint32_t addr, uint32_t size,
 		bool enable)
 {
-	if (addr + size > chip->flash_size * 1024)
+	if (addr + size > chip->flash_size * 1024 || !locks->count)
 		return false;
+	if (!size)
+		return true;
 
-	uint32_t addr_end = addr + size;
+	if (!eefc_read_locks(fd, chip, locks))
+		return false;
 
-	uint32_t offset = 0;
-	for (int lock = 0; lock < locks->count; lock++) {
-		uint32_t next_offset = offset + locks->size[lock];
-		if (addr >= offset && addr < next_offset) {
-			if (!set_page_lock(fd, chip, locks, lock, enable))
-				return false;
-			addr = next_offset;
-			if (addr >= addr_end)
-				return true;
-		}
-		offset = next_offset;
-	}
-	return false;
+	uint32_t last = eefc_lock_region(locks, addr + size - 1);
+	for (uint32_t lock = eefc_lock_region(locks, addr); lock <= last; lock++)
+		if (eefc_is_locked(locks, lock) != enable &&
+				!set_region_lock(fd, chip, locks, lock, enable))
+			return false;
+	return true;
+}
+
+bool eefc_lock_page(int fd, const struct _chip* chip,
+		struct _eefc_locks* locks, uint32_t page)
+{
+	return set_lock(fd, chip, locks, page * EEFC_PAGE_SIZE, EEFC_PAGE_SIZE, true);
+}
+
+bool eefc_unlock_page(int fd, const struct _chip* chip,
+		struct _eefc_locks* locks, uint32_t page)
+{
+	return set_lock(fd, chip, locks, page * EEFC_PAGE_SIZE, EEFC_PAGE_SIZE, false);
 }
 
 bool eefc_lock(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t addr, uint32_t size)
+		struct _eefc_locks* locks, uint32_t addr, uint32_t size)
 {
 	return set_lock(fd, chip, locks, addr, size, true);
 }
 
 bool eefc_unlock(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t addr, uint32_t size)
+		struct _eefc_locks* locks, uint32_t addr, uint32_t size)
 {
 	return set_lock(fd, chip, locks, addr, size, false);
 }
@@ -202,22 +376,37 @@ bool eefc_erase_all(int fd, const struct _chip* chip)
 	return true;
 }
 
-bool eefc_erase_16pages(int fd, const struct _chip* chip,
-		uint32_t first_page)
+bool eefc_erase_pages(int fd, const struct _chip* chip,
+		uint32_t first_page, uint32_t nb_pages)
 {
 	uint32_t arg;
 
-	if (first_page & 15) {
-		fprintf(stderr, "Erase pages error: first page must be multiple of 16\n");
+	switch (nb_pages) {
+		case 4: arg = 0; break;
+		case 8: arg = 1; break;
+		case 16: arg = 2; break;
+		case 32: arg = 3; break;
+		default:
+			fprintf(stderr, "Erase pages error: cannot erase %d pages at once\n", nb_pages);
+			return false;
+	}
+
+	if (first_page & (nb_pages - 1)) {
+		fprintf(stderr, "Erase pages error: first page must be multiple of %d\n", nb_pages);
 		return false;
 	}
 
-	arg = (first_page & ~15) | 2;
+	arg |= first_page;
 
 	// send erase pages command to flash controller
 	uint32_t status;
 	if (!eefc_send_command(fd, chip, EEFC_FCR_FCMD_EPA, arg, &status))
 		return false;
+	if (status & EEFC_FSR_CMDE) {
+		fprintf(stderr, "Erase pages error: cannot erase %d pages at page %d\n",
+				nb_pages, first_page);
+		return false;
+	}
 	if (status & EEFC_FSR_FLOCKE) {
 		fprintf(stderr, "Erase pages error: at least one page is locked\n");
 		return false;
@@ -230,6 +419,91 @@ bool eefc_erase_16pages(int fd, const struct _chip* chip,
 	return true;
 }
 
+bool eefc_erase_16pages(int fd, const struct _chip* chip,
+		uint32_t first_page)
+{
+	return eefc_erase_pages(fd, chip, first_page, 16);
+}
+
+bool eefc_plan_erase_pages(const struct _chip* chip, uint32_t first_page,
+		uint32_t nb_pages, struct _eefc_erase_plan* plan)
+{
+	static const uint32_t small_blocks[] = { 16, 8, 4 };
+	static const uint32_t large_blocks[] = { 32, 16 };
+	uint32_t small_pages = EEFC_SMALL_SECTOR_PAGES * EEFC_NB_SMALL_SECTORS;
+	uint32_t flash_pages = chip->flash_size * 1024 / EEFC_PAGE_SIZE;
+
+	if (first_page + nb_pages > flash_pages)
+		return false;
+
+	uint32_t page = first_page;
+	uint32_t last_page = first_page + nb_pages;
+
+	// skip pages already covered by the plan
+	if (plan->count > 0) {
+		const struct _eefc_erase_block* block = &plan->blocks[plan->count - 1];
+		page = MAX(page, block->first_page + block->nb_pages);
+	}
+
+	while (page < last_page) {
+		bool small = page < small_pages;
+		const uint32_t* blocks = small ? small_blocks : large_blocks;
+		uint32_t nb_blocks = small ? ARRAY_SIZE(small_blocks) : ARRAY_SIZE(large_blocks);
+		uint32_t granularity = blocks[nb_blocks - 1];
+
+		// the area to erase is extended to the erase granularity of
+		// the sector, then covered with the largest aligned blocks
+		uint32_t start = page & ~(granularity - 1);
+		uint32_t end = (last_page + granularity - 1) & ~(granularity - 1);
+		end = MIN(end, small ? small_pages : flash_pages);
+
+		uint32_t count = granularity;
+		for (uint32_t i = 0; i < nb_blocks; i++) {
+			if (!(start & (blocks[i] - 1)) && start + blocks[i] <= end) {
+				count = blocks[i];
+				break;
+			}
+		}
+
+		if (plan->count == MAX_EEFC_ERASE_BLOCKS)
+			return false;
+		if (plan->count == 0)
+			plan->first_page = start;
+		plan->blocks[plan->count].first_page = start;
+		plan->blocks[plan->count].nb_pages = count;
+		plan->count++;
+		plan->nb_pages += count;
+		page = start + count;
+	}
+
+	return true;
+}
+
+bool eefc_plan_erase(const struct _chip* chip, uint32_t addr,
+		uint32_t size, struct _eefc_erase_plan* plan)
+{
+	if (addr + size > chip->flash_size * 1024)
+		return false;
+
+	uint32_t first_page = addr / EEFC_PAGE_SIZE;
+	uint32_t last_page = (addr + size + EEFC_PAGE_SIZE - 1) / EEFC_PAGE_SIZE;
+
+	plan->first_page = 0;
+	plan->nb_pages = 0;
+	plan->count = 0;
+	return eefc_plan_erase_pages(chip, first_page, last_page - first_page, plan);
+}
+
+bool eefc_erase_plan(int fd, const struct _chip* chip,
+		const struct _eefc_erase_plan* plan)
+{
+	for (uint32_t i = 0; i < plan->count; i++)
+		if (!eefc_erase_pages(fd, chip, plan->blocks[i].first_page,
+					plan->blocks[i].nb_pages))
+			return false;
+	return true;
+}
+
 bool eefc_read(int fd, const struct _chip* chip,
 		uint8_t* buffer, uint32_t addr, uint32_t size)
 {
@@ -240,23 +514,33 @@ bool eefc_read(int fd, const struct _chip* chip,
 }
 
 bool eefc_write(int fd, const struct _chip* chip,
-		uint8_t* buffer, uint32_t addr, uint32_t size)
+		const uint8_t* buffer, uint32_t addr, uint32_t size)
 {
 	if (addr + size > chip->flash_size * 1024)
 		return false;
 
+	uint32_t words[EEFC_PAGE_SIZE / 4];
 	while (size > 0) {
-		uint16_t page = addr / PAGE_SIZE;
-		uint32_t head = addr & (PAGE_SIZE - 1);
-		uint32_t count = MIN(size, PAGE_SIZE - head);
+		uint16_t page = addr / EEFC_PAGE_SIZE;
+		uint32_t head = addr & (EEFC_PAGE_SIZE - 1);
+		uint32_t count = MIN(size, EEFC_PAGE_SIZE - head);
 
 		// write to latch buffer
 		// we cannot use the SAM-BA Monitor send command because it
-		// does byte writes and the flash controller needs word writes
-		uint32_t* wbuffer = (uint32_t*)buffer;
-		for (uint32_t i = 0; i < (count + 3) / 4; i++)
-			if (!samba_write_word(fd, chip->flash_addr + addr + i * 4, wbuffer[i]))
-				return false;
+		// does byte writes and the flash controller needs word writes,
+		// so send all the word writes for the page in a single transfer
+		// (unaligned data and partial words are copied and padded with
+		// 0xff, which leaves the flash content unchanged)
+		const uint32_t* wbuffer = (const uint32_t*)buffer;
+		if (((uintptr_t)buffer & 3) || (addr & 3) || (count & 3)) {
+			uint32_t head_bytes = addr & 3;
+			memset(words, 0xff, sizeof(words));
+			memcpy((uint8_t*)words + head_bytes, buffer, count);
+			wbuffer = words;
+		}
+		uint32_t nb_words = ((addr & 3) + count + 3) / 4;
+		if (!samba_write_words(fd, chip->flash_addr + (addr & ~3), wbuffer, nb_words))
+			return false;
 
 		// send write command to flash controller
 		uint32_t status;
@@ -279,26 +563,51 @@ bool eefc_write(int fd, const struct _chip* chip,
 	return true;
 }
 
-extern bool eefc_get_gpnvm(int fd, const struct _chip* chip,
-		uint8_t gpnvm, bool* value)
+bool eefc_read_unique_id(int fd, const struct _chip* chip,
+		uint8_t id[EEFC_UNIQUE_ID_SIZE])
 {
-	if (gpnvm >= chip->gpnvm) {
-		fprintf(stderr, "Get GPNVM%d error: invalid GPNVM\n", gpnvm);
+	// the unique identifier replaces the start of the flash until SPUI, and
+	// FRDY stays low meanwhile, so STUI is not waited for
+	if (!samba_write_word(fd, chip->eefc_base + EEFC_FCR,
+				EEFC_FCR_FKEY | EEFC_FCR_FCMD_STUI))
+		return false;
+	if (!samba_read(fd, id, chip->flash_addr, EEFC_UNIQUE_ID_SIZE))
 		return false;
-	}
 
-	// send Get GPNVM command to flash controller
 	uint32_t status;
-	if (!eefc_send_command(fd, chip, EEFC_FCR_FCMD_GGPB, gpnvm, &status))
+	if (!eefc_send_command(fd, chip, EEFC_FCR_FCMD_SPUI, 0, &status))
 		return false;
 	if (status & EEFC_FSR_CMDE) {
-		fprintf(stderr, "Get GPNVM%d error: command error\n", gpnvm);
+		fprintf(stderr, "Read unique identifier error: command error\n");
 		return false;
 	}
+	return true;
+}
 
-	uint32_t bits;
-	if (!eefc_read_result(fd, chip, &bits))
+extern bool eefc_get_gpnvm(int fd, const struct _chip* chip,
+		uint8_t gpnvm, bool* value)
+{
+	if (gpnvm >= chip->gpnvm) {
+		fprintf(stderr, "Get GPNVM%d error: invalid GPNVM\n", gpnvm);
 		return false;
+	}
+
+	// send Get GPNVM command to flash controller
+	uint32_t bits;
+	for (int attempt = 0; ; attempt++) {
+		uint64_t retries = transport_retries(fd);
+		uint32_t status;
+		if (!eefc_send_command(fd, chip, EEFC_FCR_FCMD_GGPB, gpnvm, &status))
+			return false;
+		if (status & EEFC_FSR_CMDE) {
+			fprintf(stderr, "Get GPNVM%d error: command error\n", gpnvm);
+			return false;
+		}
+		if (eefc_read_result(fd, chip, &bits))
+			break;
+		if (!eefc_results_lost(fd, retries, attempt, 1))
+			return false;
+	}
 	*value = bits & (1 << gpnvm);
 
 	return true;
@@ -17,40 +17,126 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define EEFC_PAGE_SIZE 512
+
+// erase pages granularity: 4, 8 or 16 pages in the small sectors at the
+// start of the flash, 16 or 32 pages elsewhere
+#define EEFC_SMALL_SECTOR_PAGES 16
+#define EEFC_NB_SMALL_SECTORS 2
+
+// Largest block erased by EPA, erase blocks never cross a boundary of this size
+#define EEFC_MAX_ERASE_PAGES 32
+
 #define MAX_EEFC_LOCKS 256
 
+#define MAX_EEFC_ERASE_BLOCKS 256
+
+#define EEFC_FMR  0x00000000
+#define EEFC_FCR  0x00000004
+#define EEFC_FSR  0x00000008
+#define EEFC_FRR  0x0000000c
+
+#define EEFC_FCR_FKEY      (0x5a << 24)
+#define EEFC_FCR_FCMD_GETD 0x00 // Get Flash descriptor
+#define EEFC_FCR_FCMD_WP   0x01 // Write page
+#define EEFC_FCR_FCMD_WPL  0x02 // Write page and lock
+#define EEFC_FCR_FCMD_EWP  0x03 // Erase page and write page
+#define EEFC_FCR_FCMD_EWPL 0x04 // Erase page and write page then lock
+#define EEFC_FCR_FCMD_EA   0x05 // Erase all
+#define EEFC_FCR_FCMD_EPA  0x07 // Erase pages
+#define EEFC_FCR_FCMD_SLB  0x08 // Set lock bit
+#define EEFC_FCR_FCMD_CLB  0x09 // Clear lock bit
+#define EEFC_FCR_FCMD_GLB  0x0A // Get lock bit
+#define EEFC_FCR_FCMD_SGPB 0x0B // Set GPNVM bit
+#define EEFC_FCR_FCMD_CGPB 0x0C // Clear GPNVM bit
+#define EEFC_FCR_FCMD_GGPB 0x0D // Get GPNVM bit
+#define EEFC_FCR_FCMD_STUI 0x0E // Start read unique identifier
+#define EEFC_FCR_FCMD_SPUI 0x0F // Stop read unique identifier
+
+#define EEFC_UNIQUE_ID_SIZE 16
+
+#define EEFC_FSR_FRDY   (1 << 0)
+#define EEFC_FSR_CMDE   (1 << 1)
+#define EEFC_FSR_FLOCKE (1 << 2)
+#define EEFC_FSR_FLERR  (1 << 3)
+
 struct _chip;
 
+// Lock regions, with the offset of each region (offset[count] is the flash
+// size) and the lock bitmap, read once with GLB and then kept up to date
 struct _eefc_locks {
 	uint32_t count;
 	uint32_t size[MAX_EEFC_LOCKS];
+	uint32_t offset[MAX_EEFC_LOCKS + 1];
+	uint32_t bits[MAX_EEFC_LOCKS / 32];
+	bool bits_valid;
+};
+
+struct _eefc_erase_block {
+	uint32_t first_page;
+	uint32_t nb_pages;
+};
+
+struct _eefc_erase_plan {
+	uint32_t first_page;
+	uint32_t nb_pages;
+	uint32_t count;
+	struct _eefc_erase_block blocks[MAX_EEFC_ERASE_BLOCKS];
 };
 
 extern bool eefc_read_flash_info(int fd, const struct _chip* chip,
 		struct _eefc_locks* locks);
 
+// Read the lock bitmap, if not read yet
+extern bool eefc_read_locks(int fd, const struct _chip* chip,
+		struct _eefc_locks* locks);
+
+// Index of the lock region holding the flash offset
+extern uint32_t eefc_lock_region(const struct _eefc_locks* locks, uint32_t offset);
+
+extern bool eefc_is_locked(const struct _eefc_locks* locks, uint32_t lock);
+
+// Lock or unlock the region holding the page
 extern bool eefc_lock_page(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t page);
+		struct _eefc_locks* locks, uint32_t page);
 
 extern bool eefc_unlock_page(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t page);
+		struct _eefc_locks* locks, uint32_t page);
 
+// Lock or unlock the regions holding the flash range, only the regions not
+// already in the requested state are changed
 extern bool eefc_lock(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t addr, uint32_t size);
+		struct _eefc_locks* locks, uint32_t addr, uint32_t size);
 
 extern bool eefc_unlock(int fd, const struct _chip* chip,
-		const struct _eefc_locks* locks, uint32_t addr, uint32_t size);
+		struct _eefc_locks* locks, uint32_t addr, uint32_t size);
 
 extern bool eefc_erase_all(int fd, const struct _chip* chip);
 
+extern bool eefc_erase_pages(int fd, const struct _chip* chip,
+		uint32_t first_page, uint32_t nb_pages);
+
 extern bool eefc_erase_16pages(int fd, const struct _chip* chip,
 		uint32_t first_page);
 
+extern bool eefc_plan_erase(const struct _chip* chip, uint32_t addr,
+		uint32_t size, struct _eefc_erase_plan* plan);
+
+extern bool eefc_plan_erase_pages(const struct _chip* chip, uint32_t first_page,
+		uint32_t nb_pages, struct _eefc_erase_plan* plan);
+
+extern bool eefc_erase_plan(int fd, const struct _chip* chip,
+		const struct _eefc_erase_plan* plan);
+
 extern bool eefc_read(int fd, const struct _chip* chip,
 		uint8_t* buffer, uint32_t addr, uint32_t size);
 
 extern bool eefc_write(int fd, const struct _chip* chip,
-		uint8_t* buffer, uint32_t addr, uint32_t size);
+		const uint8_t* buffer, uint32_t addr, uint32_t size);
+
+// Read the 128-bit unique identifier of the device
+extern bool eefc_read_unique_id(int fd, const struct _chip* chip,
+		uint8_t id[EEFC_UNIQUE_ID_SIZE]);
 
 extern bool eefc_get_gpnvm(int fd, const struct _chip* chip,
 		uint8_t gpnvm, bool* value);
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "framing.h"
+#include "utils.h"
+
+static uint32_t next_chunk(uint32_t max_transfer, uint32_t size,
+		uint32_t header_size)
+{
+	// largest chunk whose command and data fill whole packets
+	uint32_t chunk = MIN(size, max_transfer - header_size);
+
+	// a transfer of the bad size is split in two full speed aligned
+	// chunks, and a chunk leaving the bad size is shortened so that the
+	// rest still fits in one chunk
+	if (chunk == FRAMING_BAD_SIZE || size - chunk == FRAMING_BAD_SIZE)
+		chunk -= FRAMING_FULL_SPEED_PACKET;
+	return chunk;
+}
+
+uint32_t framing_next_read(const struct _framing* framing, uint32_t size)
+{
+	return next_chunk(framing->max_read, size, 0);
+}
+
+uint32_t framing_next_write(const struct _framing* framing, uint32_t size,
+		uint32_t header_size)
+{
+	return next_chunk(framing->max_write, size, header_size);
+}
+
+uint32_t framing_packets(const struct _framing* framing, uint32_t bytes,
+		bool* is_short)
+{
+	*is_short = bytes % framing->packet_size != 0;
+	return (bytes + framing->packet_size - 1) / framing->packet_size;
+}
+
+uint32_t framing_detect_packet_size(const char* device)
+{
+	char* path = realpath(device, NULL);
+	if (!path)
+		return 0;
+	// the speed is an attribute of the USB device, parent of the interface
+	char sysfs[PATH_MAX];
+	snprintf(sysfs, sizeof(sysfs), "/sys/class/tty/%s/device/../speed",
+			basename(path));
+	free(path);
+
+	FILE* file = fopen(sysfs, "r");
+	if (!file)
+		return 0;
+	double mbps = 0;
+	if (fscanf(file, "%lf", &mbps) != 1)
+		mbps = 0;
+	fclose(file);
+
+	if (mbps >= 480)
+		return FRAMING_HIGH_SPEED_PACKET;
+	if (mbps > 0)
+		return FRAMING_FULL_SPEED_PACKET;
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef FRAMING_H_
+#define FRAMING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// USB bulk packet sizes
+#define FRAMING_FULL_SPEED_PACKET 64
+#define FRAMING_HIGH_SPEED_PACKET 512
+
+// The monitor mishandles transfers of exactly this size
+#define FRAMING_BAD_SIZE 512
+
+// Planning of the chunks of the 'R' and 'S' transfers: each chunk but the
+// last of a transfer fills whole USB packets, and no chunk has the size the
+// monitor mishandles.  For writes, the 'S' command is sent in the same
+// packets as its data, so the header size is taken out of the chunks.
+// The 'R' and 'S' limits are separate since only the reads are probed.
+struct _framing {
+	uint32_t packet_size;
+	uint32_t max_read;
+	uint32_t max_write;
+};
+
+// Size of the next 'R' chunk of a transfer of size bytes
+extern uint32_t framing_next_read(const struct _framing* framing, uint32_t size);
+
+// Size of the next 'S' chunk of a transfer of size bytes, header_size bytes
+// being sent before each chunk
+extern uint32_t framing_next_write(const struct _framing* framing,
+		uint32_t size, uint32_t header_size);
+
+// Number of USB packets of a transfer, *is_short being set when the last
+// one is not full
+extern uint32_t framing_packets(const struct _framing* framing, uint32_t bytes,
+		bool* is_short);
+
+// Bulk packet size of the USB device behind a tty, from sysfs, or 0 when it
+// is unknown (not a USB device)
+extern uint32_t framing_detect_packet_size(const char* device);
+
+#endif /* FRAMING_H_ */
@@ -0,0 +1,739 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "eefc.h"
+#include "image.h"
+#include "utils.h"
+
+static bool read_all(int fd, uint8_t* buffer, uint32_t size)
+{
+	while (size > 0) {
+		ssize_t count = read(fd, buffer, size);
+		if (count <= 0)
+			return false;
+		buffer += count;
+		size -= count;
+	}
+	return true;
+}
+
+// Map a file read-only, page aligned and padded with 0xff up to the next flash
+// page.  With copy, the file is read in anonymous memory instead.
+static bool image_map(struct _image* image, const char* filename, bool copy)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open '%s' for reading\n", filename);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		fprintf(stderr, "Could not access '%s'\n", filename);
+		close(fd);
+		return false;
+	}
+
+	// the image is padded with 0xff up to a page boundary so that word
+	// and page accesses never read past the end of the image
+	uint32_t size = st.st_size;
+	uint32_t padded = (size + EEFC_PAGE_SIZE - 1) & ~(EEFC_PAGE_SIZE - 1);
+	size_t host_page = sysconf(_SC_PAGESIZE);
+	size_t length = (MAX(padded, EEFC_PAGE_SIZE) + host_page - 1) & ~(host_page - 1);
+
+	// reserve the whole area, page aligned, then map the whole host pages
+	// of the file over it: only the partial last host page is copied
+	uint8_t* data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Could not allocate memory for '%s'\n", filename);
+		close(fd);
+		return false;
+	}
+
+	uint32_t mapped = 0;
+	if (S_ISREG(st.st_mode) && !copy) {
+		mapped = size & ~(host_page - 1);
+		if (mapped && mmap(data, mapped, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+					fd, 0) == MAP_FAILED)
+			mapped = 0;
+		if (mapped) {
+			// advice values are not flags, each needs its own call
+			madvise(data, mapped, MADV_SEQUENTIAL);
+			madvise(data, mapped, MADV_WILLNEED);
+		}
+	}
+
+	if ((mapped && lseek(fd, mapped, SEEK_SET) != mapped) ||
+			!read_all(fd, data + mapped, size - mapped)) {
+		fprintf(stderr, "Error while reading from '%s'\n", filename);
+		munmap(data, length);
+		close(fd);
+		return false;
+	}
+	memset(data + size, 0xff, length - size);
+	mprotect(data + mapped, length - mapped, PROT_READ);
+
+	close(fd);
+	image->data = data;
+	image->size = size;
+	image->length = length;
+	return true;
+}
+
+// Data record of a HEX, S-record or ELF file, before coalescing
+struct _record {
+	uint32_t addr;
+	uint32_t size;
+	uint32_t offset;
+};
+
+struct _records {
+	struct _record* records;
+	uint32_t count;
+	uint32_t capacity;
+	uint8_t* bytes;     // decoded data (HEX and S-record)
+	uint32_t nb_bytes;
+	uint32_t max_bytes;
+};
+
+static bool add_record(struct _records* records, uint32_t addr, uint32_t size,
+		uint32_t offset)
+{
+	if (!size)
+		return true;
+	if ((uint64_t)addr + size > 0x100000000ull) {
+		fprintf(stderr, "Data at 0x%08x is past the end of the address space\n", addr);
+		return false;
+	}
+
+	// records following each other are merged right away
+	if (records->count) {
+		struct _record* last = &records->records[records->count - 1];
+		if (last->addr + last->size == addr && last->offset + last->size == offset) {
+			last->size += size;
+			return true;
+		}
+	}
+
+	if (records->count == records->capacity) {
+		uint32_t capacity = records->capacity ? records->capacity * 2 : 64;
+		struct _record* tmp = realloc(records->records, capacity * sizeof(*tmp));
+		if (!tmp)
+			return false;
+		records->records = tmp;
+		records->capacity = capacity;
+	}
+	struct _record* record = &records->records[records->count++];
+	record->addr = addr;
+	record->size = size;
+	record->offset = offset;
+	return true;
+}
+
+static bool add_bytes(struct _records* records, uint32_t addr,
+		const uint8_t* data, uint32_t size)
+{
+	if (records->nb_bytes + size > records->max_bytes) {
+		uint32_t max_bytes = MAX(records->max_bytes * 2, records->nb_bytes + size);
+		uint8_t* tmp = realloc(records->bytes, max_bytes);
+		if (!tmp)
+			return false;
+		records->bytes = tmp;
+		records->max_bytes = max_bytes;
+	}
+	memcpy(records->bytes + records->nb_bytes, data, size);
+	records->nb_bytes += size;
+	return add_record(records, addr, size, records->nb_bytes - size);
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// Decode the hex digits of a line to bytes, returns the number of bytes or -1
+static int decode_hex(const char* text, uint32_t length, uint8_t* bytes, uint32_t max)
+{
+	if (length & 1 || length / 2 > max)
+		return -1;
+	for (uint32_t i = 0; i < length / 2; i++) {
+		int high = hex_digit(text[2 * i]);
+		int low = hex_digit(text[2 * i + 1]);
+		if (high < 0 || low < 0)
+			return -1;
+		bytes[i] = (high << 4) | low;
+	}
+	return length / 2;
+}
+
+static uint32_t line_length(const char* text, const char* end)
+{
+	const char* p = text;
+	while (p < end && *p != '\n' && *p != '\r')
+		p++;
+	return p - text;
+}
+
+static bool parse_ihex(const char* text, const char* end, struct _records* records)
+{
+	uint32_t base = 0;
+	uint8_t bytes[5 + 255];
+
+	for (uint32_t line = 1; text < end; line++) {
+		uint32_t length = line_length(text, end);
+		const char* next = text + length;
+		while (next < end && (*next == '\n' || *next == '\r'))
+			next++;
+		if (!length) {
+			text = next;
+			continue;
+		}
+
+		// :LLAAAATT<data>CC
+		int count = text[0] == ':' ?
+			decode_hex(text + 1, length - 1, bytes, sizeof(bytes)) : -1;
+		uint8_t sum = 0;
+		for (int i = 0; i < count; i++)
+			sum += bytes[i];
+		if (count < 5 || count != 5 + bytes[0] || sum) {
+			fprintf(stderr, "Invalid Intel HEX record at line %d\n", line);
+			return false;
+		}
+
+		// the address records hold exactly two bytes
+		uint32_t offset = (bytes[1] << 8) | bytes[2];
+		if ((bytes[3] == 0x02 || bytes[3] == 0x04) && bytes[0] != 2) {
+			fprintf(stderr, "Invalid Intel HEX record at line %d\n", line);
+			return false;
+		}
+		switch (bytes[3]) {
+			case 0x00: // data
+				if (!add_bytes(records, base + offset, bytes + 4, bytes[0]))
+					return false;
+				break;
+			case 0x01: // end of file
+				return true;
+			case 0x02: // extended segment address
+				base = ((bytes[4] << 8) | bytes[5]) << 4;
+				break;
+			case 0x04: // extended linear address
+				base = ((bytes[4] << 8) | bytes[5]) << 16;
+				break;
+			case 0x03: // start segment address
+			case 0x05: // start linear address
+				break;
+			default:
+				fprintf(stderr, "Unknown Intel HEX record type %02x at line %d\n",
+						bytes[3], line);
+				return false;
+		}
+		text = next;
+	}
+
+	return true;
+}
+
+static bool parse_srec(const char* text, const char* end, struct _records* records)
+{
+	uint8_t bytes[256];
+
+	for (uint32_t line = 1; text < end; line++) {
+		uint32_t length = line_length(text, end);
+		const char* next = text + length;
+		while (next < end && (*next == '\n' || *next == '\r'))
+			next++;
+		if (!length) {
+			text = next;
+			continue;
+		}
+
+		// S<type><count><address><data><checksum>
+		int count = length >= 4 && text[0] == 'S' ?
+			decode_hex(text + 2, length - 2, bytes, sizeof(bytes)) : -1;
+		uint8_t sum = 0;
+		for (int i = 0; i < count; i++)
+			sum += bytes[i];
+		if (count < 2 || count != 1 + bytes[0] || sum != 0xff) {
+			fprintf(stderr, "Invalid S-record at line %d\n", line);
+			return false;
+		}
+
+		int type = text[1] - '0';
+		uint32_t addr_size;
+		switch (type) {
+			case 1: addr_size = 2; break;
+			case 2: addr_size = 3; break;
+			case 3: addr_size = 4; break;
+			case 0: // header
+			case 5: // record count
+			case 6:
+			case 7: // start address
+			case 8:
+			case 9:
+				text = next;
+				continue;
+			default:
+				fprintf(stderr, "Unknown S-record type S%c at line %d\n", text[1], line);
+				return false;
+		}
+		if (bytes[0] < addr_size + 1) {
+			fprintf(stderr, "Invalid S-record at line %d\n", line);
+			return false;
+		}
+
+		uint32_t addr = 0;
+		for (uint32_t i = 0; i < addr_size; i++)
+			addr = (addr << 8) | bytes[1 + i];
+		if (!add_bytes(records, addr, bytes + 1 + addr_size, bytes[0] - addr_size - 1))
+			return false;
+		text = next;
+	}
+
+	return true;
+}
+
+#define ELF_HEADER_SIZE  52
+#define ELF_PHDR_SIZE    32
+#define ELF_PT_LOAD      1
+#define ELF_ET_EXEC      2
+#define ELF_EM_ARM       40
+#define ELF_PF_RX        5
+
+static uint32_t elf_word(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t elf_half(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static void elf_set_word(uint8_t* p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static void elf_set_half(uint8_t* p, uint16_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+// Load the PT_LOAD segments of a 32-bit little-endian ELF file at their
+// physical (load) address
+static bool parse_elf(const uint8_t* data, uint32_t size, struct _records* records)
+{
+	if (size < ELF_HEADER_SIZE || data[4] != 1 || data[5] != 1) {
+		fprintf(stderr, "Only 32-bit little-endian ELF files are supported\n");
+		return false;
+	}
+
+	uint32_t phoff = elf_word(data + 28);
+	uint16_t phentsize = elf_half(data + 42);
+	uint16_t phnum = elf_half(data + 44);
+	if (phentsize < ELF_PHDR_SIZE || (uint64_t)phoff + (uint64_t)phnum * phentsize > size) {
+		fprintf(stderr, "Invalid ELF program headers\n");
+		return false;
+	}
+
+	for (uint32_t i = 0; i < phnum; i++) {
+		const uint8_t* phdr = data + phoff + i * phentsize;
+		uint32_t offset = elf_word(phdr + 4);
+		uint32_t paddr = elf_word(phdr + 12);
+		uint32_t filesz = elf_word(phdr + 16);
+		if (elf_word(phdr) != ELF_PT_LOAD || !filesz)
+			continue;
+		if ((uint64_t)offset + filesz > size) {
+			fprintf(stderr, "Invalid ELF segment %d\n", i);
+			return false;
+		}
+		if (!add_record(records, paddr, filesz, offset))
+			return false;
+	}
+
+	return true;
+}
+
+bool image_elf_start(FILE* file)
+{
+	uint8_t header[ELF_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+bool image_elf_finish(FILE* file, const struct _image_segment* segments,
+		uint32_t nb_segments)
+{
+	if (nb_segments > UINT16_MAX) {
+		fprintf(stderr, "Too many ELF segments (%d)\n", nb_segments);
+		return false;
+	}
+
+	uint32_t offset = ELF_HEADER_SIZE;
+	for (uint32_t i = 0; i < nb_segments; i++) {
+		uint8_t phdr[ELF_PHDR_SIZE];
+		memset(phdr, 0, sizeof(phdr));
+		elf_set_word(phdr, ELF_PT_LOAD);
+		elf_set_word(phdr + 4, offset);
+		elf_set_word(phdr + 8, segments[i].addr);
+		elf_set_word(phdr + 12, segments[i].addr);
+		elf_set_word(phdr + 16, segments[i].size);
+		elf_set_word(phdr + 20, segments[i].size);
+		elf_set_word(phdr + 24, ELF_PF_RX);
+		elf_set_word(phdr + 28, 4);
+		if (fwrite(phdr, 1, sizeof(phdr), file) != sizeof(phdr))
+			return false;
+		offset += segments[i].size;
+	}
+
+	uint8_t header[ELF_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, "\x7f" "ELF", 4);
+	header[4] = 1; // 32-bit
+	header[5] = 1; // little-endian
+	header[6] = 1; // version
+	elf_set_half(header + 16, ELF_ET_EXEC);
+	elf_set_half(header + 18, ELF_EM_ARM);
+	elf_set_word(header + 20, 1);
+	elf_set_word(header + 28, offset);
+	elf_set_half(header + 40, ELF_HEADER_SIZE);
+	elf_set_half(header + 42, ELF_PHDR_SIZE);
+	elf_set_half(header + 44, nb_segments);
+	return fseek(file, 0, SEEK_SET) == 0 &&
+		fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+static int compare_records(const void* a, const void* b)
+{
+	const struct _record* ra = a;
+	const struct _record* rb = b;
+	return ra->addr < rb->addr ? -1 : ra->addr > rb->addr;
+}
+
+// Sort the records, coalesce adjacent ones into segments and copy them to a
+// single buffer.  Each segment is placed at the same offset in a flash page
+// as its address, so that its whole pages are page aligned.
+static bool coalesce_records(struct _image* image, struct _records* records,
+		const uint8_t* base)
+{
+	qsort(records->records, records->count, sizeof(struct _record), compare_records);
+
+	struct _image_segment* segments = calloc(MAX(records->count, 1), sizeof(*segments));
+	if (!segments)
+		return false;
+
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < records->count; i++) {
+		const struct _record* record = &records->records[i];
+		struct _image_segment* last = count ? &segments[count - 1] : NULL;
+		if (last && record->addr < last->addr + last->size) {
+			fprintf(stderr, "Overlapping data at 0x%08x\n", record->addr);
+			free(segments);
+			return false;
+		}
+		if (last && record->addr == last->addr + last->size) {
+			last->size += record->size;
+		} else {
+			segments[count].addr = record->addr;
+			segments[count].size = record->size;
+			count++;
+		}
+	}
+
+	// layout: pad so that each segment offset matches its address modulo
+	// the page size
+	uint32_t total = 0;
+	uint64_t position = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		position += (segments[i].addr - position) % EEFC_PAGE_SIZE;
+		position += segments[i].size;
+		total += segments[i].size;
+	}
+	position += EEFC_PAGE_SIZE;
+	if (position > UINT32_MAX) {
+		free(segments);
+		return false;
+	}
+
+	uint8_t* buffer;
+	if (posix_memalign((void**)&buffer, EEFC_PAGE_SIZE, position)) {
+		free(segments);
+		return false;
+	}
+	memset(buffer, 0xff, position);
+
+	position = 0;
+	for (uint32_t i = 0, r = 0; i < count; i++) {
+		position += (segments[i].addr - position) % EEFC_PAGE_SIZE;
+		segments[i].data = buffer + position;
+		for (uint32_t done = 0; done < segments[i].size; r++) {
+			const struct _record* record = &records->records[r];
+			memcpy(buffer + position + done, base + record->offset, record->size);
+			done += record->size;
+		}
+		position += segments[i].size;
+	}
+
+	image->buffer = buffer;
+	image->segments = segments;
+	image->nb_segments = count;
+	image->size = total;
+	return true;
+}
+
+static int image_detect_format(const char* filename, const uint8_t* data, uint32_t size)
+{
+	static const char* const ihex_ext[] = { ".hex", ".ihex", ".ihx" };
+	static const char* const srec_ext[] = { ".srec", ".s19", ".s28", ".s37", ".mot" };
+	const char* ext = strrchr(filename, '.');
+
+	if (size >= 4 && !memcmp(data, "\x7f" "ELF", 4))
+		return IMAGE_ELF;
+	for (uint32_t i = 0; ext && i < ARRAY_SIZE(ihex_ext); i++)
+		if (!strcasecmp(ext, ihex_ext[i]))
+			return IMAGE_IHEX;
+	for (uint32_t i = 0; ext && i < ARRAY_SIZE(srec_ext); i++)
+		if (!strcasecmp(ext, srec_ext[i]))
+			return IMAGE_SREC;
+	return IMAGE_BINARY;
+}
+
+// Decode a mapped image into its segments
+static bool image_decode(struct _image* image, const char* filename)
+{
+	image->format = image_detect_format(filename, image->data, image->size);
+	if (image->format == IMAGE_BINARY) {
+		image->segments = calloc(1, sizeof(*image->segments));
+		if (!image->segments) {
+			image_free(image);
+			return false;
+		}
+		image->segments[0].data = image->data;
+		image->segments[0].size = image->size;
+		image->nb_segments = 1;
+		return true;
+	}
+
+	struct _records records;
+	memset(&records, 0, sizeof(records));
+	const char* text = (const char*)image->data;
+	bool ok;
+	switch (image->format) {
+		case IMAGE_IHEX:
+			ok = parse_ihex(text, text + image->size, &records) &&
+				coalesce_records(image, &records, records.bytes);
+			break;
+		case IMAGE_SREC:
+			ok = parse_srec(text, text + image->size, &records) &&
+				coalesce_records(image, &records, records.bytes);
+			break;
+		default:
+			ok = parse_elf(image->data, image->size, &records) &&
+				coalesce_records(image, &records, image->data);
+			break;
+	}
+	free(records.records);
+	free(records.bytes);
+
+	// the decoded segments do not refer to the file anymore
+	munmap((void*)image->data, image->length);
+	image->data = NULL;
+	image->length = 0;
+	if (!ok) {
+		fprintf(stderr, "Could not load '%s'\n", filename);
+		image_free(image);
+		return false;
+	}
+	return true;
+}
+
+bool image_load(struct _image* image, const char* filename, bool copy)
+{
+	memset(image, 0, sizeof(*image));
+	return image_map(image, filename, copy) && image_decode(image, filename);
+}
+
+void image_free(struct _image* image)
+{
+	if (image->data)
+		munmap((void*)image->data, image->length);
+	free(image->buffer);
+	free(image->segments);
+	memset(image, 0, sizeof(*image));
+}
+
+static void* image_loader_run(void* arg)
+{
+	struct _image_loader* loader = arg;
+	// an image already mapped by the cache only needs to be decoded
+	bool ok = loader->image.data ?
+		image_decode(&loader->image, loader->filename) :
+		image_load(&loader->image, loader->filename, loader->copy);
+
+	pthread_mutex_lock(&loader->lock);
+	loader->ok = ok;
+	loader->done = true;
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+	return NULL;
+}
+
+static bool loader_start(struct _image_loader* loader, const char* filename,
+		bool copy, const struct _image* mapped)
+{
+	memset(loader, 0, sizeof(*loader));
+	loader->filename = filename;
+	loader->copy = copy;
+	if (mapped)
+		loader->image = *mapped;
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->cond, NULL);
+	if (pthread_create(&loader->thread, NULL, image_loader_run, loader) != 0) {
+		fprintf(stderr, "Could not start loading '%s'\n", filename);
+		pthread_cond_destroy(&loader->cond);
+		pthread_mutex_destroy(&loader->lock);
+		return false;
+	}
+	return true;
+}
+
+bool image_loader_start(struct _image_loader* loader, const char* filename, bool copy)
+{
+	return loader_start(loader, filename, copy, NULL);
+}
+
+const struct _image* image_loader_wait(struct _image_loader* loader)
+{
+	pthread_mutex_lock(&loader->lock);
+	while (!loader->done)
+		pthread_cond_wait(&loader->cond, &loader->lock);
+	pthread_mutex_unlock(&loader->lock);
+	return loader->ok ? &loader->image : NULL;
+}
+
+void image_loader_free(struct _image_loader* loader)
+{
+	pthread_join(loader->thread, NULL);
+	pthread_cond_destroy(&loader->cond);
+	pthread_mutex_destroy(&loader->lock);
+	image_free(&loader->image);
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t fnv_hash(uint64_t hash, const uint8_t* data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	return hash;
+}
+
+// Hash of the content of a file and of its extension, which selects the format
+static uint64_t hash_image(const struct _image* image, const char* filename)
+{
+	uint64_t value = fnv_hash(FNV_OFFSET, image->data, image->size);
+	const char* ext = strrchr(filename, '.');
+	for (; ext && *ext; ext++) {
+		uint8_t c = tolower((unsigned char)*ext);
+		value = fnv_hash(value, &c, 1);
+	}
+	return value;
+}
+
+static void cache_entry_free(struct _image_cache_entry* entry)
+{
+	image_loader_free(&entry->loader);
+	free(entry->filename);
+	free(entry);
+}
+
+struct _image_loader* image_cache_get(struct _image_cache* cache, const char* filename)
+{
+	// the file may be modified while the image is cached, it is copied
+	// once and the copy is both hashed and decoded
+	struct _image image;
+	memset(&image, 0, sizeof(image));
+	if (!image_map(&image, filename, true))
+		return NULL;
+	uint64_t hash = hash_image(&image, filename);
+
+	cache->clock++;
+	uint32_t oldest = 0;
+	for (uint32_t i = 0; i < cache->count; i++) {
+		struct _image_cache_entry* entry = cache->entries[i];
+		if (entry->hash == hash) {
+			entry->last_use = cache->clock;
+			image_free(&image);
+			return &entry->loader;
+		}
+		if (entry->last_use < cache->entries[oldest]->last_use)
+			oldest = i;
+	}
+
+	struct _image_cache_entry* entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		image_free(&image);
+		return NULL;
+	}
+	entry->hash = hash;
+	entry->last_use = cache->clock;
+	entry->filename = strdup(filename);
+	if (!entry->filename ||
+			!loader_start(&entry->loader, entry->filename, true, &image)) {
+		image_free(&image);
+		free(entry->filename);
+		free(entry);
+		return NULL;
+	}
+	if (!image_loader_wait(&entry->loader)) {
+		cache_entry_free(entry);
+		return NULL;
+	}
+
+	// replace the least recently used image when the cache is full
+	if (cache->count == IMAGE_CACHE_SIZE)
+		cache_entry_free(cache->entries[oldest]);
+	else
+		oldest = cache->count++;
+	cache->entries[oldest] = entry;
+	return &entry->loader;
+}
+
+void image_cache_free(struct _image_cache* cache)
+{
+	for (uint32_t i = 0; i < cache->count; i++)
+		cache_entry_free(cache->entries[i]);
+	memset(cache, 0, sizeof(*cache));
+}
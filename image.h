@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+	IMAGE_BINARY = 0,
+	IMAGE_IHEX = 1,
+	IMAGE_SREC = 2,
+	IMAGE_ELF = 3,
+};
+
+// Contiguous data of an image.  The address is an offset from the start
+// address for raw binaries, an absolute address for the other formats.
+struct _image_segment {
+	uint32_t addr;
+	const uint8_t* data;
+	uint32_t size;
+};
+
+// Read-only image, as sorted segments.  Segment data is laid out so that its
+// whole flash pages are page aligned, and is padded with 0xff up to the next
+// flash page.  Raw binaries are a single segment mapping the file, which must
+// not be modified while the image is in use; other formats are decoded to a
+// buffer, adjacent records being coalesced.
+struct _image {
+	int format;
+	const uint8_t* data;
+	uint32_t size;
+	size_t length;
+	uint8_t* buffer;
+	struct _image_segment* segments;
+	uint32_t nb_segments;
+};
+
+// Load an image.  Raw binaries are mapped, unless copy is set: images kept
+// while their file may be modified must be copied.
+extern bool image_load(struct _image* image, const char* filename, bool copy);
+
+extern void image_free(struct _image* image);
+
+// Sparse images: 32-bit little-endian ELF files with one PT_LOAD segment per
+// run of data, the data of the segments being written in order right after
+// the ELF header.  Start reserves the header, finish appends the program
+// headers and writes the header (the file must be seekable).  The data
+// pointers of the segments are not used.
+extern bool image_elf_start(FILE* file);
+
+extern bool image_elf_finish(FILE* file, const struct _image_segment* segments,
+		uint32_t nb_segments);
+
+// Image loaded by a background thread, so that reading the file overlaps
+// with the device setup.  Any number of threads can wait for it.
+struct _image_loader {
+	const char* filename;
+	bool copy;
+	struct _image image;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+	bool ok;
+};
+
+extern bool image_loader_start(struct _image_loader* loader, const char* filename,
+		bool copy);
+
+// Wait for the end of the load, returns NULL if it failed
+extern const struct _image* image_loader_wait(struct _image_loader* loader);
+
+extern void image_loader_free(struct _image_loader* loader);
+
+#define IMAGE_CACHE_SIZE 8
+
+// Loaded image kept in a cache, keyed by a hash of the file content and
+// extension
+struct _image_cache_entry {
+	uint64_t hash;
+	char* filename;
+	struct _image_loader loader;
+	uint64_t last_use;
+};
+
+// Least recently used images, so that a file that did not change is not read
+// and decoded again, whatever its name
+struct _image_cache {
+	struct _image_cache_entry* entries[IMAGE_CACHE_SIZE];
+	uint32_t count;
+	uint64_t clock;
+};
+
+// Get the image of a file from the cache, loading it if needed.  Returns NULL
+// if the image could not be loaded.
+extern struct _image_loader* image_cache_get(struct _image_cache* cache,
+		const char* filename);
+
+extern void image_cache_free(struct _image_cache* cache);
+
+#endif /* IMAGE_H_ */
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "journal.h"
+
+// a 'keep' record is the longest one
+#define MAX_LINE_SIZE (2 * EEFC_PAGE_SIZE + 32)
+
+static bool parse_keep(struct _pagemap* map, const char* line)
+{
+	uint8_t content[EEFC_PAGE_SIZE];
+	char* end;
+	uint32_t number = strtoul(line, &end, 0);
+	if (end == line || *end++ != ' ' || strlen(end) != 2 * EEFC_PAGE_SIZE)
+		return false;
+	for (uint32_t i = 0; i < EEFC_PAGE_SIZE; i++) {
+		unsigned int value;
+		if (sscanf(end + 2 * i, "%2x", &value) != 1)
+			return false;
+		content[i] = value;
+	}
+
+	struct _page* page = pagemap_get(map, number);
+	if (!page || !page_fill(page, content))
+		return false;
+	page->state = PAGE_WRITE;
+	return true;
+}
+
+static bool parse_commit(const struct _pagemap* map, const char* line,
+		struct _journal_state* state)
+{
+	char* end;
+	uint32_t first = strtoul(line, &end, 0);
+	if (end == line || *end != ' ')
+		return false;
+	const char* text = end;
+	uint32_t count = strtoul(text, &end, 0);
+	if (end == text || *end || !count)
+		return false;
+
+	for (uint32_t page = first; page < first + count; page++) {
+		struct _page* p = pagemap_find(map, page);
+		if (p)
+			p->state = PAGE_UNCHANGED;
+	}
+	if (!state->has_last || first < state->first_page)
+		state->first_page = first;
+	state->committed += count;
+	state->has_last = true;
+	state->last_page = first + count - 1;
+	return true;
+}
+
+bool journal_resume(struct _journal* journal, const char* path,
+		const char* chip, uint32_t id, struct _pagemap* map,
+		struct _journal_state* state)
+{
+	memset(journal, 0, sizeof(*journal));
+	memset(state, 0, sizeof(*state));
+
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return false;
+
+	char header[64], line[MAX_LINE_SIZE];
+	snprintf(header, sizeof(header), "journal %s %08x\n", chip, id);
+	if (!fgets(line, sizeof(line), file) || strcmp(line, header)) {
+		fprintf(stderr, "Journal '%s' is for another write, ignoring it\n", path);
+		fclose(file);
+		return false;
+	}
+
+	// the saved pages are added first, so that the pages written are all
+	// in the map when marked.  Incomplete records (without a newline) are
+	// ignored.
+	bool ok = true;
+	for (int pass = 0; ok && pass < 2; pass++) {
+		while (ok && fgets(line, sizeof(line), file)) {
+			size_t length = strlen(line);
+			if (!length || line[length - 1] != '\n')
+				break;
+			line[length - 1] = '\0';
+			if (!strncmp(line, "keep ", 5)) {
+				if (pass == 0)
+					ok = parse_keep(map, line + 5);
+			} else if (!strcmp(line, "erased")) {
+				state->erased = true;
+			} else if (pass == 1) {
+				ok = parse_commit(map, line, state);
+			}
+		}
+		rewind(file);
+		fgets(line, sizeof(line), file);
+	}
+	fclose(file);
+	if (!ok) {
+		fprintf(stderr, "Invalid journal '%s'\n", path);
+		return false;
+	}
+
+	journal->path = strdup(path);
+	journal->file = fopen(path, "a");
+	if (!journal->path || !journal->file) {
+		fprintf(stderr, "Could not open '%s' for writing\n", path);
+		journal_close(journal, false);
+		return false;
+	}
+	return true;
+}
+
+bool journal_create(struct _journal* journal, const char* path,
+		const char* chip, uint32_t id)
+{
+	memset(journal, 0, sizeof(*journal));
+	journal->path = strdup(path);
+	journal->file = fopen(path, "w");
+	if (!journal->path || !journal->file) {
+		fprintf(stderr, "Could not open '%s' for writing\n", path);
+		journal_close(journal, false);
+		return false;
+	}
+	fprintf(journal->file, "journal %s %08x\n", chip, id);
+	return fflush(journal->file) == 0;
+}
+
+// Records are flushed at once, so that they are not lost if the process is
+// interrupted
+static bool journal_flush(struct _journal* journal)
+{
+	if (fflush(journal->file) != 0 || ferror(journal->file)) {
+		fprintf(stderr, "Error while writing to '%s'\n", journal->path);
+		return false;
+	}
+	return true;
+}
+
+bool journal_keep(struct _journal* journal, const struct _page* page)
+{
+	fprintf(journal->file, "keep %u ", page->number);
+	for (uint32_t i = 0; i < EEFC_PAGE_SIZE; i++)
+		fprintf(journal->file, "%02x", page->data[i]);
+	fprintf(journal->file, "\n");
+	return journal_flush(journal);
+}
+
+bool journal_erased(struct _journal* journal)
+{
+	fprintf(journal->file, "erased\n");
+	return journal_flush(journal);
+}
+
+bool journal_commit(struct _journal* journal, uint32_t first_page,
+		uint32_t nb_pages)
+{
+	fprintf(journal->file, "%u %u\n", first_page, nb_pages);
+	return journal_flush(journal);
+}
+
+void journal_close(struct _journal* journal, bool complete)
+{
+	if (journal->file)
+		fclose(journal->file);
+	if (complete && journal->path)
+		unlink(journal->path);
+	free(journal->path);
+	memset(journal, 0, sizeof(*journal));
+}
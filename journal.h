@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "pagemap.h"
+
+// Journal of a write, so that an interrupted write can be resumed.  It is a
+// text file starting with a 'journal <chip> <id>' line, <id> identifying the
+// pages to write, followed by the records appended while writing:
+//     keep <page> <data>     content of a page to erase that is not in the
+//                            image, in hexadecimal, saved before the erase
+//     erased                 all the blocks to erase are erased
+//     <page> <count>         pages written successfully
+struct _journal {
+	char* path;
+	FILE* file;
+};
+
+// State of an interrupted write, as loaded from its journal
+struct _journal_state {
+	bool erased;
+	uint32_t committed;
+	bool has_last;
+	uint32_t first_page;
+	uint32_t last_page;
+};
+
+// Load the journal of an interrupted write of the same pages on the same
+// chip: the saved pages are added to the map, the pages written are marked
+// unchanged and the journal is reopened to append more records.  Returns false
+// if there is no such journal.
+extern bool journal_resume(struct _journal* journal, const char* path,
+		const char* chip, uint32_t id, struct _pagemap* map,
+		struct _journal_state* state);
+
+// Start a new journal, replacing any previous one
+extern bool journal_create(struct _journal* journal, const char* path,
+		const char* chip, uint32_t id);
+
+extern bool journal_keep(struct _journal* journal, const struct _page* page);
+
+extern bool journal_erased(struct _journal* journal);
+
+extern bool journal_commit(struct _journal* journal, uint32_t first_page,
+		uint32_t nb_pages);
+
+// Close the journal, and remove it once the write is complete
+extern void journal_close(struct _journal* journal, bool complete);
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "layout.h"
+
+#define MAX_LINE_SIZE 1024
+
+static char* entry_filename(const char* layout_filename, const char* name)
+{
+	const char* slash = strrchr(layout_filename, '/');
+	size_t dir_length = (name[0] != '/' && slash) ? slash - layout_filename + 1 : 0;
+	char* filename = malloc(dir_length + strlen(name) + 1);
+	if (filename) {
+		memcpy(filename, layout_filename, dir_length);
+		strcpy(filename + dir_length, name);
+	}
+	return filename;
+}
+
+static bool parse_entry(struct _layout_entry* entry, const char* filename,
+		char* line, int number)
+{
+	char* save;
+	char* token = strtok_r(line, " \t", &save);
+	entry->filename = entry_filename(filename, token);
+	if (!entry->filename)
+		return false;
+
+	while ((token = strtok_r(NULL, " \t", &save))) {
+		if (isdigit((unsigned char)token[0]) && !entry->has_addr) {
+			char* end;
+			entry->addr = strtoul(token, &end, 0);
+			if (*end) {
+				fprintf(stderr, "%s:%d: invalid start address '%s'\n",
+						filename, number, token);
+				return false;
+			}
+			entry->has_addr = true;
+		} else if (!strcmp(token, "erase")) {
+			entry->erase = true;
+		} else if (!strcmp(token, "lock")) {
+			entry->lock = true;
+		} else {
+			fprintf(stderr, "%s:%d: unknown flag '%s'\n", filename, number, token);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool layout_load(struct _layout* layout, const char* filename)
+{
+	memset(layout, 0, sizeof(*layout));
+
+	FILE* file = fopen(filename, "r");
+	if (!file) {
+		fprintf(stderr, "Could not open '%s' for reading\n", filename);
+		return false;
+	}
+
+	char line[MAX_LINE_SIZE];
+	int number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), file)) {
+		number++;
+		char* comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[strspn(line, " \t")])
+			continue;
+
+		if (layout->count == MAX_LAYOUT_ENTRIES) {
+			fprintf(stderr, "%s:%d: too many entries (max %d)\n",
+					filename, number, MAX_LAYOUT_ENTRIES);
+			ok = false;
+			break;
+		}
+		struct _layout_entry* entry = &layout->entries[layout->count];
+		ok = parse_entry(entry, filename, line, number);
+		if (ok) {
+			ok = image_loader_start(&entry->loader, entry->filename, false);
+			if (ok)
+				layout->count++;
+		}
+		if (!ok)
+			free(entry->filename);
+	}
+	fclose(file);
+
+	if (ok && !layout->count) {
+		fprintf(stderr, "No image in layout '%s'\n", filename);
+		ok = false;
+	}
+	if (!ok)
+		layout_free(layout);
+	return ok;
+}
+
+void layout_free(struct _layout* layout)
+{
+	for (uint32_t i = 0; i < layout->count; i++) {
+		image_loader_free(&layout->entries[i].loader);
+		free(layout->entries[i].filename);
+	}
+	memset(layout, 0, sizeof(*layout));
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef LAYOUT_H_
+#define LAYOUT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "image.h"
+
+#define MAX_LAYOUT_ENTRIES 64
+
+// An image of a layout manifest, with its optional start address and flags
+struct _layout_entry {
+	char* filename;
+	bool has_addr;
+	uint32_t addr;
+	bool erase;
+	bool lock;
+	struct _image_loader loader;
+};
+
+// Layout manifest: one entry per line, as
+//     <filename> [<start-address>] [erase] [lock]
+// with blank lines and '#' comments ignored.  Relative filenames are relative
+// to the directory of the manifest.  The images are loaded in the background.
+struct _layout {
+	struct _layout_entry entries[MAX_LAYOUT_ENTRIES];
+	uint32_t count;
+};
+
+extern bool layout_load(struct _layout* layout, const char* filename);
+
+extern void layout_free(struct _layout* layout);
+
+#endif /* LAYOUT_H_ */
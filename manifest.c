@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chipid.h"
+#include "eefc.h"
+#include "manifest.h"
+
+#define MAX_LINE_SIZE 256
+
+static bool parse_line(struct _manifest* manifest, char* line, int number)
+{
+	char* end;
+	uint32_t first = strtoul(line, &end, 0);
+	uint32_t last = first;
+	if (*end == '-')
+		last = strtoul(end + 1, &end, 0);
+	if (end == line || (*end != ' ' && *end != '\t'))
+		goto invalid;
+	char* text = end;
+	uint32_t crc = strtoul(text, &end, 16);
+	if (end == text || *end || last < first || last >= manifest->nb_pages)
+		goto invalid;
+
+	for (uint32_t page = first; page <= last; page++)
+		manifest_set(manifest, page, crc);
+	return true;
+
+invalid:
+	fprintf(stderr, "%s:%d: invalid line\n", manifest->path, number);
+	return false;
+}
+
+bool manifest_load(struct _manifest* manifest, const char* dir,
+		const char* key, const struct _chip* chip)
+{
+	memset(manifest, 0, sizeof(*manifest));
+	manifest->chip = chip;
+	manifest->nb_pages = chip->flash_size * 1024 / EEFC_PAGE_SIZE;
+	manifest->path = malloc(strlen(dir) + strlen(key) + sizeof("/.manifest"));
+	manifest->crcs = calloc(manifest->nb_pages, sizeof(uint32_t));
+	manifest->known = calloc(manifest->nb_pages, sizeof(uint8_t));
+	if (!manifest->path || !manifest->crcs || !manifest->known) {
+		manifest_free(manifest);
+		return false;
+	}
+	sprintf(manifest->path, "%s/%s.manifest", dir, key);
+
+	FILE* file = fopen(manifest->path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			return true;
+		fprintf(stderr, "Could not open '%s' for reading\n", manifest->path);
+		manifest_free(manifest);
+		return false;
+	}
+
+	char line[MAX_LINE_SIZE];
+	int number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), file)) {
+		number++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (number == 1) {
+			// a manifest of another chip is ignored, and replaced
+			// when saved
+			if (strncmp(line, "chip ", 5) || strcmp(line + 5, chip->name)) {
+				fprintf(stderr, "Ignoring manifest '%s' of another device\n",
+						manifest->path);
+				break;
+			}
+			continue;
+		}
+		ok = parse_line(manifest, line, number);
+	}
+	fclose(file);
+
+	if (!ok)
+		manifest_free(manifest);
+	return ok;
+}
+
+// The manifest is written to a temporary file then renamed, so that an
+// interrupted save leaves the previous manifest
+bool manifest_save(const struct _manifest* manifest)
+{
+	char* dir = strdup(manifest->path);
+	char* tmp = malloc(strlen(manifest->path) + sizeof(".tmp"));
+	if (!dir || !tmp) {
+		free(dir);
+		free(tmp);
+		return false;
+	}
+	*strrchr(dir, '/') = '\0';
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Could not create directory '%s'\n", dir);
+		free(dir);
+		free(tmp);
+		return false;
+	}
+	free(dir);
+	sprintf(tmp, "%s.tmp", manifest->path);
+
+	FILE* file = fopen(tmp, "w");
+	if (!file) {
+		fprintf(stderr, "Could not open '%s' for writing\n", tmp);
+		free(tmp);
+		return false;
+	}
+	fprintf(file, "chip %s\n", manifest->chip->name);
+	for (uint32_t first = 0, n; first < manifest->nb_pages; first += n) {
+		for (n = 1; first + n < manifest->nb_pages &&
+				manifest->known[first + n] == manifest->known[first] &&
+				manifest->crcs[first + n] == manifest->crcs[first]; n++)
+			;
+		if (!manifest->known[first])
+			continue;
+		if (n == 1)
+			fprintf(file, "%u %08x\n", first, manifest->crcs[first]);
+		else
+			fprintf(file, "%u-%u %08x\n", first, first + n - 1, manifest->crcs[first]);
+	}
+
+	bool ok = !ferror(file);
+	ok = (fclose(file) == 0) && ok;
+	if (ok && rename(tmp, manifest->path) != 0)
+		ok = false;
+	if (!ok) {
+		fprintf(stderr, "Could not write manifest '%s'\n", manifest->path);
+		unlink(tmp);
+	}
+	free(tmp);
+	return ok;
+}
+
+void manifest_free(struct _manifest* manifest)
+{
+	free(manifest->path);
+	free(manifest->crcs);
+	free(manifest->known);
+	memset(manifest, 0, sizeof(*manifest));
+}
+
+bool manifest_get(const struct _manifest* manifest, uint32_t page, uint32_t* crc)
+{
+	if (page >= manifest->nb_pages || !manifest->known[page])
+		return false;
+	*crc = manifest->crcs[page];
+	return true;
+}
+
+void manifest_set(struct _manifest* manifest, uint32_t page, uint32_t crc)
+{
+	if (page >= manifest->nb_pages)
+		return;
+	if (!manifest->known[page])
+		manifest->nb_known++;
+	manifest->known[page] = 1;
+	manifest->crcs[page] = crc;
+}
+
+void manifest_forget(struct _manifest* manifest, uint32_t page)
+{
+	if (page >= manifest->nb_pages || !manifest->known[page])
+		return;
+	manifest->known[page] = 0;
+	manifest->crcs[page] = 0;
+	manifest->nb_known--;
+}
+
+void manifest_clear(struct _manifest* manifest)
+{
+	memset(manifest->crcs, 0, manifest->nb_pages * sizeof(uint32_t));
+	memset(manifest->known, 0, manifest->nb_pages * sizeof(uint8_t));
+	manifest->nb_known = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef MANIFEST_H_
+#define MANIFEST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct _chip;
+
+// Host-side record of the flash content of one device: the CRC-32 of each
+// page whose content is known, saved as '<dir>/<key>.manifest' with one
+//     <page>[-<last-page>] <crc>
+// line per run of pages with the same CRC, after a 'chip <name>' line.
+struct _manifest {
+	char* path;
+	const struct _chip* chip;
+	uint32_t nb_pages;
+	uint32_t* crcs;
+	uint8_t* known;
+	uint32_t nb_known;
+};
+
+// Load the manifest of the device, an empty one if it does not exist yet or
+// was saved for another chip
+extern bool manifest_load(struct _manifest* manifest, const char* dir,
+		const char* key, const struct _chip* chip);
+
+extern bool manifest_save(const struct _manifest* manifest);
+
+extern void manifest_free(struct _manifest* manifest);
+
+extern bool manifest_get(const struct _manifest* manifest, uint32_t page, uint32_t* crc);
+
+extern void manifest_set(struct _manifest* manifest, uint32_t page, uint32_t crc);
+
+extern void manifest_forget(struct _manifest* manifest, uint32_t page);
+
+// Forget all the pages, when the manifest does not match the device
+extern void manifest_clear(struct _manifest* manifest);
+
+#endif /* MANIFEST_H_ */
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pagemap.h"
+#include "utils.h"
+
+#define MASK_SIZE (EEFC_PAGE_SIZE / 8)
+
+struct _page* pagemap_get(struct _pagemap* map, uint32_t number)
+{
+	// pages are usually added in order, so look from the end
+	uint32_t index = map->count;
+	while (index > 0 && map->pages[index - 1].number > number)
+		index--;
+	if (index > 0 && map->pages[index - 1].number == number)
+		return &map->pages[index - 1];
+
+	if (map->count == map->capacity) {
+		uint32_t capacity = map->capacity ? map->capacity * 2 : 64;
+		struct _page* pages = realloc(map->pages, capacity * sizeof(*pages));
+		if (!pages)
+			return NULL;
+		map->pages = pages;
+		map->capacity = capacity;
+	}
+
+	struct _page* page = &map->pages[index];
+	memmove(page + 1, page, (map->count - index) * sizeof(*page));
+	memset(page, 0, sizeof(*page));
+	page->number = number;
+	map->count++;
+	return page;
+}
+
+static bool page_own(struct _page* page)
+{
+	if (page->buffer)
+		return true;
+
+	page->buffer = malloc(EEFC_PAGE_SIZE + MASK_SIZE);
+	if (!page->buffer)
+		return false;
+	page->mask = page->buffer + EEFC_PAGE_SIZE;
+
+	if (page->data) {
+		// former view of a whole page
+		memcpy(page->buffer, page->data, EEFC_PAGE_SIZE);
+		memset(page->mask, 0xff, MASK_SIZE);
+	} else {
+		memset(page->buffer, 0xff, EEFC_PAGE_SIZE);
+		memset(page->mask, 0, MASK_SIZE);
+	}
+	page->data = page->buffer;
+	return true;
+}
+
+bool pagemap_add(struct _pagemap* map, uint32_t addr,
+		const uint8_t* data, uint32_t size)
+{
+	while (size > 0) {
+		uint32_t number = addr / EEFC_PAGE_SIZE;
+		uint32_t head = addr & (EEFC_PAGE_SIZE - 1);
+		uint32_t count = MIN(size, EEFC_PAGE_SIZE - head);
+
+		struct _page* page = pagemap_get(map, number);
+		if (!page)
+			return false;
+
+		if (!page->data && count == EEFC_PAGE_SIZE && !((uintptr_t)data & 7)) {
+			page->data = data;
+		} else {
+			if (!page_own(page))
+				return false;
+			for (uint32_t i = head; i < head + count; i++) {
+				if (page->mask[i / 8] & (1 << (i % 8))) {
+					fprintf(stderr, "Overlapping data at 0x%08x\n",
+							number * EEFC_PAGE_SIZE + i);
+					return false;
+				}
+				page->mask[i / 8] |= 1 << (i % 8);
+			}
+			memcpy(page->buffer + head, data, count);
+		}
+
+		data += count;
+		addr += count;
+		size -= count;
+	}
+	return true;
+}
+
+struct _page* pagemap_find(const struct _pagemap* map, uint32_t number)
+{
+	uint32_t low = 0, high = map->count;
+	while (low < high) {
+		uint32_t mid = (low + high) / 2;
+		if (map->pages[mid].number < number)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low < map->count && map->pages[low].number == number)
+		return &map->pages[low];
+	return NULL;
+}
+
+void pagemap_free(struct _pagemap* map)
+{
+	for (uint32_t i = 0; i < map->count; i++)
+		free(map->pages[i].buffer);
+	free(map->pages);
+	memset(map, 0, sizeof(*map));
+}
+
+bool page_is_full(const struct _page* page)
+{
+	if (!page->mask)
+		return page->data != NULL;
+	for (uint32_t i = 0; i < MASK_SIZE; i++)
+		if (page->mask[i] != 0xff)
+			return false;
+	return true;
+}
+
+bool page_fill(struct _page* page, const uint8_t* content)
+{
+	if (page_is_full(page))
+		return true;
+	if (!page_own(page))
+		return false;
+
+	for (uint32_t i = 0; i < EEFC_PAGE_SIZE; i++)
+		if (!(page->mask[i / 8] & (1 << (i % 8))))
+			page->buffer[i] = content[i];
+	memset(page->mask, 0xff, MASK_SIZE);
+	return true;
+}
+
+bool page_matches(const struct _page* page, const uint8_t* content)
+{
+	if (!page->mask)
+		return !memcmp(page->data, content, EEFC_PAGE_SIZE);
+	for (uint32_t i = 0; i < EEFC_PAGE_SIZE; i++)
+		if ((page->mask[i / 8] & (1 << (i % 8))) && page->data[i] != content[i])
+			return false;
+	return true;
+}
+
+bool page_is_blank(const uint8_t* data)
+{
+	// page data is always 64-bit aligned, check 64 bytes per iteration with
+	// a loop the compiler can vectorize
+	const uint64_t* words = (const uint64_t*)data;
+	for (uint32_t i = 0; i < EEFC_PAGE_SIZE / 8; i += 8) {
+		uint64_t value = words[i] & words[i + 1] & words[i + 2] & words[i + 3] &
+			words[i + 4] & words[i + 5] & words[i + 6] & words[i + 7];
+		if (value != UINT64_MAX)
+			return false;
+	}
+	return true;
+}
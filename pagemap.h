@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef PAGEMAP_H_
+#define PAGEMAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "eefc.h"
+
+enum {
+	PAGE_WRITE = 0,
+	PAGE_BLANK = 1,
+	PAGE_UNCHANGED = 2,
+};
+
+// A flash page to program.  Whole aligned pages are read-only views of the
+// image data, other pages are copied to an owned buffer, with a bitmap of the
+// bytes actually defined by the image (undefined bytes are 0xff).  Pages
+// marked for erase have their erase block erased before being written.
+struct _page {
+	uint32_t number;
+	const uint8_t* data;
+	uint8_t* buffer;
+	uint8_t* mask;
+	uint8_t state;
+	bool erase;
+};
+
+// Sparse map of the pages to program, sorted by page number
+struct _pagemap {
+	struct _page* pages;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+extern struct _page* pagemap_get(struct _pagemap* map, uint32_t number);
+
+extern bool pagemap_add(struct _pagemap* map, uint32_t addr,
+		const uint8_t* data, uint32_t size);
+
+extern struct _page* pagemap_find(const struct _pagemap* map, uint32_t number);
+
+extern void pagemap_free(struct _pagemap* map);
+
+extern bool page_is_full(const struct _page* page);
+
+extern bool page_fill(struct _page* page, const uint8_t* content);
+
+extern bool page_matches(const struct _page* page, const uint8_t* content);
+
+extern bool page_is_blank(const uint8_t* data);
+
+#endif /* PAGEMAP_H_ */
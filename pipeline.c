@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pipeline.h"
+
+bool pipeline_init(struct _pipeline* pipeline, uint32_t nb_buffers,
+		uint32_t buffer_size)
+{
+	if (nb_buffers < 2 || nb_buffers > PIPELINE_MAX_BUFFERS)
+		return false;
+
+	memset(pipeline, 0, sizeof(*pipeline));
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+	pipeline->nb_buffers = nb_buffers;
+	for (uint32_t i = 0; i < nb_buffers; i++) {
+		pipeline->buffers[i].data = malloc(buffer_size);
+		if (!pipeline->buffers[i].data) {
+			pipeline_free(pipeline);
+			return false;
+		}
+	}
+	return true;
+}
+
+void pipeline_free(struct _pipeline* pipeline)
+{
+	for (uint32_t i = 0; i < pipeline->nb_buffers; i++)
+		free(pipeline->buffers[i].data);
+	pthread_cond_destroy(&pipeline->cond);
+	pthread_mutex_destroy(&pipeline->lock);
+	memset(pipeline, 0, sizeof(*pipeline));
+}
+
+struct _pipeline_buffer* pipeline_produce(struct _pipeline* pipeline)
+{
+	struct _pipeline_buffer* buffer = NULL;
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (pipeline->count == pipeline->nb_buffers && !pipeline->aborted)
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+	if (!pipeline->aborted) {
+		uint32_t index = (pipeline->first + pipeline->count) % pipeline->nb_buffers;
+		buffer = &pipeline->buffers[index];
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+	return buffer;
+}
+
+void pipeline_commit(struct _pipeline* pipeline)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->count++;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+void pipeline_close(struct _pipeline* pipeline)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->closed = true;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+struct _pipeline_buffer* pipeline_consume(struct _pipeline* pipeline)
+{
+	struct _pipeline_buffer* buffer = NULL;
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (!pipeline->count && !pipeline->closed && !pipeline->aborted)
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+	if (pipeline->count && !pipeline->aborted)
+		buffer = &pipeline->buffers[pipeline->first];
+	pthread_mutex_unlock(&pipeline->lock);
+	return buffer;
+}
+
+void pipeline_release(struct _pipeline* pipeline)
+{
+	// the buffer being consumed stays counted until released, so that
+	// the producer never reuses it
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->first = (pipeline->first + 1) % pipeline->nb_buffers;
+	pipeline->count--;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+void pipeline_abort(struct _pipeline* pipeline)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->aborted = true;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PIPELINE_MAX_BUFFERS 8
+
+struct _pipeline_buffer {
+	uint8_t* data;
+	uint32_t addr;
+	uint32_t size;
+};
+
+// Bounded ring of buffers passed from one producer thread to one consumer
+// thread.  Buffers are filled and consumed in order, the producer blocks
+// when all buffers are in use and the consumer when none is ready.
+struct _pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct _pipeline_buffer buffers[PIPELINE_MAX_BUFFERS];
+	uint32_t nb_buffers;
+	uint32_t first;
+	uint32_t count;
+	bool closed;
+	bool aborted;
+};
+
+extern bool pipeline_init(struct _pipeline* pipeline, uint32_t nb_buffers,
+		uint32_t buffer_size);
+
+extern void pipeline_free(struct _pipeline* pipeline);
+
+// Producer side: get the next free buffer (NULL if the pipeline was aborted),
+// then pass it to the consumer once filled.
+extern struct _pipeline_buffer* pipeline_produce(struct _pipeline* pipeline);
+
+extern void pipeline_commit(struct _pipeline* pipeline);
+
+// No more buffers will be produced
+extern void pipeline_close(struct _pipeline* pipeline);
+
+// Consumer side: get the oldest filled buffer (NULL once the pipeline is
+// closed and empty, or aborted), then give it back once processed.
+extern struct _pipeline_buffer* pipeline_consume(struct _pipeline* pipeline);
+
+extern void pipeline_release(struct _pipeline* pipeline);
+
+// Stop both sides, on error
+extern void pipeline_abort(struct _pipeline* pipeline);
+
+#endif /* PIPELINE_H_ */
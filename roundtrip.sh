@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# Copyright (c) 2015-2016, Atmel Corporation.
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms and conditions of the GNU General Public License,
+# version 2, as published by the Free Software Foundation.
+#
+# This program is distributed in the hope it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# Round trips through the SAM-BA monitor emulator: images are written,
+# verified and read back with the main options, on a clean line, on a
+# monitor with transfer limits and the 512 bytes bug, and on a faulty line.
+# Run by 'make check' from the source directory.
+
+USAMBA=./usamba
+SAMBAEMU=./sambaemu
+
+dir=$(mktemp -d /tmp/roundtripXXXXXX) || exit 2
+tty=$dir/tty
+emu=
+tests=0
+failures=0
+
+stop_emu() {
+	if [ -n "$emu" ]; then
+		kill -INT $emu 2>/dev/null
+		wait $emu 2>/dev/null
+		emu=
+	fi
+	rm -f $tty
+}
+
+start_emu() {
+	stop_emu
+	$SAMBAEMU "$@" -l $tty >/dev/null 2>$dir/emu.log &
+	emu=$!
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		[ -e $tty ] && return 0
+		sleep 0.1
+	done
+	echo "FAILED: sambaemu $* did not start"
+	exit 1
+}
+
+trap 'stop_emu; rm -rf $dir' EXIT
+
+# run <description> <command>...: the command must succeed
+run() {
+	name=$1
+	shift
+	tests=$((tests + 1))
+	if ! "$@" >$dir/log 2>&1; then
+		echo "FAILED: $name"
+		sed 's/^/    /' $dir/log
+		failures=$((failures + 1))
+	fi
+}
+
+# check_read <description> <file> <address> [options]: the flash content at
+# the address must be the file
+check_read() {
+	name=$1
+	file=$2
+	addr=$3
+	shift 3
+	run "$name (read)" $USAMBA "$@" $tty read $dir/read.bin $addr $(wc -c <$file)
+	run "$name (compare)" cmp $file $dir/read.bin
+}
+
+head -c 100000 /dev/urandom >$dir/data.bin
+head -c 70000 /dev/urandom >$dir/small.bin
+
+start_emu
+run "write" $USAMBA $tty write $dir/data.bin 0x10100
+run "verify" $USAMBA $tty verify $dir/data.bin 0x10100
+check_read "write" $dir/data.bin 0x10100
+run "write with erase" $USAMBA --erase $tty write $dir/small.bin 0x10300
+check_read "write with erase" $dir/small.bin 0x10300
+run "applet write" $USAMBA --applet --erase $tty write $dir/data.bin 0x40000
+run "crc verify" $USAMBA --crc $tty verify $dir/data.bin 0x40000
+run "diff write" $USAMBA --applet --diff $tty write $dir/data.bin 0x40000
+check_read "applet write" $dir/data.bin 0x40000 --crc
+run "stream write" sh -c "$USAMBA --erase $tty write - 0x80100 <$dir/data.bin"
+run "stream verify" sh -c "$USAMBA $tty verify - 0x80100 <$dir/data.bin"
+check_read "stream write" $dir/data.bin 0x80100
+
+# sparse ELF files are written back at their own addresses
+run "sparse read" $USAMBA --sparse $tty read $dir/sparse.elf 0x80000 0x40000
+run "erase" $USAMBA $tty erase 0x80000 0x40000
+run "sparse write" $USAMBA $tty write $dir/sparse.elf
+check_read "sparse write" $dir/data.bin 0x80100
+
+# 'R' and 'S' size limits and the transfers of exactly 512 bytes
+start_emu -m 2048 -s 1024 -B
+run "limits: applet write" $USAMBA --applet --erase $tty write $dir/data.bin 0x20000
+run "limits: verify" $USAMBA $tty verify $dir/data.bin 0x20000
+check_read "limits: write" $dir/data.bin 0x20000
+head -c 512 $dir/data.bin >$dir/bad.bin
+check_read "limits: 512 bytes" $dir/bad.bin 0x20000
+
+# one response in 50 truncated
+start_emu -d 50
+run "faults: write" $USAMBA --timeout 100 $tty write $dir/small.bin 0x60000
+run "faults: verify" $USAMBA --timeout 100 $tty verify $dir/small.bin 0x60000
+check_read "faults: write" $dir/small.bin 0x60000 --timeout 100
+run "faults: buffered verify" $USAMBA --io buffered --timeout 100 $tty verify $dir/small.bin 0x60000
+
+echo "$tests round trips, $failures failures"
+[ $failures -eq 0 ]
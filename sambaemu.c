@@ -0,0 +1,1018 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * SAM-BA monitor emulator
+ *
+ * Opens a pseudo-terminal and answers the binary mode SAM-BA monitor
+ * commands on it, with a simulated SAMx7 memory map (flash, SRAM, CHIPID
+ * and EEFC).  It allows testing and benchmarking usamba without any board:
+ *
+ *     ./sambaemu -l /tmp/ttySAMBA &
+ *     ./usamba /tmp/ttySAMBA write firmware.bin 0
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "applet.h"
+#include "chipid.h"
+#include "crc32.h"
+#include "eefc.h"
+#include "framing.h"
+#include "utils.h"
+
+#define SRAM_ADDR 0x20400000
+#define SRAM_SIZE (384 * 1024)
+
+#define LOCK_SIZE (16 * 1024)
+
+#define MAX_LOCKS 256
+#define MAX_FRR (8 + MAX_LOCKS)
+
+#define EEFC_FCR_FCMD_MAX  0x20
+
+#define EMU_UNIQUE_ID "SAMBAEMU00000001"
+
+struct _emu_timing {
+	uint32_t byte_ns;      // link cost per transferred byte
+	uint32_t command_us;   // link cost per monitor command
+	uint32_t transfer_us;  // link turnaround per host transfer
+	uint32_t write_us;     // WP/EWP busy time
+	uint32_t erase_us;     // EPA busy time per erased page
+	uint32_t erase_all_us; // EA busy time
+	uint32_t bit_us;       // SLB/CLB/SGPB/CGPB busy time
+	uint32_t applet_ns;    // applet processing time per byte
+};
+
+struct _emu_stats {
+	uint64_t commands[128];
+	uint64_t eefc[EEFC_FCR_FCMD_MAX];
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t fsr_reads;
+	uint64_t fsr_busy;
+	uint64_t errors;
+	uint64_t dropped;
+};
+
+struct _emu {
+	const struct _chip* chip;
+	const struct _chip_serie* serie;
+	bool verbose;
+	uint32_t drop_rate;
+	uint32_t max_read;
+	uint32_t max_write;
+	bool bad_size;
+
+	uint8_t* flash;
+	uint32_t flash_size;
+	uint32_t nb_pages;
+	uint8_t sram[SRAM_SIZE];
+	uint32_t latch[EEFC_PAGE_SIZE / 4];
+
+	uint32_t nb_locks;
+	uint32_t locks[MAX_LOCKS / 32];
+	uint32_t gpnvm;
+	uint8_t unique_id[EEFC_UNIQUE_ID_SIZE];
+	bool unique_id_mapped;
+
+	uint32_t fmr;
+	uint32_t fsr;
+	uint32_t frr[MAX_FRR];
+	uint32_t frr_count;
+	uint32_t frr_index;
+	struct timespec busy_until;
+
+	struct _emu_timing timing;
+	struct timespec link_time;
+	struct _emu_stats stats;
+};
+
+static volatile sig_atomic_t _quit;
+static volatile sig_atomic_t _dump_stats;
+
+static void signal_handler(int sig)
+{
+	if (sig == SIGUSR1)
+		_dump_stats = 1;
+	else
+		_quit = 1;
+}
+
+static void timespec_add_ns(struct timespec* ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+static bool timespec_before(const struct timespec* a, const struct timespec* b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+// the link delays are accumulated on a virtual link clock so that small costs
+// are not lost to sleep granularity
+static void emu_delay(struct _emu* emu, uint64_t ns)
+{
+	if (!ns)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_before(&emu->link_time, &now))
+		emu->link_time = now;
+	timespec_add_ns(&emu->link_time, ns);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				&emu->link_time, NULL) == EINTR && !_quit);
+}
+
+// account for the link time of a command
+static void emu_link_delay(struct _emu* emu, uint32_t bytes)
+{
+	emu_delay(emu, (uint64_t)emu->timing.command_us * 1000 +
+			(uint64_t)emu->timing.byte_ns * bytes);
+}
+
+static void emu_set_busy(struct _emu* emu, uint64_t us)
+{
+	clock_gettime(CLOCK_MONOTONIC, &emu->busy_until);
+	timespec_add_ns(&emu->busy_until, us * 1000);
+}
+
+static bool emu_is_busy(struct _emu* emu)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_before(&now, &emu->busy_until);
+}
+
+static bool emu_page_locked(struct _emu* emu, uint32_t page)
+{
+	uint32_t lock = page * EEFC_PAGE_SIZE / LOCK_SIZE;
+	return emu->locks[lock / 32] & (1 << (lock % 32));
+}
+
+static void emu_push_result(struct _emu* emu, uint32_t value)
+{
+	if (emu->frr_count < MAX_FRR)
+		emu->frr[emu->frr_count++] = value;
+}
+
+static void emu_write_page(struct _emu* emu, uint32_t page, bool erase)
+{
+	uint32_t* dst = (uint32_t*)(emu->flash + page * EEFC_PAGE_SIZE);
+	for (int i = 0; i < EEFC_PAGE_SIZE / 4; i++) {
+		// programming can only clear bits
+		dst[i] = (erase ? 0xffffffff : dst[i]) & emu->latch[i];
+		emu->latch[i] = 0xffffffff;
+	}
+}
+
+// while the unique identifier is mapped (between STUI and SPUI), it replaces
+// the content of the flash
+static void emu_read_flash(struct _emu* emu, uint8_t* buffer, uint32_t offset, uint32_t size)
+{
+	if (!emu->unique_id_mapped) {
+		memcpy(buffer, emu->flash + offset, size);
+		return;
+	}
+	for (uint32_t i = 0; i < size; i++)
+		buffer[i] = emu->unique_id[(offset + i) % EEFC_UNIQUE_ID_SIZE];
+}
+
+static bool emu_erase_pages(struct _emu* emu, uint32_t arg)
+{
+	uint32_t count = 4 << (arg & 3);
+	uint32_t first = arg & ~(count - 1);
+	uint32_t small_pages = EEFC_SMALL_SECTOR_PAGES * EEFC_NB_SMALL_SECTORS;
+
+	if (first + count > emu->nb_pages)
+		return false;
+	// 4 and 8 pages erase are only allowed in small sectors, 32 pages
+	// erase only outside of them
+	if (count <= 8 && first >= small_pages)
+		return false;
+	if (count == 32 && first < small_pages)
+		return false;
+
+	for (uint32_t page = first; page < first + count; page++) {
+		if (emu_page_locked(emu, page)) {
+			emu->fsr |= EEFC_FSR_FLOCKE;
+			return true;
+		}
+	}
+
+	memset(emu->flash + first * EEFC_PAGE_SIZE, 0xff, count * EEFC_PAGE_SIZE);
+	emu_set_busy(emu, (uint64_t)emu->timing.erase_us * count);
+	return true;
+}
+
+static void emu_eefc_command(struct _emu* emu, uint32_t value)
+{
+	uint8_t cmd = value & 0xff;
+	uint32_t arg = (value >> 8) & 0xffff;
+	bool valid = true;
+
+	if ((value & 0xff000000) != EEFC_FCR_FKEY || emu_is_busy(emu)) {
+		emu->fsr |= EEFC_FSR_CMDE;
+		emu->stats.errors++;
+		return;
+	}
+
+	if (cmd < EEFC_FCR_FCMD_MAX)
+		emu->stats.eefc[cmd]++;
+	if (emu->verbose)
+		fprintf(stderr, "EEFC command 0x%02x arg 0x%04x\n", cmd, arg);
+
+	emu->frr_count = 0;
+	emu->frr_index = 0;
+
+	switch (cmd) {
+		case EEFC_FCR_FCMD_GETD:
+		{
+			emu_push_result(emu, 0x00000000);
+			emu_push_result(emu, emu->flash_size);
+			emu_push_result(emu, EEFC_PAGE_SIZE);
+			emu_push_result(emu, 1);
+			emu_push_result(emu, emu->flash_size);
+			emu_push_result(emu, emu->nb_locks);
+			for (uint32_t i = 0; i < emu->nb_locks && emu->frr_count < MAX_FRR; i++)
+				emu_push_result(emu, LOCK_SIZE);
+			break;
+		}
+
+		case EEFC_FCR_FCMD_WP:
+		case EEFC_FCR_FCMD_WPL:
+		case EEFC_FCR_FCMD_EWP:
+		case EEFC_FCR_FCMD_EWPL:
+		{
+			if (arg >= emu->nb_pages) {
+				valid = false;
+				break;
+			}
+			if (emu_page_locked(emu, arg)) {
+				emu->fsr |= EEFC_FSR_FLOCKE;
+				break;
+			}
+			bool erase = cmd == EEFC_FCR_FCMD_EWP || cmd == EEFC_FCR_FCMD_EWPL;
+			emu_write_page(emu, arg, erase);
+			if (cmd == EEFC_FCR_FCMD_WPL || cmd == EEFC_FCR_FCMD_EWPL) {
+				uint32_t lock = arg * EEFC_PAGE_SIZE / LOCK_SIZE;
+				emu->locks[lock / 32] |= 1 << (lock % 32);
+			}
+			emu_set_busy(emu, emu->timing.write_us +
+					(erase ? emu->timing.erase_us : 0));
+			break;
+		}
+
+		case EEFC_FCR_FCMD_EA:
+		{
+			for (uint32_t i = 0; i < ARRAY_SIZE(emu->locks); i++) {
+				if (emu->locks[i]) {
+					emu->fsr |= EEFC_FSR_FLOCKE;
+					break;
+				}
+			}
+			if (emu->fsr & EEFC_FSR_FLOCKE)
+				break;
+			memset(emu->flash, 0xff, emu->flash_size);
+			emu_set_busy(emu, emu->timing.erase_all_us);
+			break;
+		}
+
+		case EEFC_FCR_FCMD_EPA:
+			valid = emu_erase_pages(emu, arg);
+			break;
+
+		case EEFC_FCR_FCMD_SLB:
+		case EEFC_FCR_FCMD_CLB:
+		{
+			// the argument is a page number inside the lock region
+			if (arg >= emu->nb_pages) {
+				valid = false;
+				break;
+			}
+			uint32_t lock = arg * EEFC_PAGE_SIZE / LOCK_SIZE;
+			if (cmd == EEFC_FCR_FCMD_SLB)
+				emu->locks[lock / 32] |= 1 << (lock % 32);
+			else
+				emu->locks[lock / 32] &= ~(1 << (lock % 32));
+			emu_set_busy(emu, emu->timing.bit_us);
+			break;
+		}
+
+		case EEFC_FCR_FCMD_GLB:
+		{
+			for (uint32_t i = 0; i < (emu->nb_locks + 31) / 32; i++)
+				emu_push_result(emu, emu->locks[i]);
+			break;
+		}
+
+		case EEFC_FCR_FCMD_SGPB:
+		case EEFC_FCR_FCMD_CGPB:
+		{
+			if (arg >= emu->chip->gpnvm) {
+				valid = false;
+				break;
+			}
+			if (cmd == EEFC_FCR_FCMD_SGPB)
+				emu->gpnvm |= 1 << arg;
+			else
+				emu->gpnvm &= ~(1 << arg);
+			emu_set_busy(emu, emu->timing.bit_us);
+			break;
+		}
+
+		case EEFC_FCR_FCMD_GGPB:
+			emu_push_result(emu, emu->gpnvm);
+			break;
+
+		case EEFC_FCR_FCMD_STUI:
+			emu->unique_id_mapped = true;
+			break;
+
+		case EEFC_FCR_FCMD_SPUI:
+			emu->unique_id_mapped = false;
+			break;
+
+		default:
+			valid = false;
+			break;
+	}
+
+	if (!valid) {
+		emu->fsr |= EEFC_FSR_CMDE;
+		emu->stats.errors++;
+	}
+}
+
+static uint32_t emu_read_eefc(struct _emu* emu, uint32_t reg)
+{
+	switch (reg) {
+		case EEFC_FMR:
+			return emu->fmr;
+
+		case EEFC_FSR:
+		{
+			emu->stats.fsr_reads++;
+			if (emu_is_busy(emu) || emu->unique_id_mapped) {
+				emu->stats.fsr_busy++;
+				return 0;
+			}
+			// error flags are cleared on read
+			uint32_t value = EEFC_FSR_FRDY | emu->fsr;
+			emu->fsr = 0;
+			return value;
+		}
+
+		case EEFC_FRR:
+			if (emu_is_busy(emu) || emu->frr_index >= emu->frr_count)
+				return 0;
+			return emu->frr[emu->frr_index++];
+
+		default:
+			return 0;
+	}
+}
+
+static uint32_t emu_read(struct _emu* emu, uint32_t addr, int width)
+{
+	uint32_t flash_addr = emu->chip->flash_addr;
+	uint32_t value = 0;
+
+	if (addr >= flash_addr && addr + width <= flash_addr + emu->flash_size) {
+		emu_read_flash(emu, (uint8_t*)&value, addr - flash_addr, width);
+	} else if (addr >= SRAM_ADDR && addr + width <= SRAM_ADDR + SRAM_SIZE) {
+		memcpy(&value, emu->sram + addr - SRAM_ADDR, width);
+	} else if (addr == emu->serie->cidr_reg) {
+		value = emu->chip->cidr;
+	} else if (addr == emu->serie->exid_reg) {
+		value = emu->chip->exid;
+	} else if (addr >= emu->chip->eefc_base && addr < emu->chip->eefc_base + 0x10) {
+		value = emu_read_eefc(emu, addr - emu->chip->eefc_base);
+	} else if (emu->verbose) {
+		fprintf(stderr, "Read from unmapped address 0x%08x\n", addr);
+	}
+
+	return value;
+}
+
+static void emu_write(struct _emu* emu, uint32_t addr, uint32_t value, int width)
+{
+	uint32_t flash_addr = emu->chip->flash_addr;
+
+	if (addr >= flash_addr && addr + width <= flash_addr + emu->flash_size) {
+		// flash writes go to the latch buffer, which only supports
+		// word accesses
+		if (width != 4 || (addr & 3)) {
+			if (emu->verbose)
+				fprintf(stderr, "Ignored %d-byte write to flash at 0x%08x\n",
+						width, addr);
+			emu->stats.errors++;
+			return;
+		}
+		emu->latch[(addr % EEFC_PAGE_SIZE) / 4] = value;
+	} else if (addr >= SRAM_ADDR && addr + width <= SRAM_ADDR + SRAM_SIZE) {
+		memcpy(emu->sram + addr - SRAM_ADDR, &value, width);
+	} else if (addr == emu->chip->eefc_base + EEFC_FMR) {
+		emu->fmr = value;
+	} else if (addr == emu->chip->eefc_base + EEFC_FCR) {
+		emu_eefc_command(emu, value);
+	} else if (emu->verbose) {
+		fprintf(stderr, "Write to unmapped address 0x%08x\n", addr);
+	}
+}
+
+static void emu_read_block(struct _emu* emu, uint8_t* buffer, uint32_t addr, uint32_t size)
+{
+	uint32_t flash_addr = emu->chip->flash_addr;
+
+	if (addr >= flash_addr && addr + size <= flash_addr + emu->flash_size) {
+		emu_read_flash(emu, buffer, addr - flash_addr, size);
+	} else if (addr >= SRAM_ADDR && addr + size <= SRAM_ADDR + SRAM_SIZE) {
+		memcpy(buffer, emu->sram + addr - SRAM_ADDR, size);
+	} else {
+		for (uint32_t i = 0; i < size; i++)
+			buffer[i] = emu_read(emu, addr + i, 1);
+	}
+}
+
+static void emu_write_block(struct _emu* emu, const uint8_t* buffer, uint32_t addr, uint32_t size)
+{
+	if (addr >= SRAM_ADDR && addr + size <= SRAM_ADDR + SRAM_SIZE) {
+		memcpy(emu->sram + addr - SRAM_ADDR, buffer, size);
+	} else {
+		// like the real monitor, use byte accesses
+		for (uint32_t i = 0; i < size; i++)
+			emu_write(emu, addr + i, buffer[i], 1);
+	}
+}
+
+static void emu_wait_ready(struct _emu* emu)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				&emu->busy_until, NULL) == EINTR && !_quit);
+}
+
+static void emu_applet_delay(struct _emu* emu, uint64_t bytes)
+{
+	if (!emu->timing.applet_ns)
+		return;
+
+	struct timespec until;
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	timespec_add_ns(&until, bytes * emu->timing.applet_ns);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				&until, NULL) == EINTR && !_quit);
+}
+
+// the applet cannot be executed, so it is replaced by a native
+// implementation of its mailbox protocol
+static bool emu_run_applet(struct _emu* emu, uint32_t addr)
+{
+	uint8_t* code = emu->sram + APPLET_ADDR - SRAM_ADDR;
+	uint32_t* header = (uint32_t*)code;
+
+	if (addr != APPLET_ADDR || header[1] != ((APPLET_ADDR + 8) | 1) ||
+			memcmp(code + 8, applet_code + 8, applet_code_size - 8)) {
+		if (emu->verbose)
+			fprintf(stderr, "Unknown code at 0x%08x\n", addr);
+		return false;
+	}
+
+	struct _applet_mailbox* mailbox = (struct _applet_mailbox*)
+		(emu->sram + APPLET_MAILBOX - SRAM_ADDR);
+	mailbox->result = 0;
+
+	if (emu->verbose)
+		fprintf(stderr, "Applet command %d\n", mailbox->command);
+
+	switch (mailbox->command) {
+		case APPLET_CMD_WRITE_PAGES:
+		{
+			uint32_t eefc = mailbox->args[0];
+			uint32_t latch = mailbox->args[1];
+			uint32_t page = mailbox->args[2];
+			uint32_t src = mailbox->args[4];
+			mailbox->status = 0;
+			for (uint32_t i = 0; i < mailbox->args[3]; i++) {
+				for (int j = 0; j < EEFC_PAGE_SIZE / 4; j++) {
+					emu_write(emu, latch, emu_read(emu, src, 4), 4);
+					latch += 4;
+					src += 4;
+				}
+				emu_applet_delay(emu, EEFC_PAGE_SIZE);
+				emu_write(emu, eefc + EEFC_FCR, (page << 8) | mailbox->args[5], 4);
+				emu_wait_ready(emu);
+				mailbox->status = emu_read(emu, eefc + EEFC_FSR, 4) &
+					(EEFC_FSR_CMDE | EEFC_FSR_FLOCKE | EEFC_FSR_FLERR);
+				if (mailbox->status)
+					break;
+				mailbox->result++;
+				page++;
+			}
+			break;
+		}
+
+		case APPLET_CMD_CRC32:
+		{
+			uint32_t addr = mailbox->args[0];
+			uint32_t region_size = mailbox->args[1];
+			uint32_t dst = mailbox->args[3];
+			uint8_t* buffer = malloc(region_size ? region_size : 1);
+			if (!buffer) {
+				mailbox->status = 0xffffffff;
+				break;
+			}
+			for (uint32_t i = 0; i < mailbox->args[2]; i++) {
+				emu_read_block(emu, buffer, addr, region_size);
+				emu_write(emu, dst, crc32(buffer, region_size), 4);
+				addr += region_size;
+				dst += 4;
+				mailbox->result++;
+			}
+			free(buffer);
+			emu_applet_delay(emu, (uint64_t)region_size * mailbox->args[2]);
+			mailbox->status = 0;
+			break;
+		}
+
+		default:
+			mailbox->status = 0xffffffff;
+			break;
+	}
+
+	return true;
+}
+
+static bool write_all(int fd, const void* buffer, size_t size)
+{
+	const uint8_t* ptr = buffer;
+	while (size > 0) {
+		ssize_t count = write(fd, ptr, size);
+		if (count < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return false;
+		}
+		ptr += count;
+		size -= count;
+	}
+	return true;
+}
+
+static bool emu_respond(struct _emu* emu, int fd, const void* buffer, uint32_t size)
+{
+	// simulate a faulty line: lose the end of one response in drop_rate
+	if (emu->drop_rate && size && rand() % emu->drop_rate == 0) {
+		size = rand() % size;
+		emu->stats.dropped++;
+	}
+	emu->stats.bytes_out += size;
+	return write_all(fd, buffer, size);
+}
+
+// Like a monitor with a transfer size limit or with the bug on transfers
+// of FRAMING_BAD_SIZE bytes: such a 'R' is not answered and the data of such
+// a 'S' is lost
+static bool emu_mishandles(struct _emu* emu, uint32_t size, uint32_t max_transfer)
+{
+	if ((max_transfer && size > max_transfer) ||
+			(emu->bad_size && size == FRAMING_BAD_SIZE)) {
+		if (emu->verbose)
+			fprintf(stderr, "Mishandled transfer of %u bytes\n", size);
+		emu->stats.errors++;
+		return true;
+	}
+	return false;
+}
+
+enum {
+	STATE_COMMAND,
+	STATE_ADDR,
+	STATE_ARG,
+	STATE_DATA,
+};
+
+struct _parser {
+	int state;
+	char command;
+	uint32_t addr;
+	uint32_t arg;
+	uint32_t length;
+	uint8_t* data;
+	uint32_t data_count;
+};
+
+static bool emu_execute(struct _emu* emu, int fd, struct _parser* p)
+{
+	emu->stats.commands[(int)p->command]++;
+
+	if (emu->verbose)
+		fprintf(stderr, "%c%08x,%08x#\n", p->command, p->addr, p->arg);
+
+	switch (p->command) {
+		case 'N':
+		case 'T':
+			emu_link_delay(emu, p->length + 2);
+			return emu_respond(emu, fd, "\n\r", 2);
+
+		case 'V':
+		{
+			static const char version[] = "v1.0 sambaemu\n\r";
+			emu_link_delay(emu, p->length + sizeof(version) - 1);
+			return emu_respond(emu, fd, version, sizeof(version) - 1);
+		}
+
+		case 'o':
+		case 'h':
+		case 'w':
+		{
+			int width = p->command == 'o' ? 1 : p->command == 'h' ? 2 : 4;
+			uint32_t value = emu_read(emu, p->addr, width);
+			emu_link_delay(emu, p->length + width);
+			return emu_respond(emu, fd, &value, width);
+		}
+
+		case 'O':
+		case 'H':
+		case 'W':
+		{
+			int width = p->command == 'O' ? 1 : p->command == 'H' ? 2 : 4;
+			emu_link_delay(emu, p->length);
+			emu_write(emu, p->addr, p->arg, width);
+			return true;
+		}
+
+		case 'R':
+		{
+			if (emu_mishandles(emu, p->arg, emu->max_read))
+				return true;
+			uint8_t* buffer = malloc(p->arg ? p->arg : 1);
+			if (!buffer)
+				return false;
+			emu_read_block(emu, buffer, p->addr, p->arg);
+			emu_link_delay(emu, p->length + p->arg);
+			bool ok = emu_respond(emu, fd, buffer, p->arg);
+			free(buffer);
+			return ok;
+		}
+
+		case 'S':
+			emu_link_delay(emu, p->length + p->arg);
+			if (!emu_mishandles(emu, p->arg, emu->max_write))
+				emu_write_block(emu, p->data, p->addr, p->arg);
+			return true;
+
+		case 'G':
+			emu_link_delay(emu, p->length);
+			if (!emu_run_applet(emu, p->addr))
+				emu->stats.errors++;
+			return true;
+
+		default:
+			if (emu->verbose)
+				fprintf(stderr, "Unknown command '%c'\n", p->command);
+			emu->stats.errors++;
+			return true;
+	}
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static bool emu_parse(struct _emu* emu, int fd, struct _parser* p,
+		const uint8_t* buffer, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		char c = buffer[i];
+
+		if (p->state == STATE_DATA) {
+			uint32_t count = MIN(size - i, p->arg - p->data_count);
+			memcpy(p->data + p->data_count, buffer + i, count);
+			p->data_count += count;
+			i += count - 1;
+			if (p->data_count == p->arg) {
+				bool ok = emu_execute(emu, fd, p);
+				free(p->data);
+				p->data = NULL;
+				p->state = STATE_COMMAND;
+				if (!ok)
+					return false;
+			}
+			continue;
+		}
+
+		p->length++;
+
+		if (p->state == STATE_COMMAND) {
+			if (c == '\n' || c == '\r' || c == ' ') {
+				p->length = 0;
+				continue;
+			}
+			p->command = c & 0x7f;
+			p->addr = 0;
+			p->arg = 0;
+			p->state = STATE_ADDR;
+		} else if (c == '#') {
+			if (p->command == 'S' && p->arg > 0) {
+				p->data = malloc(p->arg);
+				if (!p->data)
+					return false;
+				p->data_count = 0;
+				p->state = STATE_DATA;
+			} else {
+				p->state = STATE_COMMAND;
+				if (!emu_execute(emu, fd, p))
+					return false;
+			}
+			p->length = 0;
+		} else if (c == ',') {
+			p->state = STATE_ARG;
+		} else {
+			int value = hex_value(c);
+			if (value < 0) {
+				// like the monitor, start a new command with it
+				if (emu->verbose)
+					fprintf(stderr, "Unexpected character 0x%02x\n", (uint8_t)c);
+				emu->stats.errors++;
+				p->command = c & 0x7f;
+				p->addr = 0;
+				p->arg = 0;
+				p->state = STATE_ADDR;
+				p->length = 1;
+			} else if (p->state == STATE_ADDR) {
+				p->addr = (p->addr << 4) | value;
+			} else {
+				p->arg = (p->arg << 4) | value;
+			}
+		}
+	}
+	return true;
+}
+
+static void print_stats(struct _emu* emu)
+{
+	static const char commands[] = "NTVwWRSGoOhH";
+	static const char* eefc_names[EEFC_FCR_FCMD_MAX] = {
+		[EEFC_FCR_FCMD_GETD] = "GETD", [EEFC_FCR_FCMD_WP] = "WP",
+		[EEFC_FCR_FCMD_WPL] = "WPL", [EEFC_FCR_FCMD_EWP] = "EWP",
+		[EEFC_FCR_FCMD_EWPL] = "EWPL", [EEFC_FCR_FCMD_EA] = "EA",
+		[EEFC_FCR_FCMD_EPA] = "EPA", [EEFC_FCR_FCMD_SLB] = "SLB",
+		[EEFC_FCR_FCMD_CLB] = "CLB", [EEFC_FCR_FCMD_GLB] = "GLB",
+		[EEFC_FCR_FCMD_SGPB] = "SGPB", [EEFC_FCR_FCMD_CGPB] = "CGPB",
+		[EEFC_FCR_FCMD_GGPB] = "GGPB", [EEFC_FCR_FCMD_STUI] = "STUI",
+		[EEFC_FCR_FCMD_SPUI] = "SPUI",
+	};
+
+	fprintf(stderr, "Monitor commands:");
+	for (int i = 0; commands[i]; i++)
+		if (emu->stats.commands[(int)commands[i]])
+			fprintf(stderr, " %c=%llu", commands[i],
+					(unsigned long long)emu->stats.commands[(int)commands[i]]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "EEFC commands:");
+	for (int i = 0; i < EEFC_FCR_FCMD_MAX; i++)
+		if (emu->stats.eefc[i])
+			fprintf(stderr, " %s=%llu", eefc_names[i] ? eefc_names[i] : "?",
+					(unsigned long long)emu->stats.eefc[i]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "FSR reads: %llu (%llu while busy)\n",
+			(unsigned long long)emu->stats.fsr_reads,
+			(unsigned long long)emu->stats.fsr_busy);
+	fprintf(stderr, "Bytes: %llu received, %llu sent\n",
+			(unsigned long long)emu->stats.bytes_in,
+			(unsigned long long)emu->stats.bytes_out);
+	fprintf(stderr, "Errors: %llu\n", (unsigned long long)emu->stats.errors);
+	if (emu->drop_rate)
+		fprintf(stderr, "Dropped responses: %llu\n",
+				(unsigned long long)emu->stats.dropped);
+}
+
+static bool emu_init(struct _emu* emu, const char* name)
+{
+	emu->serie = chipid_get_serie("samx7");
+	for (int i = 0; i < emu->serie->nb_chips; i++)
+		if (!strcasecmp(emu->serie->chips[i].name, name))
+			emu->chip = &emu->serie->chips[i];
+	if (!emu->chip) {
+		fprintf(stderr, "Unknown chip '%s'\n", name);
+		return false;
+	}
+
+	emu->flash_size = emu->chip->flash_size * 1024;
+	emu->nb_pages = emu->flash_size / EEFC_PAGE_SIZE;
+	emu->nb_locks = emu->flash_size / LOCK_SIZE;
+	emu->flash = malloc(emu->flash_size);
+	if (!emu->flash)
+		return false;
+	memset(emu->flash, 0xff, emu->flash_size);
+	memset(emu->latch, 0xff, sizeof(emu->latch));
+	// boot from flash
+	emu->gpnvm = 1 << 1;
+
+	return true;
+}
+
+static int open_pty(char** name)
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror("Could not open pseudo-terminal");
+		return -1;
+	}
+
+	if (grantpt(fd) != 0 || unlockpt(fd) != 0 || !(*name = ptsname(fd))) {
+		perror("Could not configure pseudo-terminal");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void usage(char* prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("\n");
+	printf("Options:\n");
+	printf("    -c <chip>   emulated chip (default: SAME70Q21)\n");
+	printf("    -l <path>   create a symbolic link to the pseudo-terminal\n");
+	printf("    -b <ns>     link latency per transferred byte\n");
+	printf("    -t <us>     link latency per monitor command\n");
+	printf("    -r <us>     link turnaround per transfer from the host\n");
+	printf("    -w <us>     flash busy time for a page write\n");
+	printf("    -e <us>     flash busy time per erased page\n");
+	printf("    -a <us>     flash busy time for an erase all\n");
+	printf("    -g <us>     flash busy time for lock and GPNVM bit commands\n");
+	printf("    -p <ns>     applet processing time per byte\n");
+	printf("    -u <id>     unique identifier, up to 16 characters (default: %s)\n",
+			EMU_UNIQUE_ID);
+	printf("    -d <n>      truncate one response in n, at random\n");
+	printf("    -m <bytes>  ignore the 'R' transfers larger than this\n");
+	printf("    -s <bytes>  ignore the 'S' transfers larger than this\n");
+	printf("    -B          ignore the 'R' and 'S' transfers of exactly %d bytes\n",
+			FRAMING_BAD_SIZE);
+	printf("    -L          start with all the lock regions locked\n");
+	printf("    -v          log all commands\n");
+	printf("\n");
+	printf("The pseudo-terminal name is printed on standard output.  Statistics\n");
+	printf("are printed on standard error on exit and when receiving SIGUSR1.\n");
+}
+
+static struct _emu _emu;
+
+int main(int argc, char *argv[])
+{
+	const char* chip_name = "SAME70Q21";
+	const char* link_name = NULL;
+	const char* unique_id = EMU_UNIQUE_ID;
+	bool lock_all = false;
+	struct _emu* emu = &_emu;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:l:b:t:r:w:e:a:g:p:u:d:m:s:BLvh")) != -1) {
+		switch (opt) {
+			case 'c': chip_name = optarg; break;
+			case 'l': link_name = optarg; break;
+			case 'b': emu->timing.byte_ns = strtol(optarg, NULL, 0); break;
+			case 't': emu->timing.command_us = strtol(optarg, NULL, 0); break;
+			case 'r': emu->timing.transfer_us = strtol(optarg, NULL, 0); break;
+			case 'w': emu->timing.write_us = strtol(optarg, NULL, 0); break;
+			case 'e': emu->timing.erase_us = strtol(optarg, NULL, 0); break;
+			case 'a': emu->timing.erase_all_us = strtol(optarg, NULL, 0); break;
+			case 'g': emu->timing.bit_us = strtol(optarg, NULL, 0); break;
+			case 'p': emu->timing.applet_ns = strtol(optarg, NULL, 0); break;
+			case 'u': unique_id = optarg; break;
+			case 'd': emu->drop_rate = strtol(optarg, NULL, 0); break;
+			case 'm': emu->max_read = strtol(optarg, NULL, 0); break;
+			case 's': emu->max_write = strtol(optarg, NULL, 0); break;
+			case 'B': emu->bad_size = true; break;
+			case 'L': lock_all = true; break;
+			case 'v': emu->verbose = true; break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if (!emu_init(emu, chip_name))
+		return -1;
+	strncpy((char*)emu->unique_id, unique_id, sizeof(emu->unique_id));
+	for (uint32_t i = 0; lock_all && i < emu->nb_locks; i++)
+		emu->locks[i / 32] |= 1u << (i % 32);
+
+	char* pty_name;
+	int fd = open_pty(&pty_name);
+	if (fd < 0)
+		return -1;
+
+	// keep the slave side open so that the master does not report a
+	// hangup between two client sessions
+	int slave = open(pty_name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror("Could not open pseudo-terminal slave");
+		return -1;
+	}
+	struct termios tty;
+	if (tcgetattr(slave, &tty) == 0) {
+		cfmakeraw(&tty);
+		tcsetattr(slave, TCSANOW, &tty);
+	}
+
+	if (link_name) {
+		unlink(link_name);
+		if (symlink(pty_name, link_name) != 0) {
+			perror("Could not create link");
+			return -1;
+		}
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	printf("%s\n", pty_name);
+	fflush(stdout);
+	fprintf(stderr, "Emulating Atmel %s\n", emu->chip->name);
+
+	struct _parser parser;
+	memset(&parser, 0, sizeof(parser));
+
+	uint8_t buffer[4096];
+	while (!_quit) {
+		if (_dump_stats) {
+			_dump_stats = 0;
+			print_stats(emu);
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+
+		ssize_t count = read(fd, buffer, sizeof(buffer));
+		if (count < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("Could not read from pseudo-terminal");
+			break;
+		}
+		emu->stats.bytes_in += count;
+
+		// each transfer from the host pays the link turnaround once,
+		// however many commands it holds
+		emu_delay(emu, (uint64_t)emu->timing.transfer_us * 1000);
+
+		if (!emu_parse(emu, fd, &parser, buffer, count)) {
+			fprintf(stderr, "Could not answer command\n");
+			break;
+		}
+	}
+
+	print_stats(emu);
+
+	if (link_name)
+		unlink(link_name);
+	close(slave);
+	close(fd);
+	free(emu->flash);
+
+	return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "stats.h"
+#include "utils.h"
+
+static const char* const op_names[STATS_NB_OPS] = {
+	[STATS_READ_WORD] = "read_word",
+	[STATS_WRITE_WORD] = "write_word",
+	[STATS_WRITE_WORDS] = "write_words",
+	[STATS_READ] = "read",
+	[STATS_WRITE] = "write",
+	[STATS_GO] = "go",
+	[STATS_APPLET] = "applet",
+	[STATS_EEFC + 0x00] = "eefc_getd",
+	[STATS_EEFC + 0x01] = "eefc_wp",
+	[STATS_EEFC + 0x02] = "eefc_wpl",
+	[STATS_EEFC + 0x03] = "eefc_ewp",
+	[STATS_EEFC + 0x04] = "eefc_ewpl",
+	[STATS_EEFC + 0x05] = "eefc_ea",
+	[STATS_EEFC + 0x07] = "eefc_epa",
+	[STATS_EEFC + 0x08] = "eefc_slb",
+	[STATS_EEFC + 0x09] = "eefc_clb",
+	[STATS_EEFC + 0x0a] = "eefc_glb",
+	[STATS_EEFC + 0x0b] = "eefc_sgpb",
+	[STATS_EEFC + 0x0c] = "eefc_cgpb",
+	[STATS_EEFC + 0x0d] = "eefc_ggpb",
+	[STATS_EEFC + 0x0e] = "eefc_stui",
+	[STATS_EEFC + 0x0f] = "eefc_spui",
+};
+
+static const char* const phase_names[STATS_NB_PHASES] = {
+	[STATS_PHASE_OPEN] = "open",
+	[STATS_PHASE_IDENTIFY] = "identify",
+	[STATS_PHASE_GETD] = "getd",
+	[STATS_PHASE_APPLET] = "applet",
+	[STATS_PHASE_DIFF] = "diff",
+	[STATS_PHASE_UNLOCK] = "unlock",
+	[STATS_PHASE_ERASE] = "erase",
+	[STATS_PHASE_WRITE] = "write",
+	[STATS_PHASE_VERIFY] = "verify",
+	[STATS_PHASE_READ] = "read",
+};
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t bucket_index(uint64_t ns)
+{
+	if (ns < 16)
+		return ns;
+	int msb = 63 - __builtin_clzll(ns);
+	uint32_t index = (msb - 3) * 16 + ((ns >> (msb - 4)) & 15);
+	return MIN(index, STATS_BUCKETS - 1);
+}
+
+// middle of the range of values falling in the bucket
+static uint64_t bucket_value(uint32_t index)
+{
+	if (index < 16)
+		return index;
+	int shift = index / 16 - 1;
+	return ((uint64_t)(16 + index % 16) << shift) + ((1ull << shift) >> 1);
+}
+
+struct _stats* stats_new(void)
+{
+	return calloc(1, sizeof(struct _stats));
+}
+
+void stats_free(struct _stats* stats)
+{
+	free(stats);
+}
+
+uint64_t stats_start(const struct _stats* stats)
+{
+	return stats ? now() : 0;
+}
+
+void stats_record(struct _stats* stats, int op, uint64_t bytes,
+		uint64_t start, uint32_t polls)
+{
+	if (!stats || op < 0 || op >= STATS_NB_OPS)
+		return;
+
+	uint64_t ns = now() - start;
+	struct _stats_op* s = &stats->ops[op];
+	s->count++;
+	s->bytes += bytes;
+	s->total_ns += ns;
+	s->max_ns = MAX(s->max_ns, ns);
+	s->polls += polls;
+	s->histogram[bucket_index(ns)]++;
+}
+
+void stats_phase(struct _stats* stats, int phase, uint64_t start)
+{
+	if (!stats || phase < 0 || phase >= STATS_NB_PHASES)
+		return;
+
+	stats->phases[phase] += now() - start;
+}
+
+void stats_set_framing(struct _stats* stats, uint32_t packet_size,
+		uint32_t max_transfer)
+{
+	if (!stats)
+		return;
+
+	stats->framing.packet_size = packet_size;
+	stats->framing.max_transfer = max_transfer;
+}
+
+void stats_framing(struct _stats* stats, uint32_t packets, bool is_short)
+{
+	if (!stats)
+		return;
+
+	stats->framing.chunks++;
+	stats->framing.packets += packets;
+	if (is_short)
+		stats->framing.short_packets++;
+}
+
+uint64_t stats_percentile(const struct _stats_op* op, double percentile)
+{
+	uint64_t rank = (uint64_t)(op->count * percentile / 100);
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < STATS_BUCKETS; i++) {
+		total += op->histogram[i];
+		if (total > rank)
+			return MIN(bucket_value(i), op->max_ns);
+	}
+	return op->max_ns;
+}
+
+void stats_print(const struct _stats* stats, FILE* file)
+{
+	fprintf(file, "%-12s %12s\n", "Phase", "Time (ms)");
+	for (int i = 0; i < STATS_NB_PHASES; i++) {
+		if (!stats->phases[i])
+			continue;
+		fprintf(file, "%-12s %12.3f\n", phase_names[i], stats->phases[i] / 1e6);
+	}
+	fprintf(file, "\n");
+
+	fprintf(file, "%-12s %8s %10s %12s %10s %10s %10s %10s %9s\n",
+			"Operation", "Count", "Bytes", "Total (ms)", "p50 (us)",
+			"p90 (us)", "p99 (us)", "Max (us)", "FSR polls");
+	for (int i = 0; i < STATS_NB_OPS; i++) {
+		const struct _stats_op* op = &stats->ops[i];
+		if (!op->count || !op_names[i])
+			continue;
+		fprintf(file, "%-12s %8llu %10llu %12.3f %10.1f %10.1f %10.1f %10.1f %9llu\n",
+				op_names[i], (unsigned long long)op->count,
+				(unsigned long long)op->bytes, op->total_ns / 1e6,
+				stats_percentile(op, 50) / 1e3, stats_percentile(op, 90) / 1e3,
+				stats_percentile(op, 99) / 1e3, op->max_ns / 1e3,
+				(unsigned long long)op->polls);
+	}
+
+	const struct _stats_framing* framing = &stats->framing;
+	if (framing->chunks)
+		fprintf(file, "\nFraming: %u byte packets, %u byte transfers, "
+				"%llu chunks in %llu packets, %llu short\n",
+				framing->packet_size, framing->max_transfer,
+				(unsigned long long)framing->chunks,
+				(unsigned long long)framing->packets,
+				(unsigned long long)framing->short_packets);
+}
+
+void stats_print_json(const struct _stats* stats, FILE* file)
+{
+	fprintf(file, "{\"phases\": {");
+	const char* sep = "";
+	for (int i = 0; i < STATS_NB_PHASES; i++) {
+		if (!stats->phases[i])
+			continue;
+		fprintf(file, "%s\"%s\": %.3f", sep, phase_names[i], stats->phases[i] / 1e6);
+		sep = ", ";
+	}
+
+	fprintf(file, "}, \"operations\": {");
+	sep = "";
+	for (int i = 0; i < STATS_NB_OPS; i++) {
+		const struct _stats_op* op = &stats->ops[i];
+		if (!op->count || !op_names[i])
+			continue;
+		fprintf(file, "%s\"%s\": {\"count\": %llu, \"bytes\": %llu, "
+				"\"total_ms\": %.3f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+				"\"p99_us\": %.1f, \"max_us\": %.1f, \"fsr_polls\": %llu}",
+				sep, op_names[i], (unsigned long long)op->count,
+				(unsigned long long)op->bytes, op->total_ns / 1e6,
+				stats_percentile(op, 50) / 1e3, stats_percentile(op, 90) / 1e3,
+				stats_percentile(op, 99) / 1e3, op->max_ns / 1e3,
+				(unsigned long long)op->polls);
+		sep = ", ";
+	}
+
+	const struct _stats_framing* framing = &stats->framing;
+	fprintf(file, "}, \"framing\": {\"packet_size\": %u, \"max_transfer\": %u, "
+			"\"chunks\": %llu, \"packets\": %llu, \"short_packets\": %llu}}",
+			framing->packet_size, framing->max_transfer,
+			(unsigned long long)framing->chunks,
+			(unsigned long long)framing->packets,
+			(unsigned long long)framing->short_packets);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Operations, EEFC commands are recorded at STATS_EEFC + command
+enum {
+	STATS_READ_WORD = 0,
+	STATS_WRITE_WORD,
+	STATS_WRITE_WORDS,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_GO,
+	STATS_APPLET,
+	STATS_EEFC,
+	STATS_NB_OPS = STATS_EEFC + 16,
+};
+
+enum {
+	STATS_PHASE_OPEN = 0,
+	STATS_PHASE_IDENTIFY,
+	STATS_PHASE_GETD,
+	STATS_PHASE_APPLET,
+	STATS_PHASE_DIFF,
+	STATS_PHASE_UNLOCK,
+	STATS_PHASE_ERASE,
+	STATS_PHASE_WRITE,
+	STATS_PHASE_VERIFY,
+	STATS_PHASE_READ,
+	STATS_NB_PHASES,
+};
+
+// Latencies are kept in a log-linear histogram: 16 buckets per power of
+// two, i.e. about 6% resolution, up to 2^40ns.
+#define STATS_BUCKETS 592
+
+struct _stats_op {
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t polls;
+	uint32_t histogram[STATS_BUCKETS];
+};
+
+// Chunks of the 'R' and 'S' transfers and the USB packets they take
+struct _stats_framing {
+	uint32_t packet_size;
+	uint32_t max_transfer;
+	uint64_t chunks;
+	uint64_t packets;
+	uint64_t short_packets;
+};
+
+struct _stats {
+	struct _stats_op ops[STATS_NB_OPS];
+	uint64_t phases[STATS_NB_PHASES];
+	struct _stats_framing framing;
+};
+
+extern struct _stats* stats_new(void);
+
+extern void stats_free(struct _stats* stats);
+
+// Timestamp of the start of an operation, 0 if statistics are disabled
+extern uint64_t stats_start(const struct _stats* stats);
+
+extern void stats_record(struct _stats* stats, int op, uint64_t bytes,
+		uint64_t start, uint32_t polls);
+
+extern void stats_phase(struct _stats* stats, int phase, uint64_t start);
+
+extern void stats_set_framing(struct _stats* stats, uint32_t packet_size,
+		uint32_t max_transfer);
+
+// Record a planned chunk taking the given number of packets
+extern void stats_framing(struct _stats* stats, uint32_t packets, bool is_short);
+
+extern uint64_t stats_percentile(const struct _stats_op* op, double percentile);
+
+extern void stats_print(const struct _stats* stats, FILE* file);
+
+extern void stats_print_json(const struct _stats* stats, FILE* file);
+
+#endif /* STATS_H_ */
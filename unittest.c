@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2015-2016, Atmel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Table tests of the host-side planners and parsers: erase plans, transfer
+ * framing, image formats, manifests and journals.  Run by 'make check',
+ * prints the failed cases and exits with a non-zero status if any failed.
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chipid.h"
+#include "command.h"
+#include "eefc.h"
+#include "framing.h"
+#include "image.h"
+#include "journal.h"
+#include "manifest.h"
+#include "pagemap.h"
+#include "utils.h"
+
+#define MAX_EXPECTED 4
+
+static int _tests;
+static int _failures;
+static char _dir[] = "/tmp/unittestXXXXXX";
+
+static bool check(bool ok, const char* fmt, ...)
+{
+	_tests++;
+	if (!ok) {
+		va_list ap;
+		va_start(ap, fmt);
+		printf("FAILED: ");
+		vprintf(fmt, ap);
+		printf("\n");
+		va_end(ap);
+		_failures++;
+	}
+	return ok;
+}
+
+static char* temp_path(const char* name)
+{
+	static char path[256];
+	snprintf(path, sizeof(path), "%s/%s", _dir, name);
+	return path;
+}
+
+static const char* write_file(const char* name, const void* data, size_t size)
+{
+	const char* path = temp_path(name);
+	FILE* file = fopen(path, "w");
+	if (!file || fwrite(data, 1, size, file) != size) {
+		perror(path);
+		exit(2);
+	}
+	fclose(file);
+	return path;
+}
+
+static const struct _chip* test_chip(void)
+{
+	const struct _chip_serie* serie = chipid_get_serie("samx7");
+	for (uint32_t i = 0; i < serie->nb_chips; i++)
+		if (!strcmp(serie->chips[i].name, "SAME70Q21"))
+			return &serie->chips[i];
+	return NULL;
+}
+
+struct _block {
+	uint32_t first_page;
+	uint32_t nb_pages;
+};
+
+static void test_erase_plan(const struct _chip* chip)
+{
+	static const struct {
+		uint32_t first_page;
+		uint32_t nb_pages;
+		bool ok;
+		struct _block blocks[MAX_EXPECTED];
+	} cases[] = {
+		// small sectors: 4 pages granularity, 16 pages blocks at most
+		{ 0, 1, true, { { 0, 4 } } },
+		{ 0, 16, true, { { 0, 16 } } },
+		{ 4, 8, true, { { 4, 4 }, { 8, 4 } } },
+		{ 2, 20, true, { { 0, 16 }, { 16, 8 } } },
+		// blocks do not cross from a small sector to the large ones
+		{ 30, 4, true, { { 28, 4 }, { 32, 16 } } },
+		// large sectors: 16 pages granularity, 32 pages blocks at most
+		{ 40, 1, true, { { 32, 16 } } },
+		{ 48, 32, true, { { 48, 16 }, { 64, 16 } } },
+		{ 64, 64, true, { { 64, 32 }, { 96, 32 } } },
+		{ 4080, 16, true, { { 4080, 16 } } },
+		{ 4090, 10, false, { { 0 } } },
+	};
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(cases); i++) {
+		struct _eefc_erase_plan plan;
+		memset(&plan, 0, sizeof(plan));
+		bool ok = eefc_plan_erase_pages(chip, cases[i].first_page,
+				cases[i].nb_pages, &plan);
+		if (!check(ok == cases[i].ok, "erase plan %u+%u: returned %d",
+					cases[i].first_page, cases[i].nb_pages, ok) || !ok)
+			continue;
+		uint32_t count = 0;
+		while (count < MAX_EXPECTED && cases[i].blocks[count].nb_pages)
+			count++;
+		check(plan.count == count, "erase plan %u+%u: %u blocks instead of %u",
+				cases[i].first_page, cases[i].nb_pages, plan.count, count);
+		for (uint32_t j = 0; j < MIN(count, plan.count); j++)
+			check(plan.blocks[j].first_page == cases[i].blocks[j].first_page &&
+					plan.blocks[j].nb_pages == cases[i].blocks[j].nb_pages,
+					"erase plan %u+%u: block %u is %u+%u",
+					cases[i].first_page, cases[i].nb_pages, j,
+					plan.blocks[j].first_page, plan.blocks[j].nb_pages);
+	}
+
+	// a range planned after another skips the pages already covered
+	struct _eefc_erase_plan plan;
+	memset(&plan, 0, sizeof(plan));
+	check(eefc_plan_erase_pages(chip, 0, 1, &plan) &&
+			eefc_plan_erase_pages(chip, 2, 4, &plan) &&
+			plan.count == 2 && plan.blocks[1].first_page == 4 &&
+			plan.nb_pages == 8, "erase plan of two ranges");
+}
+
+static bool has_bad_chunk(const struct _framing* framing, uint32_t size, bool write)
+{
+	while (size) {
+		uint32_t chunk = write ? framing_next_write(framing, size, COMMAND_SIZE) :
+			framing_next_read(framing, size);
+		if (!chunk || chunk > size || chunk == FRAMING_BAD_SIZE)
+			return true;
+		size -= chunk;
+	}
+	return false;
+}
+
+static void test_framing(void)
+{
+	static const struct {
+		bool write;
+		uint32_t max;
+		uint32_t size;
+		uint32_t chunk;
+	} cases[] = {
+		{ false, 4096, 100, 100 },
+		{ false, 4096, 4096, 4096 },
+		{ false, 4096, 5000, 4096 },
+		// the bad size is split, or avoided in the rest
+		{ false, 4096, 512, 448 },
+		{ false, 4096, 4608, 4032 },
+		{ false, 1024, 1536, 960 },
+		// the command is sent in the packets of the data
+		{ true, 1024, 2000, 1024 - COMMAND_SIZE },
+		{ true, 1024, 532, 532 },
+		{ true, 1024, 512, 448 },
+		{ true, 1024, 1024 - COMMAND_SIZE + 512, 1024 - COMMAND_SIZE - 64 },
+	};
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(cases); i++) {
+		struct _framing framing = {
+			.packet_size = FRAMING_HIGH_SPEED_PACKET,
+			.max_read = cases[i].max,
+			.max_write = cases[i].max,
+		};
+		uint32_t chunk = cases[i].write ?
+			framing_next_write(&framing, cases[i].size, COMMAND_SIZE) :
+			framing_next_read(&framing, cases[i].size);
+		check(chunk == cases[i].chunk, "%s of %u bytes, limit %u: chunk of %u",
+				cases[i].write ? "write" : "read", cases[i].size,
+				cases[i].max, chunk);
+	}
+
+	// whatever the size, no chunk is empty or has the bad size
+	struct _framing framing = {
+		.packet_size = FRAMING_HIGH_SPEED_PACKET,
+		.max_read = 4096,
+		.max_write = 1024,
+	};
+	uint32_t size = 1;
+	while (size < 3 * 4096 && !has_bad_chunk(&framing, size, false) &&
+			!has_bad_chunk(&framing, size, true))
+		size++;
+	check(size == 3 * 4096, "transfer of %u bytes has a bad chunk", size);
+}
+
+static void test_image_formats(void)
+{
+	static const struct {
+		const char* name;
+		const char* text;
+		bool ok;
+		struct {
+			uint32_t addr;
+			uint32_t size;
+			uint8_t first;
+		} segments[MAX_EXPECTED];
+	} cases[] = {
+		{ "one.hex", ":040000001122334452\n:00000001FF\n",
+			true, { { 0, 4, 0x11 } } },
+		{ "crlf.hex", ":040000001122334452\r\n\r\n:00000001FF\r\n",
+			true, { { 0, 4, 0x11 } } },
+		// contiguous records are coalesced, whatever their order
+		{ "two.hex", ":04000400556677883E\n:040000001122334452\n:00000001FF\n",
+			true, { { 0, 8, 0x11 } } },
+		{ "gap.hex", ":040000001122334452\n:02020000AABB97\n:00000001FF\n",
+			true, { { 0, 4, 0x11 }, { 0x200, 2, 0xaa } } },
+		{ "linear.hex", ":020000040040BA\n:040000001122334452\n:00000001FF\n",
+			true, { { 0x400000, 4, 0x11 } } },
+		{ "segment.hex", ":020000021000EC\n:040000001122334452\n:00000001FF\n",
+			true, { { 0x10000, 4, 0x11 } } },
+		{ "checksum.hex", ":040000001122334453\n:00000001FF\n", false, { { 0 } } },
+		{ "address.hex", ":0400000400400000B8\n:040000001122334452\n", false, { { 0 } } },
+		{ "overlap.hex", ":040000001122334452\n:020002000102F9\n", false, { { 0 } } },
+		{ "one.srec", "S1071000112233443E\nS9030000FC\n",
+			true, { { 0x1000, 4, 0x11 } } },
+		{ "wide.s37", "S30700400000DEAD2D\nS2050100009960\n",
+			true, { { 0x10000, 1, 0x99 }, { 0x400000, 2, 0xde } } },
+		{ "checksum.srec", "S1071000112233443F\n", false, { { 0 } } },
+		{ "type.srec", "S404000001FA\n", false, { { 0 } } },
+		{ "raw.bin", "\x01\x02\x03", true, { { 0, 3, 0x01 } } },
+	};
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(cases); i++) {
+		const char* path = write_file(cases[i].name, cases[i].text,
+				strlen(cases[i].text));
+		struct _image image;
+		bool ok = image_load(&image, path, false);
+		if (!check(ok == cases[i].ok, "%s: load returned %d", cases[i].name, ok) || !ok)
+			continue;
+		uint32_t count = 0;
+		while (count < MAX_EXPECTED && cases[i].segments[count].size)
+			count++;
+		check(image.nb_segments == count, "%s: %u segments instead of %u",
+				cases[i].name, image.nb_segments, count);
+		for (uint32_t j = 0; j < MIN(count, image.nb_segments); j++) {
+			const struct _image_segment* segment = &image.segments[j];
+			check(segment->addr == cases[i].segments[j].addr &&
+					segment->size == cases[i].segments[j].size &&
+					segment->data[0] == cases[i].segments[j].first,
+					"%s: segment %u is %u bytes at 0x%08x",
+					cases[i].name, j, segment->size, segment->addr);
+			check(((uintptr_t)segment->data & (EEFC_PAGE_SIZE - 1)) ==
+					(segment->addr & (EEFC_PAGE_SIZE - 1)),
+					"%s: segment %u is not laid out at its page offset",
+					cases[i].name, j);
+		}
+		image_free(&image);
+	}
+}
+
+static void test_elf(void)
+{
+	static const uint8_t data[] = { 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70 };
+	const struct _image_segment segments[] = {
+		{ 0x400000, data, 4 },
+		{ 0x400304, data + 4, 3 },
+	};
+
+	// sparse ELF files written by read are loaded back
+	const char* path = temp_path("sparse.elf");
+	FILE* file = fopen(path, "w+");
+	bool ok = file && image_elf_start(file);
+	for (uint32_t i = 0; ok && i < ARRAY_SIZE(segments); i++)
+		ok = fwrite(segments[i].data, 1, segments[i].size, file) == segments[i].size;
+	ok = ok && image_elf_finish(file, segments, ARRAY_SIZE(segments));
+	if (file)
+		fclose(file);
+	if (!check(ok, "sparse.elf: could not write"))
+		return;
+
+	struct _image image;
+	if (!check(image_load(&image, path, false), "sparse.elf: could not load"))
+		return;
+	check(image.format == IMAGE_ELF && image.nb_segments == ARRAY_SIZE(segments),
+			"sparse.elf: %u segments", image.nb_segments);
+	for (uint32_t i = 0; i < MIN(image.nb_segments, ARRAY_SIZE(segments)); i++)
+		check(image.segments[i].addr == segments[i].addr &&
+				image.segments[i].size == segments[i].size &&
+				!memcmp(image.segments[i].data, segments[i].data, segments[i].size),
+				"sparse.elf: segment %u differs", i);
+	image_free(&image);
+
+	// truncated header
+	path = write_file("short.elf", "\x7f" "ELF\x01\x01\x01", 7);
+	check(!image_load(&image, path, false), "short.elf: loaded");
+}
+
+static void test_manifest(const struct _chip* chip)
+{
+	static const struct {
+		const char* text;
+		bool ok;
+		uint32_t nb_known;
+		uint32_t page;
+		uint32_t crc;
+	} cases[] = {
+		{ "chip SAME70Q21\n0 12345678\n2-4 deadbeef\n", true, 4, 3, 0xdeadbeef },
+		{ "chip SAME70Q21\r\n7\tcafe\r\n", true, 1, 7, 0xcafe },
+		{ "chip SAME70Q21\n", true, 0, 0, 0 },
+		// a manifest of another chip is ignored
+		{ "chip SAME70Q19\n0 12345678\n", true, 0, 0, 0 },
+		{ "chip SAME70Q21\nabc\n", false, 0, 0, 0 },
+		{ "chip SAME70Q21\n4-2 0\n", false, 0, 0, 0 },
+		{ "chip SAME70Q21\n4096 0\n", false, 0, 0, 0 },
+		{ "chip SAME70Q21\n1 12z\n", false, 0, 0, 0 },
+	};
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(cases); i++) {
+		write_file("device.manifest", cases[i].text, strlen(cases[i].text));
+		struct _manifest manifest;
+		bool ok = manifest_load(&manifest, _dir, "device", chip);
+		if (!check(ok == cases[i].ok, "manifest %u: load returned %d", i, ok) || !ok)
+			continue;
+		uint32_t crc;
+		check(manifest.nb_known == cases[i].nb_known, "manifest %u: %u known pages",
+				i, manifest.nb_known);
+		check(!cases[i].nb_known || (manifest_get(&manifest, cases[i].page, &crc) &&
+					crc == cases[i].crc), "manifest %u: wrong CRC of page %u",
+				i, cases[i].page);
+		manifest_free(&manifest);
+	}
+
+	// saved manifests are loaded back
+	struct _manifest manifest;
+	if (!check(manifest_load(&manifest, _dir, "saved", chip), "manifest save: load"))
+		return;
+	for (uint32_t page = 10; page < 20; page++)
+		manifest_set(&manifest, page, page < 15 ? 0x1234 : page);
+	manifest_forget(&manifest, 12);
+	check(manifest_save(&manifest), "manifest save: save");
+	manifest_free(&manifest);
+	uint32_t crc;
+	check(manifest_load(&manifest, _dir, "saved", chip) && manifest.nb_known == 9 &&
+			!manifest_get(&manifest, 12, &crc) &&
+			manifest_get(&manifest, 13, &crc) && crc == 0x1234 &&
+			manifest_get(&manifest, 19, &crc) && crc == 19,
+			"manifest save: content differs");
+	manifest_free(&manifest);
+}
+
+static void test_journal(void)
+{
+	static const struct {
+		const char* text;
+		bool ok;
+		bool erased;
+		uint32_t committed;
+		uint32_t first_page;
+		uint32_t last_page;
+	} cases[] = {
+		{ "journal SAME70Q21 0000002a\n", true, false, 0, 0, 0 },
+		{ "journal SAME70Q21 0000002a\nerased\n0 2\n", true, true, 2, 0, 1 },
+		{ "journal SAME70Q21 0000002a\n2 1\n0 2\n", true, false, 3, 0, 1 },
+		// an incomplete record is ignored
+		{ "journal SAME70Q21 0000002a\n0 2\n2 1", true, false, 2, 0, 1 },
+		{ "journal SAME70Q21 0000002b\n0 2\n", false, false, 0, 0, 0 },
+		{ "journal SAME70Q19 0000002a\n0 2\n", false, false, 0, 0, 0 },
+		{ "journal SAME70Q21 0000002a\nx y\n", false, false, 0, 0, 0 },
+		{ "journal SAME70Q21 0000002a\n0 0\n", false, false, 0, 0, 0 },
+		{ "journal SAME70Q21 0000002a\nkeep 8 00\n", false, false, 0, 0, 0 },
+	};
+	static uint8_t data[4 * EEFC_PAGE_SIZE];
+	memset(data, 0x5a, sizeof(data));
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(cases); i++) {
+		const char* path = write_file("write.journal", cases[i].text,
+				strlen(cases[i].text));
+		struct _pagemap map;
+		memset(&map, 0, sizeof(map));
+		pagemap_add(&map, 0, data, sizeof(data));
+		struct _journal journal;
+		struct _journal_state state;
+		bool ok = journal_resume(&journal, path, "SAME70Q21", 0x2a, &map, &state);
+		if (check(ok == cases[i].ok, "journal %u: resume returned %d", i, ok) && ok) {
+			check(state.erased == cases[i].erased &&
+					state.committed == cases[i].committed,
+					"journal %u: erased %d, %u pages committed", i,
+					state.erased, state.committed);
+			check(!state.committed || (state.first_page == cases[i].first_page &&
+					state.last_page == cases[i].last_page),
+					"journal %u: pages %u to %u committed", i,
+					state.first_page, state.last_page);
+			check(map.pages[0].state == (cases[i].committed ?
+						PAGE_UNCHANGED : PAGE_WRITE),
+					"journal %u: wrong state of page 0", i);
+			journal_close(&journal, false);
+		}
+		pagemap_free(&map);
+	}
+
+	// the pages kept by a journal are added back to the map
+	struct _journal journal;
+	struct _page page = { .number = 8, .data = data };
+	check(journal_create(&journal, temp_path("keep.journal"), "SAME70Q21", 1) &&
+			journal_keep(&journal, &page) && journal_erased(&journal),
+			"journal keep: create");
+	journal_close(&journal, false);
+	struct _pagemap map;
+	memset(&map, 0, sizeof(map));
+	struct _journal_state state;
+	struct _page* kept = NULL;
+	if (journal_resume(&journal, temp_path("keep.journal"), "SAME70Q21", 1, &map,
+				&state)) {
+		kept = pagemap_find(&map, 8);
+		journal_close(&journal, true);
+	}
+	check(kept && state.erased && page_matches(kept, data),
+			"journal keep: page not restored");
+	pagemap_free(&map);
+}
+
+int main(int argc, char* argv[])
+{
+	const struct _chip* chip = test_chip();
+	if (!chip || !mkdtemp(_dir)) {
+		fprintf(stderr, "Could not set up the tests\n");
+		return 2;
+	}
+
+	// the error messages of the failing cases are expected
+	if (argc < 2 || strcmp(argv[1], "-v"))
+		if (!freopen("/dev/null", "w", stderr))
+			return 2;
+
+	test_erase_plan(chip);
+	test_framing();
+	test_image_formats();
+	test_elf();
+	test_manifest(chip);
+	test_journal();
+
+	char command[64];
+	snprintf(command, sizeof(command), "rm -rf %s", _dir);
+	if (system(command) != 0)
+		_failures++;
+	printf("%d tests, %d failures\n", _tests, _failures);
+	return _failures ? 1 : 0;
+}
@@ -13,152 +13,927 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include "applet.h"
 #include "chipid.h"
 #include "comm.h"
+#include "crc32.h"
+#include "daemon.h"
 #include "eefc.h"
+#include "image.h"
+#include "journal.h"
+#include "layout.h"
+#include "manifest.h"
+#include "pagemap.h"
+#include "pipeline.h"
+#include "stats.h"
 #include "utils.h"
 
 #define BUFFER_SIZE 8192
 
-static bool get_file_size(const char* filename, uint32_t* size)
+// reads use larger buffers to keep the read window full
+#define READ_BUFFER_SIZE 65536
+
+// number of buffers between the device and the host threads
+#define PIPELINE_BUFFERS 4
+
+#define MAX_PORTS 64
+
+#define MAX_SCRIPT_LINE_SIZE 1024
+#define MAX_SCRIPT_ARGS 8
+
+// pokes sent together by scripts, the 'W' commands of one transfer
+#define MAX_SCRIPT_POKES 128
+
+// pages skipped by --delta that are checked on the device
+#define DELTA_SPOT_CHECKS 8
+
+struct _options {
+	bool applet;
+	bool crc;
+	bool diff;
+	bool delta;
+	bool erase;
+	bool resume;
+	bool sparse;
+	bool stats;
+	const char* stats_json;
+	uint32_t read_window;
+	uint32_t timeout;
+	uint32_t packet_size;
+	int io_mode;
+	const char* ports;
+	const char* daemon;
+	const char* manifest;
+	const char* serial;
+};
+
+struct _job {
+	int command;
+	const char* filename;
+	struct _layout* layout;
+	bool has_addr;
+	uint32_t addr;
+	uint32_t size;
+	uint32_t value;
+};
+
+struct _session {
+	const char* port;
+	bool prefix;
+	int fd;
+	const struct _chip_serie* serie;
+	const struct _chip* chip;
+	struct _eefc_locks locks;
+	const struct _options* options;
+	const struct _job* job;
+	struct _image_loader* loader;
+	bool applet_loaded;
+	struct _manifest manifest;
+	bool manifest_loaded;
+	struct _journal* journal;
+	struct _stats* stats;
+	bool quiet;
+	pthread_t thread;
+	double elapsed;
+	bool ok;
+};
+
+static void info(const struct _session* session, const char* fmt, ...)
 {
-	struct stat st;
+	va_list ap;
 
-	if (stat(filename, &st) != 0) {
-		fprintf(stderr, "Could not access '%s'\n", filename);
-		return false;
+	if (session->quiet)
+		return;
+	va_start(ap, fmt);
+	flockfile(stdout);
+	if (session->prefix)
+		printf("%s: ", session->port);
+	vprintf(fmt, ap);
+	funlockfile(stdout);
+	va_end(ap);
+}
+
+// '-' stands for the standard input or output
+static bool is_stdio(const char* filename)
+{
+	return !strcmp(filename, "-");
+}
+
+// Descriptor of the standard output kept for a dump, the messages going to
+// the standard error instead
+static int _dump_fd = -1;
+
+static void take_stdout(void)
+{
+	fflush(stdout);
+	_dump_fd = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+static double elapsed_since(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// With sparse set, the blank pages are left out and the data is written as
+// the segments of an ELF file, at their flash address.
+struct _file_writer {
+	struct _pipeline* pipeline;
+	FILE* file;
+	const char* filename;
+	bool sparse;
+	uint32_t flash_addr;
+	struct _image_segment* segments;
+	uint32_t nb_segments;
+	uint32_t max_segments;
+	uint32_t blank_pages;
+	bool ok;
+};
+
+static bool is_blank(const uint8_t* data, uint32_t size)
+{
+	if (size == EEFC_PAGE_SIZE)
+		return page_is_blank(data);
+	for (uint32_t i = 0; i < size; i++)
+		if (data[i] != 0xff)
+			return false;
+	return true;
+}
+
+// Write the data of a page, extending the last segment if it is contiguous
+static bool file_writer_add(struct _file_writer* writer, uint32_t addr,
+		const uint8_t* data, uint32_t size)
+{
+	struct _image_segment* last = writer->nb_segments ?
+		&writer->segments[writer->nb_segments - 1] : NULL;
+	if (last && last->addr + last->size == addr) {
+		last->size += size;
+	} else {
+		if (writer->nb_segments == writer->max_segments) {
+			uint32_t max = MAX(2 * writer->max_segments, 16);
+			struct _image_segment* segments = realloc(writer->segments,
+					max * sizeof(*segments));
+			if (!segments)
+				return false;
+			writer->segments = segments;
+			writer->max_segments = max;
+		}
+		last = &writer->segments[writer->nb_segments++];
+		last->addr = addr;
+		last->data = NULL;
+		last->size = size;
 	}
+	return fwrite(data, 1, size, writer->file) == size;
+}
 
-	*size = st.st_size;
+static bool file_writer_write(struct _file_writer* writer,
+		const struct _pipeline_buffer* buffer)
+{
+	if (!writer->sparse)
+		return fwrite(buffer->data, 1, buffer->size, writer->file) == buffer->size;
+
+	for (uint32_t offset = 0; offset < buffer->size; offset += EEFC_PAGE_SIZE) {
+		uint32_t count = MIN(EEFC_PAGE_SIZE, buffer->size - offset);
+		if (is_blank(buffer->data + offset, count))
+			writer->blank_pages++;
+		else if (!file_writer_add(writer, writer->flash_addr + buffer->addr + offset,
+					buffer->data + offset, count))
+			return false;
+	}
 	return true;
 }
 
-static bool read_flash(int fd, const struct _chip* chip, uint32_t addr, uint32_t size, const char* filename)
+static void* file_writer_run(void* arg)
 {
-	FILE* file = fopen(filename, "wb");
-	if (!file) {
+	struct _file_writer* writer = arg;
+	struct _pipeline_buffer* buffer;
+
+	while ((buffer = pipeline_consume(writer->pipeline))) {
+		if (!file_writer_write(writer, buffer)) {
+			fprintf(stderr, "Error while writing to '%s'\n", writer->filename);
+			writer->ok = false;
+			pipeline_abort(writer->pipeline);
+			break;
+		}
+		pipeline_release(writer->pipeline);
+	}
+	return NULL;
+}
+
+// Reads the standard input into the pipeline, the pieces starting at their
+// flash offset in the buffers so that whole pages stay page aligned, and
+// ending on an erase block boundary so that no block is shared by two pieces
+struct _file_reader {
+	struct _pipeline* pipeline;
+	FILE* file;
+	uint32_t addr;
+	bool ok;
+};
+
+static void* file_reader_run(void* arg)
+{
+	struct _file_reader* reader = arg;
+	struct _pipeline_buffer* buffer;
+	uint32_t addr = reader->addr;
+
+	while ((buffer = pipeline_produce(reader->pipeline))) {
+		uint32_t head = addr & (EEFC_PAGE_SIZE - 1);
+		uint32_t room = READ_BUFFER_SIZE -
+			(addr & (EEFC_MAX_ERASE_PAGES * EEFC_PAGE_SIZE - 1));
+		size_t count = fread(buffer->data + head, 1, room, reader->file);
+		if (!count)
+			break;
+		buffer->addr = addr;
+		buffer->size = count;
+		pipeline_commit(reader->pipeline);
+		addr += count;
+		if (count < room)
+			break;
+	}
+	if (ferror(reader->file)) {
+		fprintf(stderr, "Error while reading the standard input\n");
+		reader->ok = false;
+		pipeline_abort(reader->pipeline);
+	}
+	pipeline_close(reader->pipeline);
+	return NULL;
+}
+
+// Read flash from the device while the previous buffers are written to the
+// file by another thread.  With --sparse, the dump is an ELF file without the
+// blank pages; the pages set in blank, found blank on the device, are not
+// read at all.
+static bool read_flash(struct _session* session, uint32_t addr, uint32_t size,
+		const char* filename, const bool* blank)
+{
+	int fd = session->fd;
+	const struct _chip* chip = session->chip;
+	struct _file_writer writer = {
+		.filename = filename,
+		.sparse = session->options->sparse,
+		.flash_addr = chip->flash_addr,
+		.ok = true,
+	};
+	if (is_stdio(filename) && writer.sparse) {
+		fprintf(stderr, "Sparse dumps cannot be written to the standard output\n");
+		return false;
+	}
+	if (is_stdio(filename))
+		writer.file = _dump_fd >= 0 ? fdopen(_dump_fd, "wb") : NULL;
+	else
+		writer.file = fopen(filename, "wb");
+	if (!writer.file) {
 		fprintf(stderr, "Could not open '%s' for writing\n", filename);
 		return false;
 	}
+	if (writer.sparse && !image_elf_start(writer.file)) {
+		fprintf(stderr, "Error while writing to '%s'\n", filename);
+		fclose(writer.file);
+		return false;
+	}
 
-	uint8_t buffer[BUFFER_SIZE];
-	uint32_t total = 0;
+	struct _pipeline pipeline;
+	if (!pipeline_init(&pipeline, PIPELINE_BUFFERS, READ_BUFFER_SIZE)) {
+		fclose(writer.file);
+		return false;
+	}
+	writer.pipeline = &pipeline;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, file_writer_run, &writer) != 0) {
+		pipeline_free(&pipeline);
+		fclose(writer.file);
+		return false;
+	}
+
+	bool ok = true;
+	uint32_t total = 0, skipped = 0;
 	while (total < size) {
-		uint32_t count = MIN(BUFFER_SIZE, size - total);
-		if (!eefc_read(fd, chip, buffer, addr, count)) {
-			fclose(file);
-			return false;
+		// runs of pages known to be blank are skipped, the others are
+		// read up to the next blank page
+		uint32_t count = MIN(READ_BUFFER_SIZE, size - total);
+		if (blank) {
+			uint32_t run = 0;
+			bool run_blank = blank[total / EEFC_PAGE_SIZE];
+			while (run < count && blank[(total + run) / EEFC_PAGE_SIZE] == run_blank)
+				run += EEFC_PAGE_SIZE;
+			count = MIN(run, count);
+			if (run_blank) {
+				skipped += (count + EEFC_PAGE_SIZE - 1) / EEFC_PAGE_SIZE;
+				total += count;
+				continue;
+			}
 		}
 
-		if (fwrite(buffer, 1, count, file) != count) {
-			fprintf(stderr, "Error while writing to '%s'", filename);
-			fclose(file);
-			return false;
+		struct _pipeline_buffer* buffer = pipeline_produce(&pipeline);
+		if (!buffer)
+			break;
+
+		if (!eefc_read(fd, chip, buffer->data, addr + total, count)) {
+			pipeline_abort(&pipeline);
+			ok = false;
+			break;
 		}
+		buffer->addr = addr + total;
+		buffer->size = count;
+		pipeline_commit(&pipeline);
 
 		total += count;
-		addr += count;
 	}
+	pipeline_close(&pipeline);
+	pthread_join(thread, NULL);
+	pipeline_free(&pipeline);
 
-	fclose(file);
-	return true;
+	if (writer.sparse && ok && writer.ok &&
+			!image_elf_finish(writer.file, writer.segments, writer.nb_segments)) {
+		fprintf(stderr, "Error while writing to '%s'\n", filename);
+		writer.ok = false;
+	}
+	if (fclose(writer.file) != 0 && writer.ok) {
+		fprintf(stderr, "Error while writing to '%s'\n", filename);
+		writer.ok = false;
+	}
+	if (writer.sparse && ok && writer.ok) {
+		uint32_t written = 0;
+		for (uint32_t i = 0; i < writer.nb_segments; i++)
+			written += writer.segments[i].size;
+		info(session, "Skipped %d blank pages (%d on the device), wrote %d bytes in %d segments\n",
+				skipped + writer.blank_pages, skipped, written, writer.nb_segments);
+	}
+	free(writer.segments);
+	return ok && writer.ok;
 }
 
-static bool write_flash(int fd, const struct _chip* chip, const char* filename, uint32_t addr, uint32_t size)
+static bool write_flash(int fd, const struct _chip* chip, const struct _options* options,
+		const uint8_t* data, uint32_t addr, uint32_t size)
 {
-	FILE* file = fopen(filename, "rb");
-	if (!file) {
-		fprintf(stderr, "Could not open '%s' for reading\n", filename);
-		return false;
-	}
-
-	uint8_t buffer[BUFFER_SIZE];
 	uint32_t total = 0;
 	while (total < size) {
 		uint32_t count = MIN(BUFFER_SIZE, size - total);
-		if (fread(buffer, 1, count, file) != count) {
-			fprintf(stderr, "Error while reading from '%s'", filename);
-			fclose(file);
-			return false;
-		}
 
-		if (!eefc_write(fd, chip, buffer, addr, count)) {
-			fclose(file);
+		bool ok;
+		if (options->applet)
+			ok = applet_write(fd, chip, data + total, addr, count);
+		else
+			ok = eefc_write(fd, chip, data + total, addr, count);
+		if (!ok)
 			return false;
-		}
 
 		total += count;
 		addr += count;
 	}
 
-	fclose(file);
 	return true;
 }
 
-static bool verify_flash(int fd, const struct _chip* chip, const char* filename, uint32_t addr, uint32_t size)
+static bool compare_buffers(const uint8_t* expected, const uint8_t* actual,
+		uint32_t addr, uint32_t size)
 {
-	FILE* file = fopen(filename, "rb");
-	if (!file) {
-		fprintf(stderr, "Could not open '%s' for reading\n", filename);
+	for (uint32_t i = 0; i < size; i++) {
+		if (expected[i] != actual[i]) {
+			fprintf(stderr, "Verify failed, first difference at offset %d\n", addr + i);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool read_flash_crcs(int fd, const struct _chip* chip, uint32_t addr,
+		uint32_t size, uint32_t* crcs)
+{
+	uint32_t regions = size / EEFC_PAGE_SIZE;
+	uint32_t tail = size % EEFC_PAGE_SIZE;
+
+	if (regions && !applet_crc32(fd, chip, addr, EEFC_PAGE_SIZE, regions, crcs))
 		return false;
+	if (tail && !applet_crc32(fd, chip, addr + regions * EEFC_PAGE_SIZE,
+				tail, 1, crcs + regions))
+		return false;
+	return true;
+}
+
+struct _comparer {
+	struct _pipeline* pipeline;
+	const uint8_t* data;
+	uint32_t addr;
+	bool ok;
+};
+
+static void* comparer_run(void* arg)
+{
+	struct _comparer* comparer = arg;
+	struct _pipeline_buffer* buffer;
+
+	while ((buffer = pipeline_consume(comparer->pipeline))) {
+		const uint8_t* expected = comparer->data + (buffer->addr - comparer->addr);
+		if (!compare_buffers(expected, buffer->data, buffer->addr, buffer->size)) {
+			comparer->ok = false;
+			pipeline_abort(comparer->pipeline);
+			break;
+		}
+		pipeline_release(comparer->pipeline);
 	}
+	return NULL;
+}
 
-	uint8_t buffer1[BUFFER_SIZE];
-	uint8_t buffer2[BUFFER_SIZE];
-	uint32_t total = 0;
-	while (total < size) {
-		uint32_t count = MIN(BUFFER_SIZE, size - total);
-		if (fread(buffer1, 1, count, file) != count) {
-			fprintf(stderr, "Error while reading from '%s'", filename);
-			fclose(file);
+// Read back flash from the device while the previous buffers are compared
+// with the image by another thread.
+static bool read_and_compare(int fd, const struct _chip* chip,
+		const uint8_t* data, uint32_t addr, uint32_t size)
+{
+	struct _pipeline pipeline;
+	if (!pipeline_init(&pipeline, PIPELINE_BUFFERS, READ_BUFFER_SIZE))
+		return false;
+
+	struct _comparer comparer = {
+		.pipeline = &pipeline,
+		.data = data,
+		.addr = addr,
+		.ok = true,
+	};
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, comparer_run, &comparer) != 0) {
+		pipeline_free(&pipeline);
+		return false;
+	}
+
+	bool ok = true;
+	for (uint32_t total = 0; total < size; total += READ_BUFFER_SIZE) {
+		struct _pipeline_buffer* buffer = pipeline_produce(&pipeline);
+		if (!buffer)
+			break;
+
+		uint32_t count = MIN(READ_BUFFER_SIZE, size - total);
+		if (!eefc_read(fd, chip, buffer->data, addr + total, count)) {
+			pipeline_abort(&pipeline);
+			ok = false;
+			break;
+		}
+		buffer->addr = addr + total;
+		buffer->size = count;
+		pipeline_commit(&pipeline);
+	}
+	pipeline_close(&pipeline);
+	pthread_join(thread, NULL);
+	pipeline_free(&pipeline);
+
+	return ok && comparer.ok;
+}
+
+static bool verify_flash(int fd, const struct _chip* chip, const struct _options* options,
+		const uint8_t* data, uint32_t addr, uint32_t size)
+{
+	if (!options->crc)
+		return read_and_compare(fd, chip, data, addr, size);
+
+	// with CRC verification, the device computes a CRC for each page
+	// sized region and only mismatching regions are read back
+	uint32_t* crcs = malloc(((size + EEFC_PAGE_SIZE - 1) / EEFC_PAGE_SIZE) * sizeof(uint32_t));
+	if (!crcs || !read_flash_crcs(fd, chip, addr, size, crcs)) {
+		free(crcs);
+		return false;
+	}
+
+	uint8_t buffer[EEFC_PAGE_SIZE];
+	bool ok = true;
+	for (uint32_t offset = 0; ok && offset < size; offset += EEFC_PAGE_SIZE) {
+		uint32_t region = MIN(EEFC_PAGE_SIZE, size - offset);
+		if (crc32(data + offset, region) == crcs[offset / EEFC_PAGE_SIZE])
+			continue;
+		ok = eefc_read(fd, chip, buffer, addr + offset, region) &&
+			compare_buffers(data + offset, buffer, addr + offset, region);
+	}
+
+	free(crcs);
+	return ok;
+}
+
+// Length of the run of consecutive pages starting at index, with the same
+// state and erase flag, limited to max pages.
+static uint32_t page_run(const struct _pagemap* map, uint32_t index, uint32_t max)
+{
+	const struct _page* pages = map->pages;
+	uint32_t n = 1;
+	while (n < max && index + n < map->count &&
+			pages[index + n].number == pages[index].number + n &&
+			pages[index + n].state == pages[index].state &&
+			pages[index + n].erase == pages[index].erase)
+		n++;
+	return n;
+}
+
+// Mark the pages to write whose content is already in flash as unchanged.
+// Whole pages are compared using CRCs computed on the device when crc is set,
+// other pages are read back.
+static bool diff_pages(struct _session* session, struct _pagemap* map, bool crc)
+{
+	int fd = session->fd;
+	const struct _chip* chip = session->chip;
+	struct _page* pages = map->pages;
+
+	uint32_t* crcs = NULL;
+	if (crc) {
+		crcs = malloc(MAX(map->count, 1) * sizeof(uint32_t));
+		if (!crcs)
 			return false;
+		for (uint32_t i = 0, n; i < map->count; i += n) {
+			n = page_run(map, i, map->count);
+			if (pages[i].state != PAGE_WRITE)
+				continue;
+			if (!applet_crc32(fd, chip, pages[i].number * EEFC_PAGE_SIZE,
+						EEFC_PAGE_SIZE, n, crcs + i)) {
+				free(crcs);
+				return false;
+			}
 		}
+	}
 
-		if (!eefc_read(fd, chip, buffer2, addr, count)) {
-			fclose(file);
+	uint64_t buffer[BUFFER_SIZE / 8];
+	for (uint32_t i = 0, n; i < map->count; i += n) {
+		n = 1;
+		if (pages[i].state != PAGE_WRITE)
+			continue;
+		if (crcs && page_is_full(&pages[i])) {
+			if (crc32(pages[i].data, EEFC_PAGE_SIZE) == crcs[i])
+				pages[i].state = PAGE_UNCHANGED;
+			continue;
+		}
+
+		if (!crcs)
+			n = page_run(map, i, BUFFER_SIZE / EEFC_PAGE_SIZE);
+		if (!eefc_read(fd, chip, (uint8_t*)buffer, pages[i].number * EEFC_PAGE_SIZE,
+					n * EEFC_PAGE_SIZE)) {
+			free(crcs);
+			return false;
+		}
+		for (uint32_t j = 0; j < n; j++)
+			if (page_matches(&pages[i + j], (uint8_t*)buffer + j * EEFC_PAGE_SIZE))
+				pages[i + j].state = PAGE_UNCHANGED;
+	}
+
+	free(crcs);
+	return true;
+}
+
+// Plan the erase of the blocks covering the pages to write that are marked
+// for erase.  The previous content of the erased pages that is not overwritten
+// by the image is added to the map, and to the journal.
+static bool plan_erase(struct _session* session, struct _pagemap* map,
+		struct _eefc_erase_plan* plan)
+{
+	int fd = session->fd;
+	const struct _chip* chip = session->chip;
+
+	memset(plan, 0, sizeof(*plan));
+	for (uint32_t i = 0, n; i < map->count; i += n) {
+		n = page_run(map, i, map->count);
+		if (map->pages[i].state != PAGE_WRITE || !map->pages[i].erase)
+			continue;
+		if (!eefc_plan_erase_pages(chip, map->pages[i].number, n, plan)) {
+			fprintf(stderr, "Could not plan erase of %d pages at 0x%08x\n",
+					n, map->pages[i].number * EEFC_PAGE_SIZE);
 			return false;
 		}
+	}
+	if (!plan->count)
+		return true;
+
+	uint64_t phase = stats_start(session->stats);
 
-		for (int i = 0; i < BUFFER_SIZE; i++) {
-			if (buffer1[i] != buffer2[i]) {
-				fprintf(stderr, "Verify failed, first difference at offset %d", addr + i);
-				fclose(file);
+	// save the content that is erased but not overwritten by the image,
+	// reading runs of pages not fully defined by the map
+	uint64_t buffer[BUFFER_SIZE / 8];
+	for (uint32_t i = 0; i < plan->count; i++) {
+		uint32_t page = plan->blocks[i].first_page;
+		uint32_t last_page = page + plan->blocks[i].nb_pages;
+		while (page < last_page) {
+			struct _page* p = pagemap_find(map, page);
+			if (p && page_is_full(p)) {
+				p->state = PAGE_WRITE;
+				page++;
+				continue;
+			}
+
+			uint32_t n = 1;
+			while (page + n < last_page && n < BUFFER_SIZE / EEFC_PAGE_SIZE &&
+					!((p = pagemap_find(map, page + n)) && page_is_full(p)))
+				n++;
+			if (!eefc_read(fd, chip, (uint8_t*)buffer, page * EEFC_PAGE_SIZE,
+						n * EEFC_PAGE_SIZE))
 				return false;
+
+			for (uint32_t j = 0; j < n; j++, page++) {
+				const uint8_t* content = (uint8_t*)buffer + j * EEFC_PAGE_SIZE;
+				p = pagemap_find(map, page);
+				if (!p) {
+					if (page_is_blank(content))
+						continue;
+					p = pagemap_get(map, page);
+					if (!p)
+						return false;
+				}
+				if (!page_fill(p, content))
+					return false;
+				p->state = PAGE_WRITE;
+				if (session->journal && !journal_keep(session->journal, p))
+					return false;
 			}
 		}
+	}
+	stats_phase(session->stats, STATS_PHASE_ERASE, phase);
+	return true;
+}
 
-		total += count;
-		addr += count;
+static void mark_lock_regions(const struct _eefc_locks* locks, uint32_t first_page,
+		uint32_t nb_pages, bool* regions)
+{
+	uint32_t first = eefc_lock_region(locks, first_page * EEFC_PAGE_SIZE);
+	uint32_t last = eefc_lock_region(locks, (first_page + nb_pages) * EEFC_PAGE_SIZE - 1);
+	for (uint32_t i = first; i <= last; i++)
+		regions[i] = true;
+}
+
+// Unlock the locked regions holding pages to write or to erase, in runs of
+// consecutive regions.
+static bool unlock_pages(struct _session* session, const struct _pagemap* map,
+		const struct _eefc_erase_plan* plan)
+{
+	struct _eefc_locks* locks = &session->locks;
+	bool regions[MAX_EEFC_LOCKS] = { false };
+
+	for (uint32_t i = 0, n; i < map->count; i += n) {
+		n = page_run(map, i, map->count);
+		if (map->pages[i].state == PAGE_WRITE)
+			mark_lock_regions(locks, map->pages[i].number, n, regions);
+	}
+	for (uint32_t i = 0; i < plan->count; i++)
+		mark_lock_regions(locks, plan->blocks[i].first_page,
+				plan->blocks[i].nb_pages, regions);
+
+	uint64_t phase = stats_start(session->stats);
+	if (!eefc_read_locks(session->fd, session->chip, locks))
+		return false;
+	for (uint32_t i = 0; i < locks->count; i++)
+		regions[i] = regions[i] && eefc_is_locked(locks, i);
+	for (uint32_t i = 0, n; i < locks->count; i += n) {
+		for (n = 1; i + n < locks->count && regions[i + n] == regions[i]; n++)
+			;
+		if (!regions[i])
+			continue;
+		uint32_t offset = locks->offset[i];
+		uint32_t size = locks->offset[i + n] - offset;
+		info(session, "Unlocking %d bytes at 0x%08x\n", size, offset);
+		if (!eefc_unlock(session->fd, session->chip, locks, offset, size))
+			return false;
+	}
+	stats_phase(session->stats, STATS_PHASE_UNLOCK, phase);
+	return true;
+}
+
+// Erase the planned blocks, the pages left blank by the erase are marked as
+// such.
+static bool erase_pages(struct _session* session, struct _pagemap* map,
+		const struct _eefc_erase_plan* plan)
+{
+	if (!plan->count)
+		return true;
+
+	info(session, "Erasing %d pages at 0x%08x with %d commands\n",
+			plan->nb_pages, plan->first_page * EEFC_PAGE_SIZE, plan->count);
+	uint64_t phase = stats_start(session->stats);
+	if (!eefc_erase_plan(session->fd, session->chip, plan))
+		return false;
+	stats_phase(session->stats, STATS_PHASE_ERASE, phase);
+	if (session->journal && !journal_erased(session->journal))
+		return false;
+
+	for (uint32_t i = 0; i < map->count; i++) {
+		struct _page* p = &map->pages[i];
+		if (p->state == PAGE_WRITE && page_is_blank(p->data))
+			p->state = PAGE_BLANK;
+	}
+	return true;
+}
+
+// Write the pages of the map that are not skipped, in runs of consecutive
+// pages, each run being recorded in the journal once written.
+static bool write_pages(struct _session* session, const struct _pagemap* map)
+{
+	uint64_t buffer[BUFFER_SIZE / 8];
+	for (uint32_t i = 0, n; i < map->count; i += n) {
+		const struct _page* pages = &map->pages[i];
+		n = page_run(map, i, BUFFER_SIZE / EEFC_PAGE_SIZE);
+		if (pages->state != PAGE_WRITE)
+			continue;
+
+		// runs of views of the image are written in place, other pages
+		// are gathered in the buffer
+		const uint8_t* data = pages->data;
+		for (uint32_t j = 1; j < n; j++) {
+			if (pages[j].data != pages->data + j * EEFC_PAGE_SIZE) {
+				data = (const uint8_t*)buffer;
+				break;
+			}
+		}
+		if (data != pages->data)
+			for (uint32_t j = 0; j < n; j++)
+				memcpy((uint8_t*)buffer + j * EEFC_PAGE_SIZE, pages[j].data, EEFC_PAGE_SIZE);
+
+		if (!write_flash(session->fd, session->chip, session->options, data,
+					pages->number * EEFC_PAGE_SIZE, n * EEFC_PAGE_SIZE))
+			return false;
+		if (session->journal && !journal_commit(session->journal, pages->number, n))
+			return false;
+	}
+	return true;
+}
+
+// Flash offset of an image segment.  Raw binaries are written at the start
+// address; other formats at their own address, either a CPU address in flash
+// or a flash offset, moved by the start address if any.
+static bool segment_offset(const struct _session* session, const struct _image* image,
+		uint32_t start, const struct _image_segment* segment, uint32_t* offset)
+{
+	const struct _chip* chip = session->chip;
+	uint32_t flash_size = chip->flash_size * 1024;
+	uint32_t addr = segment->addr + start;
+
+	if (image->format != IMAGE_BINARY && addr >= chip->flash_addr &&
+			addr - chip->flash_addr < flash_size)
+		addr -= chip->flash_addr;
+	if (addr > flash_size || segment->size > flash_size - addr) {
+		fprintf(stderr, "Data at 0x%08x (%d bytes) is outside of the flash\n",
+				segment->addr, segment->size);
+		return false;
 	}
 
-	fclose(file);
+	*offset = addr;
+	return true;
+}
+
+// Add the segments of an image to the map, the pages with data being marked
+// for erase if requested
+static bool image_to_pagemap(const struct _session* session, const struct _image* image,
+		uint32_t start, bool erase, struct _pagemap* map)
+{
+	for (uint32_t i = 0; i < image->nb_segments; i++) {
+		const struct _image_segment* segment = &image->segments[i];
+		uint32_t offset;
+		if (!segment_offset(session, image, start, segment, &offset) ||
+				!pagemap_add(map, offset, segment->data, segment->size))
+			return false;
+		if (!erase || !segment->size)
+			continue;
+		uint32_t last_page = (offset + segment->size - 1) / EEFC_PAGE_SIZE;
+		for (uint32_t page = offset / EEFC_PAGE_SIZE; page <= last_page; page++)
+			pagemap_find(map, page)->erase = true;
+	}
 	return true;
 }
 
+static const char* describe_image(const struct _session* session,
+		const struct _image* image, char* text, size_t size)
+{
+	if (image->format == IMAGE_BINARY)
+		snprintf(text, size, "%d bytes at 0x%08x", image->size, session->job->addr);
+	else
+		snprintf(text, size, "%d bytes in %d segments", image->size, image->nb_segments);
+	return text;
+}
+
+static void print_counters(const struct _samba_counters* before,
+		const struct _samba_counters* after, uint32_t pages)
+{
+	pages = MAX(pages, 1);
+	uint64_t syscalls = after->syscalls - before->syscalls;
+	uint64_t bytes = (after->bytes_sent - before->bytes_sent) +
+		(after->bytes_received - before->bytes_received);
+
+	printf("Transferred %llu bytes in %llu system calls (%.1f bytes and %.1f system calls per page)\n",
+			(unsigned long long)bytes, (unsigned long long)syscalls,
+			(double)bytes / pages, (double)syscalls / pages);
+}
+
+// Report the communication errors the session recovered from, if any
+static void print_recoveries(const struct _session* session,
+		const struct _samba_counters* before)
+{
+	struct _samba_counters after;
+	samba_get_counters(session->fd, &after);
+	uint64_t retries = after.retries - before->retries;
+	if (retries)
+		info(session, "Recovered from communication errors with %llu retries (%llu timeouts)\n",
+				(unsigned long long)retries,
+				(unsigned long long)(after.timeouts - before->timeouts));
+}
+
 static void usage(char* prog)
 {
-	printf("Usage: %s <port> (read|write|verify|erase-all|gpnvm) [args]*\n", prog);
+	printf("Usage: %s [options] <port> <command> [args]*\n", prog);
+	printf("       %s [options] --ports <port>[,<port>]* <command> [args]*\n", prog);
 	printf("\n");
 	printf("- Reading Flash:\n");
 	printf("    %s <port> read <filename> <start-address> <size>\n", prog);
 	printf("\n");
 	printf("- Writing Flash:\n");
-	printf("    %s <port> write <filename> <start-address>\n", prog);
+	printf("    %s <port> write <filename> [<start-address>]\n", prog);
 	printf("\n");
 	printf("- Verify Flash:\n");
-	printf("    %s <port> verify <filename> <start-address>\n", prog);
+	printf("    %s <port> verify <filename> [<start-address>]\n", prog);
+	printf("\n");
+	printf("  Intel HEX, S-record and ELF files are written at their own addresses\n");
+	printf("  (moved by <start-address> if given), raw binaries need <start-address>\n");
+	printf("  '-' reads to the standard output, writes and verifies a raw binary\n");
+	printf("  streamed from the standard input\n");
+	printf("\n");
+	printf("- Writing several images listed in a layout file:\n");
+	printf("    %s <port> flash <layout-file>\n", prog);
+	printf("  with one '<filename> [<start-address>] [erase] [lock]' line per image\n");
 	printf("\n");
 	printf("- Erasing Flash:\n");
 	printf("    %s <port> erase-all\n", prog);
+	printf("    %s <port> erase <start-address> <size>\n", prog);
+	printf("\n");
+	printf("- Printing the lock regions ('L' if locked, '.' otherwise):\n");
+	printf("    %s <port> locks\n", prog);
 	printf("\n");
 	printf("- Getting/Setting/Clearing GPNVM:\n");
 	printf("    %s <port> gpnvm (get|set|clear) <gpnvm_number>\n", prog);
 	printf("\n");
+	printf("- Reading/Writing a 32-bit word at any address:\n");
+	printf("    %s <port> peek <address>\n", prog);
+	printf("    %s <port> poke <address> <value>\n", prog);
+	printf("\n");
+	printf("- Running commands from a script ('-' for stdin) in one session:\n");
+	printf("    %s <port> script <filename>\n", prog);
+	printf("  with one command per line, as above without '%s <port>', and\n", prog);
+	printf("  'sleep <ms>'\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("    --applet  upload a flashing applet to the device and use it to\n");
+	printf("              program whole pages at once\n");
+	printf("    --crc     verify using CRCs computed on the device by the applet,\n");
+	printf("              only mismatching pages are read back\n");
+	printf("    --diff    for write, skip the pages whose content is already in\n");
+	printf("              flash (compared using CRCs with --applet or --crc)\n");
+	printf("    --delta   for write, skip the pages whose content is recorded in\n");
+	printf("              the manifest, after checking a few of them on the device\n");
+	printf("    --manifest <dir>\n");
+	printf("              keep the CRC of each page of the device in\n");
+	printf("              '<dir>/<id>.manifest', <id> being the unique identifier\n");
+	printf("              of the chip or the serial given with --serial\n");
+	printf("    --serial <serial>\n");
+	printf("              name of the manifest of the device\n");
+	printf("    --erase   for write, erase the pages covered by the image first,\n");
+	printf("              content of the erased pages outside the image is kept,\n");
+	printf("              blank pages are not written\n");
+	printf("    --resume  for write and flash, continue an interrupted write from\n");
+	printf("              its journal ('<filename>.journal') instead of writing\n");
+	printf("              all the pages again\n");
+	printf("    --sparse  for read, write an ELF file without the blank pages,\n");
+	printf("              which are not read from the device with --applet or\n");
+	printf("              --crc\n");
+	printf("    --read-window <n>\n");
+	printf("              number of read commands kept in flight (default %d)\n",
+			SAMBA_DEFAULT_READ_WINDOW);
+	printf("    --io <mode>\n");
+	printf("              'sync' (default) writes synchronously and blocks for\n");
+	printf("              each response, 'buffered' buffers writes and polls\n");
+	printf("              for whole batches of responses\n");
+	printf("    --timeout <ms>\n");
+	printf("              time allowed for a response before the monitor is\n");
+	printf("              resynchronized and the command retried (default %d)\n",
+			SAMBA_DEFAULT_TIMEOUT_MS);
+	printf("    --packet-size <64|512>\n");
+	printf("              USB packet size the transfers are aligned to (default\n");
+	printf("              detected, 512 if the port is not a USB device)\n");
+	printf("    --stats   print the time spent in each phase and the count, size,\n");
+	printf("              latency and FSR polls of each operation\n");
+	printf("    --stats-json <filename>\n");
+	printf("              write the same statistics as JSON ('-' for stdout)\n");
+	printf("    --daemon <socket>\n");
+	printf("              serve jobs sent with --connect on a Unix socket, keeping\n");
+	printf("              the devices open and identified and the images loaded\n");
+	printf("    --connect <socket>\n");
+	printf("              run the command in the daemon listening on the socket\n");
+	printf("    --ports <port>[,<port>]*\n");
+	printf("              run the command on several devices in parallel, the\n");
+	printf("              image is loaded only once\n");
+	printf("\n");
 	printf("for all commands:\n");
 	printf("    <port> is the USB device node for the SAM-BA bootloader, for\n");
 	printf("         example '/dev/ttyACM0'\n");
@@ -174,169 +949,1171 @@ enum {
 	CMD_GPNVM_GET = 5,
 	CMD_GPNVM_SET = 6,
 	CMD_GPNVM_CLEAR = 7,
+	CMD_FLASH = 8,
+	CMD_ERASE = 9,
+	CMD_PEEK = 10,
+	CMD_POKE = 11,
+	CMD_SLEEP = 12,
+	CMD_SCRIPT = 13,
+	CMD_LOCKS = 14,
 };
 
-int main(int argc, char *argv[])
+// Parse the options, which are removed from argv, and return the number of
+// remaining arguments, or -1 on error
+static int parse_options(int argc, char** argv, struct _options* options)
 {
-	int fd = -1;
-	int command = 0;
-	char* port = NULL;
-	char* filename = NULL;
-	uint32_t addr = 0;
-	uint32_t size = 0;
-	bool err = true;
+	memset(options, 0, sizeof(*options));
+	int nargs = 1;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2)) {
+			argv[nargs++] = argv[i];
+		} else if (!strcmp(argv[i], "--applet")) {
+			options->applet = true;
+		} else if (!strcmp(argv[i], "--crc")) {
+			options->crc = true;
+		} else if (!strcmp(argv[i], "--diff")) {
+			options->diff = true;
+		} else if (!strcmp(argv[i], "--delta")) {
+			options->delta = true;
+		} else if (!strcmp(argv[i], "--manifest") && i + 1 < argc) {
+			options->manifest = argv[++i];
+		} else if (!strcmp(argv[i], "--serial") && i + 1 < argc) {
+			options->serial = argv[++i];
+		} else if (!strcmp(argv[i], "--erase")) {
+			options->erase = true;
+		} else if (!strcmp(argv[i], "--resume")) {
+			options->resume = true;
+		} else if (!strcmp(argv[i], "--sparse")) {
+			options->sparse = true;
+		} else if (!strcmp(argv[i], "--read-window") && i + 1 < argc) {
+			options->read_window = strtol(argv[++i], NULL, 0);
+			if (!options->read_window) {
+				fprintf(stderr, "Error: invalid read window '%s'\n", argv[i]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--io") && i + 1 < argc) {
+			options->io_mode = samba_parse_io_mode(argv[++i]);
+			if (options->io_mode < 0) {
+				fprintf(stderr, "Error: invalid I/O mode '%s'\n", argv[i]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--timeout") && i + 1 < argc) {
+			options->timeout = strtol(argv[++i], NULL, 0);
+			if (!options->timeout) {
+				fprintf(stderr, "Error: invalid timeout '%s'\n", argv[i]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--packet-size") && i + 1 < argc) {
+			options->packet_size = strtol(argv[++i], NULL, 0);
+			if (!options->packet_size) {
+				fprintf(stderr, "Error: invalid packet size '%s'\n", argv[i]);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--stats")) {
+			options->stats = true;
+		} else if (!strcmp(argv[i], "--stats-json") && i + 1 < argc) {
+			options->stats_json = argv[++i];
+		} else if (!strcmp(argv[i], "--ports") && i + 1 < argc) {
+			options->ports = argv[++i];
+		} else if (!strcmp(argv[i], "--daemon") && i + 1 < argc) {
+			options->daemon = argv[++i];
+		} else {
+			fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+			return -1;
+		}
+	}
+	argv[nargs] = NULL;
 
-	// parse command line
-	if (argc < 3) {
-		fprintf(stderr, "Error: not enough arguments\n");
-		usage(argv[0]);
+	if (options->delta && !options->manifest) {
+		fprintf(stderr, "Error: --delta requires --manifest\n");
 		return -1;
 	}
-	port = argv[1];
-	char* cmd_text = argv[2];
-	if (!strcmp(cmd_text, "read")) {
-		if (argc == 6) {
-			command = CMD_READ;
-			filename = argv[3];
-			addr = strtol(argv[4], NULL, 0);
-			size = strtol(argv[5], NULL, 0);
-			err = false;
-		} else {
-			fprintf(stderr, "Error: invalid number of arguments\n");
-		}
-	} else if (!strcmp(cmd_text, "write")) {
-		if (argc == 5) {
-			command = CMD_WRITE;
-			filename = argv[3];
-			addr = strtol(argv[4], NULL, 0);
+	if (options->serial && (!*options->serial || strchr(options->serial, '/'))) {
+		fprintf(stderr, "Error: invalid serial '%s'\n", options->serial);
+		return -1;
+	}
+	if (options->resume && options->ports) {
+		fprintf(stderr, "Error: --resume is not supported on multiple ports\n");
+		return -1;
+	}
+	if (options->serial && options->ports) {
+		fprintf(stderr, "Error: --serial is not supported on multiple ports\n");
+		return -1;
+	}
+	return nargs;
+}
+
+// Parse a command and its arguments, argv[0] being the command name
+static bool job_needs_image(const struct _job* job)
+{
+	return (job->command == CMD_WRITE || job->command == CMD_VERIFY) &&
+		!is_stdio(job->filename);
+}
+
+static bool job_dumps_to_stdout(const struct _job* job)
+{
+	return job->command == CMD_READ && is_stdio(job->filename);
+}
+
+static bool parse_command(int argc, char** argv, struct _job* job)
+{
+	bool err = true;
+
+	memset(job, 0, sizeof(*job));
+	char* cmd_text = argv[0];
+	if (!strcmp(cmd_text, "read")) {
+		if (argc == 4) {
+			job->command = CMD_READ;
+			job->filename = argv[1];
+			job->addr = strtol(argv[2], NULL, 0);
+			job->size = strtol(argv[3], NULL, 0);
+			err = false;
+		} else {
+			fprintf(stderr, "Error: invalid number of arguments\n");
+		}
+	} else if (!strcmp(cmd_text, "write")) {
+		if (argc == 2 || argc == 3) {
+			job->command = CMD_WRITE;
+			job->filename = argv[1];
+			job->has_addr = argc == 3;
+			job->addr = job->has_addr ? strtol(argv[2], NULL, 0) : 0;
 			err = false;
 		} else {
 			fprintf(stderr, "Error: invalid number of arguments\n");
 		}
 	} else if (!strcmp(cmd_text, "verify")) {
-		if (argc == 5) {
-			command = CMD_VERIFY;
-			filename = argv[3];
-			addr = strtol(argv[4], NULL, 0);
+		if (argc == 2 || argc == 3) {
+			job->command = CMD_VERIFY;
+			job->filename = argv[1];
+			job->has_addr = argc == 3;
+			job->addr = job->has_addr ? strtol(argv[2], NULL, 0) : 0;
+			err = false;
+		} else {
+			fprintf(stderr, "Error: invalid number of arguments\n");
+		}
+	} else if (!strcmp(cmd_text, "flash")) {
+		if (argc == 2) {
+			job->command = CMD_FLASH;
+			job->filename = argv[1];
 			err = false;
 		} else {
 			fprintf(stderr, "Error: invalid number of arguments\n");
 		}
 	} else if (!strcmp(cmd_text, "erase-all")) {
+		if (argc == 1) {
+			job->command = CMD_ERASE_ALL;
+			err = false;
+		} else {
+			fprintf(stderr, "Error: invalid number of arguments\n");
+		}
+	} else if (!strcmp(cmd_text, "erase")) {
 		if (argc == 3) {
-			command = CMD_ERASE_ALL;
+			job->command = CMD_ERASE;
+			job->addr = strtol(argv[1], NULL, 0);
+			job->size = strtol(argv[2], NULL, 0);
+			err = false;
+		} else {
+			fprintf(stderr, "Error: invalid number of arguments\n");
+		}
+	} else if (!strcmp(cmd_text, "locks")) {
+		if (argc == 1) {
+			job->command = CMD_LOCKS;
 			err = false;
 		} else {
 			fprintf(stderr, "Error: invalid number of arguments\n");
 		}
 	} else if (!strcmp(cmd_text, "gpnvm")) {
-		if (argc == 5) {
-			if (!strcmp(argv[3], "get")) {
-				command = CMD_GPNVM_GET;
-				addr = strtol(argv[4], NULL, 0);
+		if (argc == 3) {
+			if (!strcmp(argv[1], "get")) {
+				job->command = CMD_GPNVM_GET;
+				job->addr = strtol(argv[2], NULL, 0);
 				err = false;
-			} else if (!strcmp(argv[3], "set")) {
-				command = CMD_GPNVM_SET;
-				addr = strtol(argv[4], NULL, 0);
+			} else if (!strcmp(argv[1], "set")) {
+				job->command = CMD_GPNVM_SET;
+				job->addr = strtol(argv[2], NULL, 0);
 				err = false;
-			} else if (!strcmp(argv[3], "clear")) {
-				command = CMD_GPNVM_CLEAR;
-				addr = strtol(argv[4], NULL, 0);
+			} else if (!strcmp(argv[1], "clear")) {
+				job->command = CMD_GPNVM_CLEAR;
+				job->addr = strtol(argv[2], NULL, 0);
 				err = false;
 			} else {
-				fprintf(stderr, "Error: unknown GPNVM command '%s'\n", argv[3]);
+				fprintf(stderr, "Error: unknown GPNVM command '%s'\n", argv[1]);
 			}
 		} else {
 			fprintf(stderr, "Error: invalid number of arguments\n");
 		}
+	} else if (!strcmp(cmd_text, "peek")) {
+		if (argc == 2) {
+			job->command = CMD_PEEK;
+			job->addr = strtoul(argv[1], NULL, 0);
+			err = false;
+		} else {
+			fprintf(stderr, "Error: invalid number of arguments\n");
+		}
+	} else if (!strcmp(cmd_text, "poke")) {
+		if (argc == 3) {
+			job->command = CMD_POKE;
+			job->addr = strtoul(argv[1], NULL, 0);
+			job->value = strtoul(argv[2], NULL, 0);
+			err = false;
+		} else {
+			fprintf(stderr, "Error: invalid number of arguments\n");
+		}
+	} else if (!strcmp(cmd_text, "sleep")) {
+		if (argc == 2) {
+			job->command = CMD_SLEEP;
+			job->value = strtoul(argv[1], NULL, 0);
+			err = false;
+		} else {
+			fprintf(stderr, "Error: invalid number of arguments\n");
+		}
+	} else if (!strcmp(cmd_text, "script")) {
+		if (argc == 2) {
+			job->command = CMD_SCRIPT;
+			job->filename = argv[1];
+			err = false;
+		} else {
+			fprintf(stderr, "Error: invalid number of arguments\n");
+		}
 	} else {
 		fprintf(stderr, "Error: unknown command '%s'\n", cmd_text);
 	}
-	if (err) {
-		usage(argv[0]);
-		return -1;
-	}
 
-	err = true;
+	return !err;
+}
 
-	printf("Port: %s\n", port);
-	fd = samba_open(port);
-	if (fd < 0)
-		return -1;
+static bool session_open(struct _session* session)
+{
+	info(session, "Port: %s\n", session->port);
+	uint64_t phase = stats_start(session->stats);
+	session->fd = samba_open(session->port, session->options->io_mode);
+	if (session->fd < 0)
+		return false;
+	samba_set_stats(session->fd, session->stats);
+	if (session->options->read_window &&
+			!samba_set_read_window(session->fd, session->options->read_window))
+		return false;
+	if (session->options->timeout &&
+			!samba_set_timeout(session->fd, session->options->timeout))
+		return false;
+	if (session->options->packet_size &&
+			!samba_set_packet_size(session->fd, session->options->packet_size))
+		return false;
+	stats_phase(session->stats, STATS_PHASE_OPEN, phase);
 
 	// Identify chip
-	const struct _chip* chip;
-	if (!chipid_identity_serie(fd, &chip)) {
+	phase = stats_start(session->stats);
+	session->serie = chipid_identity_serie(session->fd, &session->chip);
+	if (!session->serie) {
 		fprintf(stderr, "Could not identify chip\n");
-		goto exit;
+		return false;
 	}
-	printf("Device: Atmel %s\n", chip->name);
+	stats_phase(session->stats, STATS_PHASE_IDENTIFY, phase);
+	info(session, "Device: Atmel %s\n", session->chip->name);
 
 	// Read and check flash information
-	struct _eefc_locks locks;
-	if (!eefc_read_flash_info(fd, chip, &locks)) {
+	phase = stats_start(session->stats);
+	if (!eefc_read_flash_info(session->fd, session->chip, &session->locks)) {
 		fprintf(stderr, "Could not read flash information\n");
-		goto exit;
+		return false;
 	}
-	printf("Flash Size: %uKB\n", chip->flash_size);
+	stats_phase(session->stats, STATS_PHASE_GETD, phase);
+	info(session, "Flash Size: %uKB\n", session->chip->flash_size);
+
+	return true;
+}
+
+static void session_close(struct _session* session)
+{
+	if (session->fd >= 0)
+		samba_close(session->fd);
+	session->fd = -1;
+	if (session->manifest_loaded)
+		manifest_free(&session->manifest);
+	session->manifest_loaded = false;
+}
+
+static bool session_load_applet(struct _session* session)
+{
+	if (session->applet_loaded)
+		return true;
+	info(session, "Loading applet at 0x%08x\n", APPLET_ADDR);
+	uint64_t phase = stats_start(session->stats);
+	if (!applet_load(session->fd))
+		return false;
+	stats_phase(session->stats, STATS_PHASE_APPLET, phase);
+	session->applet_loaded = true;
+	return true;
+}
+
+// Load the manifest of the device on first use, keyed by the serial given with
+// --serial or by the unique identifier of the chip
+static bool session_load_manifest(struct _session* session)
+{
+	if (session->manifest_loaded)
+		return true;
+
+	const char* key = session->options->serial;
+	char id_text[2 * EEFC_UNIQUE_ID_SIZE + 1];
+	if (!key) {
+		uint8_t id[EEFC_UNIQUE_ID_SIZE];
+		if (!eefc_read_unique_id(session->fd, session->chip, id))
+			return false;
+		for (uint32_t i = 0; i < EEFC_UNIQUE_ID_SIZE; i++)
+			sprintf(id_text + 2 * i, "%02x", id[i]);
+		key = id_text;
+	}
+	if (!manifest_load(&session->manifest, session->options->manifest, key,
+				session->chip))
+		return false;
+	info(session, "Manifest '%s': %d pages known\n", session->manifest.path,
+			session->manifest.nb_known);
+	session->manifest_loaded = true;
+	return true;
+}
+
+static uint32_t blank_page_crc(void)
+{
+	uint8_t page[EEFC_PAGE_SIZE];
+	memset(page, 0xff, sizeof(page));
+	return crc32(page, sizeof(page));
+}
+
+// Find the blank page sized regions of a read from the CRCs computed on the
+// device.  Returns an array with one entry per region, or NULL on error.
+static bool* find_blank_pages(struct _session* session, uint32_t addr, uint32_t size)
+{
+	if (!session_load_applet(session))
+		return NULL;
+
+	uint32_t nb_regions = (size + EEFC_PAGE_SIZE - 1) / EEFC_PAGE_SIZE;
+	uint32_t* crcs = malloc(MAX(nb_regions, 1) * sizeof(uint32_t));
+	bool* blank = calloc(MAX(nb_regions, 1), sizeof(bool));
+	if (!crcs || !blank || !read_flash_crcs(session->fd, session->chip, addr, size, crcs)) {
+		free(crcs);
+		free(blank);
+		return NULL;
+	}
+
+	uint8_t page[EEFC_PAGE_SIZE];
+	memset(page, 0xff, sizeof(page));
+	uint32_t blank_crc = crc32(page, EEFC_PAGE_SIZE);
+	uint32_t tail = size % EEFC_PAGE_SIZE;
+	uint32_t blank_tail_crc = crc32(page, tail);
+	for (uint32_t i = 0; i < nb_regions; i++) {
+		if (tail && i == nb_regions - 1)
+			blank[i] = crcs[i] == blank_tail_crc;
+		else
+			blank[i] = crcs[i] == blank_crc;
+	}
+	free(crcs);
+	return blank;
+}
+
+// Check a sample of the pages marked unchanged against the flash content,
+// evenly spread over the map from a random start.  The CRCs are computed on
+// the device when crc is set, the pages are read back otherwise.
+static bool spot_check_pages(struct _session* session, const struct _pagemap* map,
+		bool crc, bool* valid)
+{
+	const struct _page* pages = map->pages;
+	uint32_t unchanged = 0;
+	for (uint32_t i = 0; i < map->count; i++)
+		if (pages[i].state == PAGE_UNCHANGED)
+			unchanged++;
+	*valid = true;
+	if (!unchanged)
+		return true;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint32_t step = MAX(unchanged / DELTA_SPOT_CHECKS, 1);
+	uint32_t next = now.tv_nsec % step;
+	uint32_t checked = 0;
+	uint64_t buffer[EEFC_PAGE_SIZE / 8];
+	for (uint32_t i = 0, n = 0; i < map->count && checked < DELTA_SPOT_CHECKS; i++) {
+		if (pages[i].state != PAGE_UNCHANGED || n++ != next)
+			continue;
+		next += step;
+		checked++;
+
+		uint32_t addr = pages[i].number * EEFC_PAGE_SIZE;
+		uint32_t actual;
+		if (crc) {
+			if (!applet_crc32(session->fd, session->chip, addr, EEFC_PAGE_SIZE, 1, &actual))
+				return false;
+		} else {
+			if (!eefc_read(session->fd, session->chip, (uint8_t*)buffer, addr, EEFC_PAGE_SIZE))
+				return false;
+			actual = crc32((uint8_t*)buffer, EEFC_PAGE_SIZE);
+		}
+		if (actual != crc32(pages[i].data, EEFC_PAGE_SIZE)) {
+			*valid = false;
+			break;
+		}
+	}
+	return true;
+}
+
+// Mark the pages whose content is known from the manifest to be in flash as
+// unchanged, once a sample of them is checked on the device.  Partial pages
+// match if the flash holds their data and is blank elsewhere.  The pages that
+// are not in the manifest and the other partial pages are compared with the
+// flash content as with --diff.
+static bool delta_pages(struct _session* session, struct _pagemap* map, bool crc)
+{
+	const struct _manifest* manifest = &session->manifest;
+
+	// the other pages are compared as a map of copies of their descriptors,
+	// sharing the data, and their state is copied back
+	struct _pagemap others;
+	memset(&others, 0, sizeof(others));
+	others.pages = malloc(MAX(map->count, 1) * sizeof(struct _page));
+	if (!others.pages)
+		return false;
+
+	uint32_t known = 0, unchanged = 0;
+	for (uint32_t i = 0; i < map->count; i++) {
+		struct _page* p = &map->pages[i];
+		uint32_t value;
+		bool found = manifest_get(manifest, p->number, &value);
+		if (found && crc32(p->data, EEFC_PAGE_SIZE) == value) {
+			p->state = PAGE_UNCHANGED;
+			unchanged++;
+		} else if (!found || !page_is_full(p)) {
+			others.pages[others.count++] = *p;
+			continue;
+		}
+		known++;
+	}
+
+	bool valid;
+	if (!spot_check_pages(session, map, crc, &valid)) {
+		free(others.pages);
+		return false;
+	}
+	if (!valid) {
+		info(session, "Manifest does not match the flash content, comparing all pages\n");
+		free(others.pages);
+		manifest_clear(&session->manifest);
+		for (uint32_t i = 0; i < map->count; i++)
+			map->pages[i].state = PAGE_WRITE;
+		return diff_pages(session, map, crc);
+	}
+
+	info(session, "Manifest: %d pages known, %d unchanged, %d pages to compare\n",
+			known, unchanged, others.count);
+	bool ok = diff_pages(session, &others, crc);
+	for (uint32_t i = 0; ok && i < others.count; i++)
+		pagemap_find(map, others.pages[i].number)->state = others.pages[i].state;
+	free(others.pages);
+	return ok;
+}
 
-	// Execute command
-	switch (command) {
+// Forget the pages about to be erased or written in the manifest and save it,
+// so that it stays valid if programming is interrupted.  The partial pages
+// written over pages known to be blank become full pages.
+static bool forget_manifest_pages(struct _session* session, struct _pagemap* map,
+		const struct _eefc_erase_plan* plan)
+{
+	struct _manifest* manifest = &session->manifest;
+	if (!session->manifest_loaded)
+		return true;
+
+	uint8_t blank[EEFC_PAGE_SIZE];
+	memset(blank, 0xff, sizeof(blank));
+	uint32_t blank_crc = crc32(blank, sizeof(blank));
+	for (uint32_t i = 0; i < map->count; i++) {
+		struct _page* p = &map->pages[i];
+		uint32_t value;
+		if (p->state != PAGE_WRITE)
+			continue;
+		if (!page_is_full(p) && manifest_get(manifest, p->number, &value) &&
+				value == blank_crc && !page_fill(p, blank))
+			return false;
+		manifest_forget(manifest, p->number);
+	}
+	for (uint32_t i = 0; i < plan->count; i++)
+		for (uint32_t j = 0; j < plan->blocks[i].nb_pages; j++)
+			manifest_forget(manifest, plan->blocks[i].first_page + j);
+	return manifest_save(manifest);
+}
+
+// Record the flash content after programming in the manifest: the erased
+// blocks are blank and the pages of the map fully defined hold their data
+static bool record_manifest_pages(struct _session* session, const struct _pagemap* map,
+		const struct _eefc_erase_plan* plan)
+{
+	struct _manifest* manifest = &session->manifest;
+	if (!session->manifest_loaded)
+		return true;
+
+	uint32_t blank_crc = blank_page_crc();
+	for (uint32_t i = 0; i < plan->count; i++)
+		for (uint32_t j = 0; j < plan->blocks[i].nb_pages; j++)
+			manifest_set(manifest, plan->blocks[i].first_page + j, blank_crc);
+	for (uint32_t i = 0; i < map->count; i++)
+		if (page_is_full(&map->pages[i]))
+			manifest_set(manifest, map->pages[i].number,
+					crc32(map->pages[i].data, EEFC_PAGE_SIZE));
+	return manifest_save(manifest);
+}
+
+// Identifier of the pages to write, so that a journal is only resumed by the
+// write of the same pages
+static uint32_t pagemap_id(const struct _pagemap* map)
+{
+	uint32_t* values = malloc(MAX(map->count, 1) * 2 * sizeof(uint32_t));
+	if (!values)
+		return 0;
+	for (uint32_t i = 0; i < map->count; i++) {
+		values[2 * i] = map->pages[i].number;
+		values[2 * i + 1] = crc32(map->pages[i].data, EEFC_PAGE_SIZE);
+	}
+	uint32_t id = crc32((const uint8_t*)values, map->count * 2 * sizeof(uint32_t));
+	free(values);
+	return id;
+}
+
+// Open the journal of the write, next to the file.  With --resume, the journal
+// of an interrupted write of the same pages is loaded, and the write fails if
+// the last and first pages it records as written are not in flash.  Otherwise
+// a new journal is started, the write going on without journal if it cannot
+// be created.
+static bool open_journal(struct _session* session, struct _pagemap* map,
+		const char* filename, struct _journal* journal, bool* erased)
+{
+	const char* chip = session->chip->name;
+	uint32_t id = pagemap_id(map);
+	char* path = malloc(strlen(filename) + sizeof(".journal"));
+	if (!path)
+		return false;
+	sprintf(path, "%s.journal", filename);
+
+	*erased = false;
+	struct _journal_state state;
+	if (session->options->resume &&
+			journal_resume(journal, path, chip, id, map, &state)) {
+		// the first page written is checked too, in case another
+		// image was written meanwhile
+		uint32_t checks[2] = { state.last_page, state.first_page };
+		bool valid = true;
+		for (uint32_t i = 0; state.has_last && valid && i < 2; i++) {
+			struct _page* p = pagemap_find(map, checks[i]);
+			uint64_t buffer[EEFC_PAGE_SIZE / 8];
+			if (!eefc_read(session->fd, session->chip, (uint8_t*)buffer,
+						checks[i] * EEFC_PAGE_SIZE, EEFC_PAGE_SIZE)) {
+				journal_close(journal, false);
+				free(path);
+				return false;
+			}
+			valid = p && page_matches(p, (uint8_t*)buffer);
+		}
+		if (valid) {
+			info(session, "Resuming from journal '%s': %d pages written%s\n", path,
+					state.committed, state.erased ? ", blocks erased" : "");
+			*erased = state.erased;
+			free(path);
+			return true;
+		}
+		// the map now holds the pages saved by the journal, which may
+		// not match the flash either
+		fprintf(stderr, "Journal '%s' does not match the flash content, write without --resume to start over\n",
+				path);
+		journal_close(journal, false);
+		free(path);
+		return false;
+	} else if (session->options->resume) {
+		info(session, "No write to resume, writing all pages\n");
+	}
+
+	if (!journal_create(journal, path, chip, id))
+		fprintf(stderr, "Writing without journal, the write cannot be resumed\n");
+	free(path);
+	return true;
+}
+
+// Program the pages of the map: find the unchanged pages with --diff or
+// --delta, erase the blocks of the pages marked for erase (unless done by the
+// resumed write), unlock the regions to modify once and write the pages,
+// keeping the manifest up to date.
+static bool program_map(struct _session* session, struct _pagemap* map,
+		const char* text, const char* filename, bool erased)
+{
+	const struct _options* options = session->options;
+	uint64_t phase;
+
+	// unchanged pages are found using the applet CRCs when the applet is
+	// loaded anyway
+	bool diff = options->diff || options->delta;
+	bool crc = diff && (options->applet || options->crc);
+	if ((options->applet || crc) && !session_load_applet(session))
+		return false;
+	if (options->manifest && !session_load_manifest(session))
+		return false;
+	if (diff) {
+		info(session, "Comparing %s with file '%s'\n", text, filename);
+		phase = stats_start(session->stats);
+		if (options->delta ? !delta_pages(session, map, crc) : !diff_pages(session, map, crc))
+			return false;
+		stats_phase(session->stats, STATS_PHASE_DIFF, phase);
+	}
+
+	// the blocks erased by the resumed write only hold blank pages and
+	// pages of the map
+	struct _eefc_erase_plan plan;
+	memset(&plan, 0, sizeof(plan));
+	for (uint32_t i = 0; erased && i < map->count; i++) {
+		struct _page* p = &map->pages[i];
+		if (p->state == PAGE_WRITE && p->erase && page_is_blank(p->data))
+			p->state = PAGE_BLANK;
+	}
+	if ((!erased && !plan_erase(session, map, &plan)) ||
+			!forget_manifest_pages(session, map, &plan) ||
+			!unlock_pages(session, map, &plan) ||
+			!erase_pages(session, map, &plan))
+		return false;
+
+	info(session, "Writing %s from file '%s'\n", text, filename);
+	struct _samba_counters before, after;
+	samba_get_counters(session->fd, &before);
+	phase = stats_start(session->stats);
+	if (!write_pages(session, map))
+		return false;
+	stats_phase(session->stats, STATS_PHASE_WRITE, phase);
+	samba_get_counters(session->fd, &after);
+	if (!record_manifest_pages(session, map, &plan))
+		return false;
+
+	uint32_t blank = 0, unchanged = 0;
+	for (uint32_t i = 0; i < map->count; i++) {
+		if (map->pages[i].state == PAGE_BLANK)
+			blank++;
+		else if (map->pages[i].state == PAGE_UNCHANGED)
+			unchanged++;
+	}
+	if (blank + unchanged)
+		info(session, "Skipped %d pages (%d bytes): %d blank, %d unchanged\n",
+				blank + unchanged, (blank + unchanged) * EEFC_PAGE_SIZE,
+				blank, unchanged);
+	if (!session->prefix && !session->quiet)
+		print_counters(&before, &after, map->count);
+	return true;
+}
+
+// Program the pages of the map, recording the progress in a journal next to
+// the file so that the write can be resumed if interrupted
+static bool program_pages(struct _session* session, struct _pagemap* map,
+		const char* text, const char* filename)
+{
+	struct _journal journal;
+	bool erased = false;
+	memset(&journal, 0, sizeof(journal));
+	if (!session->options->ports &&
+			!open_journal(session, map, filename, &journal, &erased))
+		return false;
+
+	session->journal = journal.file ? &journal : NULL;
+	bool ok = program_map(session, map, text, filename, erased);
+	session->journal = NULL;
+	if (!ok && journal.file)
+		fprintf(stderr, "Progress saved in '%s', run again with --resume to continue\n",
+				journal.path);
+	journal_close(&journal, ok);
+	return ok;
+}
+
+// Verify all the pages of the map, including the skipped ones, using CRCs
+// computed on the device for whole pages when the applet is loaded.
+static bool verify_pages(struct _session* session, struct _pagemap* map)
+{
+	const struct _options* options = session->options;
+
+	if ((options->applet || options->crc) && !session_load_applet(session))
+		return false;
+	uint64_t phase = stats_start(session->stats);
+	for (uint32_t i = 0; i < map->count; i++)
+		map->pages[i].state = PAGE_WRITE;
+	if (!diff_pages(session, map, options->applet || options->crc))
+		return false;
+	for (uint32_t i = 0; i < map->count; i++) {
+		if (map->pages[i].state != PAGE_UNCHANGED) {
+			fprintf(stderr, "Verify failed in page at offset %d\n",
+					map->pages[i].number * EEFC_PAGE_SIZE);
+			return false;
+		}
+	}
+	stats_phase(session->stats, STATS_PHASE_VERIFY, phase);
+	return true;
+}
+
+// Write or verify the raw binary read from the standard input at the start
+// address, piece by piece as it arrives while the next pieces are read by
+// another thread, so that the memory used is bounded whatever the size.
+// Each piece is written like an image of its own, quietly, and a summary is
+// printed at the end.
+static bool stream_image(struct _session* session, bool verify)
+{
+	const struct _options* options = session->options;
+	const struct _job* job = session->job;
+	if (!job->has_addr) {
+		fprintf(stderr, "A start address is required for the standard input\n");
+		return false;
+	}
+	if (options->resume) {
+		fprintf(stderr, "Writes from the standard input cannot be resumed\n");
+		return false;
+	}
+	if ((options->crc || (!verify && options->applet)) && !session_load_applet(session))
+		return false;
+	if (!verify && options->manifest && !session_load_manifest(session))
+		return false;
+
+	struct _pipeline pipeline;
+	if (!pipeline_init(&pipeline, PIPELINE_BUFFERS, READ_BUFFER_SIZE))
+		return false;
+	struct _file_reader reader = {
+		.pipeline = &pipeline,
+		.file = stdin,
+		.addr = job->addr,
+		.ok = true,
+	};
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, file_reader_run, &reader) != 0) {
+		pipeline_free(&pipeline);
+		return false;
+	}
+
+	uint64_t phase = stats_start(session->stats);
+	struct _samba_counters before, after;
+	samba_get_counters(session->fd, &before);
+	bool ok = true;
+	uint32_t total = 0, pieces = 0;
+	struct _pipeline_buffer* buffer;
+	while ((buffer = pipeline_consume(&pipeline))) {
+		struct _image_segment segment = {
+			.addr = buffer->addr,
+			.data = buffer->data + (buffer->addr & (EEFC_PAGE_SIZE - 1)),
+			.size = buffer->size,
+		};
+		struct _image image = {
+			.format = IMAGE_BINARY,
+			.data = segment.data,
+			.size = segment.size,
+			.segments = &segment,
+			.nb_segments = 1,
+		};
+		uint32_t addr;
+		ok = segment_offset(session, &image, 0, &segment, &addr);
+		if (ok && verify) {
+			ok = verify_flash(session->fd, session->chip, options,
+					segment.data, addr, segment.size);
+		} else if (ok) {
+			char text[64];
+			snprintf(text, sizeof(text), "%d bytes at 0x%08x", segment.size, addr);
+			struct _pagemap map;
+			memset(&map, 0, sizeof(map));
+			session->quiet = true;
+			ok = image_to_pagemap(session, &image, 0, options->erase, &map) &&
+				program_map(session, &map, text, job->filename, false);
+			session->quiet = false;
+			pagemap_free(&map);
+		}
+		if (!ok) {
+			pipeline_abort(&pipeline);
+			break;
+		}
+		total += segment.size;
+		pieces++;
+		pipeline_release(&pipeline);
+	}
+	pthread_join(thread, NULL);
+	pipeline_free(&pipeline);
+	if (!ok || !reader.ok)
+		return false;
+
+	if (verify)
+		stats_phase(session->stats, STATS_PHASE_VERIFY, phase);
+	samba_get_counters(session->fd, &after);
+	info(session, "%s %d bytes at 0x%08x from the standard input in %d pieces\n",
+			verify ? "Verified" : "Wrote", total, job->addr, pieces);
+	if (!session->prefix)
+		print_counters(&before, &after,
+				(job->addr + total + EEFC_PAGE_SIZE - 1) / EEFC_PAGE_SIZE -
+				job->addr / EEFC_PAGE_SIZE);
+	return true;
+}
+
+// Print the lock bitmap, one character per region ('L' if locked), 32
+// regions per line
+static void print_locks(const struct _session* session, const struct _eefc_locks* locks)
+{
+	uint32_t locked = 0;
+	bool same_size = true;
+	for (uint32_t i = 0; i < locks->count; i++) {
+		if (eefc_is_locked(locks, i))
+			locked++;
+		if (locks->size[i] != locks->size[0])
+			same_size = false;
+	}
+	if (same_size && locks->count)
+		info(session, "%d lock regions of %d bytes, %d locked\n",
+				locks->count, locks->size[0], locked);
+	else
+		info(session, "%d lock regions, %d locked\n", locks->count, locked);
+
+	for (uint32_t i = 0; i < locks->count; i += 32) {
+		char line[33];
+		uint32_t n = MIN(32, locks->count - i);
+		for (uint32_t j = 0; j < n; j++)
+			line[j] = eefc_is_locked(locks, i + j) ? 'L' : '.';
+		line[n] = '\0';
+		info(session, "0x%08x %s\n", locks->offset[i], line);
+	}
+}
+
+static bool session_execute(struct _session* session);
+
+// Run a command of a script in the session, loading its image first
+static bool run_job(struct _session* session, const struct _job* job)
+{
+	const struct _job* script = session->job;
+	struct _image_loader loader;
+	struct _layout layout;
+	struct _job copy = *job;
+
+	session->job = &copy;
+	session->loader = NULL;
+	if ((job->command == CMD_READ || job->command == CMD_WRITE ||
+				job->command == CMD_VERIFY) && is_stdio(job->filename)) {
+		fprintf(stderr, "The standard input and output are not supported in scripts\n");
+		session->job = script;
+		return false;
+	} else if (job_needs_image(job)) {
+		if (!image_loader_start(&loader, job->filename, false)) {
+			session->job = script;
+			return false;
+		}
+		session->loader = &loader;
+	} else if (job->command == CMD_FLASH) {
+		if (!layout_load(&layout, job->filename)) {
+			session->job = script;
+			return false;
+		}
+		copy.layout = &layout;
+	}
+
+	bool ok = session_execute(session);
+
+	if (session->loader)
+		image_loader_free(session->loader);
+	if (copy.layout)
+		layout_free(copy.layout);
+	session->loader = NULL;
+	session->job = script;
+	return ok;
+}
+
+static bool flush_pokes(struct _session* session, struct _samba_word* pokes,
+		uint32_t* count)
+{
+	bool ok = !*count || samba_write_word_list(session->fd, pokes, *count);
+	*count = 0;
+	return ok;
+}
+
+// Run the commands of a script, one per line, in the open session.
+// Consecutive pokes are sent together, before the next other command, unless
+// the script is read from a terminal.
+static bool run_script(struct _session* session)
+{
+	const char* filename = session->job->filename;
+	bool is_stdin = !strcmp(filename, "-");
+	FILE* file = is_stdin ? stdin : fopen(filename, "r");
+	if (!file) {
+		fprintf(stderr, "Could not open '%s' for reading\n", filename);
+		return false;
+	}
+	bool interactive = isatty(fileno(file));
+
+	struct _samba_word pokes[MAX_SCRIPT_POKES];
+	uint32_t nb_pokes = 0;
+	char line[MAX_SCRIPT_LINE_SIZE];
+	int number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), file)) {
+		number++;
+		char* comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		// gang sessions run scripts in parallel threads
+		char* argv[MAX_SCRIPT_ARGS + 1];
+		char* save;
+		int argc = 0;
+		for (char* arg = strtok_r(line, " \t\r\n", &save); arg;
+				arg = strtok_r(NULL, " \t\r\n", &save)) {
+			if (argc == MAX_SCRIPT_ARGS)
+				break;
+			argv[argc++] = arg;
+		}
+		if (!argc)
+			continue;
+
+		struct _job job;
+		if (!parse_command(argc, argv, &job)) {
+			ok = false;
+		} else if (job.command == CMD_SCRIPT) {
+			fprintf(stderr, "Error: scripts cannot be nested\n");
+			ok = false;
+		} else if (job.command == CMD_READ && session->prefix) {
+			fprintf(stderr, "Error: read is not supported on multiple ports\n");
+			ok = false;
+		} else if (job.command == CMD_POKE) {
+			if (nb_pokes == MAX_SCRIPT_POKES)
+				ok = flush_pokes(session, pokes, &nb_pokes);
+			info(session, "Writing 0x%08x at 0x%08x\n", job.value, job.addr);
+			pokes[nb_pokes].addr = job.addr;
+			pokes[nb_pokes].value = job.value;
+			nb_pokes++;
+			if (ok && interactive)
+				ok = flush_pokes(session, pokes, &nb_pokes);
+		} else {
+			ok = flush_pokes(session, pokes, &nb_pokes) && run_job(session, &job);
+		}
+		if (!ok)
+			fprintf(stderr, "%s:%d: '%s' failed\n", is_stdin ? "<stdin>" : filename,
+					number, argv[0]);
+	}
+	if (ok)
+		ok = flush_pokes(session, pokes, &nb_pokes);
+
+	if (!is_stdin)
+		fclose(file);
+	return ok;
+}
+
+static bool session_execute(struct _session* session)
+{
+	int fd = session->fd;
+	const struct _chip* chip = session->chip;
+	const struct _options* options = session->options;
+	const struct _job* job = session->job;
+	const struct _image* image;
+	uint32_t addr = job->addr;
+	uint32_t size = job->size;
+	uint64_t phase;
+
+	switch (job->command) {
 		case CMD_READ:
 		{
-			printf("Reading %d bytes at 0x%08x to file '%s'\n", size, addr, filename);
-			if (read_flash(fd, chip, addr, size, filename)) {
-				err = false;
+			bool* blank = NULL;
+			if (options->sparse && (options->applet || options->crc)) {
+				blank = find_blank_pages(session, addr, size);
+				if (!blank)
+					return false;
 			}
-			break;
+			info(session, "Reading %d bytes at 0x%08x to file '%s'\n", size, addr, job->filename);
+			phase = stats_start(session->stats);
+			bool ok = read_flash(session, addr, size, job->filename, blank);
+			free(blank);
+			if (!ok)
+				return false;
+			stats_phase(session->stats, STATS_PHASE_READ, phase);
+			return true;
 		}
 
 		case CMD_WRITE:
 		{
-			if (get_file_size(filename, &size)) {
-				printf("Unlocking %d bytes at 0x%08x\n", size, addr);
-				if (eefc_unlock(fd, chip, &locks, addr, size)) {
-					printf("Writing %d bytes at 0x%08x from file '%s'\n", size, addr, filename);
-					if (write_flash(fd, chip, filename, addr, size)) {
-						err = false;
-					}
+			if (is_stdio(job->filename))
+				return stream_image(session, false);
+			image = image_loader_wait(session->loader);
+			if (!image)
+				return false;
+			if (image->format == IMAGE_BINARY && !job->has_addr) {
+				fprintf(stderr, "A start address is required for raw binary '%s'\n",
+						job->filename);
+				return false;
+			}
+			char text[64];
+			describe_image(session, image, text, sizeof(text));
+			struct _pagemap map;
+			memset(&map, 0, sizeof(map));
+			bool ok = image_to_pagemap(session, image, addr, options->erase, &map);
+			if (ok && !map.count)
+				info(session, "Nothing to write in file '%s'\n", job->filename);
+			else if (ok)
+				ok = program_pages(session, &map, text, job->filename);
+			pagemap_free(&map);
+			return ok;
+		}
+
+		case CMD_FLASH:
+		{
+			// all the images are merged in a single map, sharing the
+			// partially covered pages
+			struct _layout* layout = job->layout;
+			struct _pagemap map;
+			memset(&map, 0, sizeof(map));
+			uint32_t bytes = 0;
+			for (uint32_t i = 0; i < layout->count; i++) {
+				struct _layout_entry* entry = &layout->entries[i];
+				image = image_loader_wait(&entry->loader);
+				if (!image) {
+					pagemap_free(&map);
+					return false;
+				}
+				if (image->format == IMAGE_BINARY && !entry->has_addr) {
+					fprintf(stderr, "A start address is required for raw binary '%s'\n",
+							entry->filename);
+					pagemap_free(&map);
+					return false;
 				}
+				if (!image_to_pagemap(session, image, entry->addr,
+							options->erase || entry->erase, &map)) {
+					fprintf(stderr, "Could not add '%s' to the layout\n", entry->filename);
+					pagemap_free(&map);
+					return false;
+				}
+				bytes += image->size;
 			}
-			break;
+			char text[64];
+			snprintf(text, sizeof(text), "%d bytes in %d images", bytes, layout->count);
+			bool ok = program_pages(session, &map, text, job->filename);
+			if (ok) {
+				info(session, "Verifying %s\n", text);
+				ok = verify_pages(session, &map);
+			}
+			pagemap_free(&map);
+			if (!ok)
+				return false;
+
+			for (uint32_t i = 0; i < layout->count; i++) {
+				const struct _layout_entry* entry = &layout->entries[i];
+				if (!entry->lock)
+					continue;
+				image = &entry->loader.image;
+				info(session, "Locking file '%s'\n", entry->filename);
+				for (uint32_t j = 0; j < image->nb_segments; j++) {
+					const struct _image_segment* segment = &image->segments[j];
+					if (!segment_offset(session, image, entry->addr, segment, &addr) ||
+							!eefc_lock(fd, chip, &session->locks, addr, segment->size))
+						return false;
+				}
+			}
+			return true;
 		}
 
 		case CMD_VERIFY:
 		{
-			if (get_file_size(filename, &size)) {
-				printf("Verifying %d bytes at 0x%08x with file '%s'\n", size, addr, filename);
-				if (verify_flash(fd, chip, filename, addr, size)) {
-					err = false;
-				}
+			if (is_stdio(job->filename))
+				return stream_image(session, true);
+			image = image_loader_wait(session->loader);
+			if (!image)
+				return false;
+			if (image->format == IMAGE_BINARY && !job->has_addr) {
+				fprintf(stderr, "A start address is required for raw binary '%s'\n",
+						job->filename);
+				return false;
 			}
-			break;
+			if (options->crc && !session_load_applet(session))
+				return false;
+			char text[64];
+			info(session, "Verifying %s with file '%s'\n",
+					describe_image(session, image, text, sizeof(text)), job->filename);
+			struct _samba_counters before, after;
+			samba_get_counters(fd, &before);
+			phase = stats_start(session->stats);
+			uint32_t pages = 0;
+			for (uint32_t i = 0; i < image->nb_segments; i++) {
+				const struct _image_segment* segment = &image->segments[i];
+				if (!segment_offset(session, image, job->addr, segment, &addr) ||
+						!verify_flash(fd, chip, options, segment->data, addr, segment->size))
+					return false;
+				pages += (addr + segment->size + EEFC_PAGE_SIZE - 1) / EEFC_PAGE_SIZE -
+					addr / EEFC_PAGE_SIZE;
+			}
+			stats_phase(session->stats, STATS_PHASE_VERIFY, phase);
+			samba_get_counters(fd, &after);
+			if (!session->prefix)
+				print_counters(&before, &after, pages);
+
+			// the verified pages are known to hold the image
+			if (!options->manifest)
+				return true;
+			struct _eefc_erase_plan plan;
+			struct _pagemap map;
+			memset(&plan, 0, sizeof(plan));
+			memset(&map, 0, sizeof(map));
+			bool ok = session_load_manifest(session) &&
+				image_to_pagemap(session, image, job->addr, false, &map) &&
+				record_manifest_pages(session, &map, &plan);
+			pagemap_free(&map);
+			return ok;
 		}
 
 		case CMD_ERASE_ALL:
 		{
-			printf("Unlocking all pages\n");
-			if (eefc_unlock(fd, chip, &locks, 0, chip->flash_size * 1024)) {
-				printf("Erasing all pages\n");
-				if (eefc_erase_all(fd, chip)) {
-					err = false;
-				}
+			struct _manifest* manifest = &session->manifest;
+			if (options->manifest) {
+				if (!session_load_manifest(session))
+					return false;
+				manifest_clear(manifest);
+				if (!manifest_save(manifest))
+					return false;
 			}
-			break;
+			info(session, "Unlocking all pages\n");
+			phase = stats_start(session->stats);
+			if (!eefc_unlock(fd, chip, &session->locks, 0, chip->flash_size * 1024))
+				return false;
+			stats_phase(session->stats, STATS_PHASE_UNLOCK, phase);
+			info(session, "Erasing all pages\n");
+			phase = stats_start(session->stats);
+			if (!eefc_erase_all(fd, chip))
+				return false;
+			stats_phase(session->stats, STATS_PHASE_ERASE, phase);
+			if (!options->manifest)
+				return true;
+			uint32_t blank_crc = blank_page_crc();
+			for (uint32_t page = 0; page < manifest->nb_pages; page++)
+				manifest_set(manifest, page, blank_crc);
+			return manifest_save(manifest);
+		}
+
+		case CMD_ERASE:
+		{
+			struct _eefc_erase_plan plan;
+			if (!eefc_plan_erase(chip, addr, size, &plan)) {
+				fprintf(stderr, "Could not plan erase of %d bytes at 0x%08x\n", size, addr);
+				return false;
+			}
+			struct _pagemap map;
+			memset(&map, 0, sizeof(map));
+			if (options->manifest && !session_load_manifest(session))
+				return false;
+			return forget_manifest_pages(session, &map, &plan) &&
+				unlock_pages(session, &map, &plan) &&
+				erase_pages(session, &map, &plan) &&
+				record_manifest_pages(session, &map, &plan);
+		}
+
+		case CMD_LOCKS:
+		{
+			struct _eefc_locks* locks = &session->locks;
+			if (!eefc_read_locks(fd, chip, locks))
+				return false;
+			print_locks(session, locks);
+			return true;
 		}
 
 		case CMD_GPNVM_GET:
 		{
-			printf("Getting GPNVM%d\n", addr);
+			info(session, "Getting GPNVM%d\n", addr);
 			bool value;
-			if (eefc_get_gpnvm(fd, chip, addr, &value)) {
-				printf("GPNVM%d is %s\n", addr, value ? "set" : "clear");
-				err = false;
-			}
-			break;
+			if (!eefc_get_gpnvm(fd, chip, addr, &value))
+				return false;
+			info(session, "GPNVM%d is %s\n", addr, value ? "set" : "clear");
+			return true;
 		}
 
 		case CMD_GPNVM_SET:
@@ -345,28 +2122,690 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "To avoid setting the security bit (GPNVM0) by mistake, an additional\n");
 				fprintf(stderr, "confirmation is required: please add a 'GPNVM0_CONFIRM' environment\n");
 				fprintf(stderr, "variable with any value and try again.\n");
-			} else {
-				printf("Setting GPNVM%d\n", addr);
-				if (eefc_set_gpnvm(fd, chip, addr)) {
-					err = false;
-				}
+				return false;
 			}
-			break;
+			info(session, "Setting GPNVM%d\n", addr);
+			return eefc_set_gpnvm(fd, chip, addr);
 		}
 
 		case CMD_GPNVM_CLEAR:
 		{
-			printf("Clearing GPNVM%d\n", addr);
-			if (eefc_clear_gpnvm(fd, chip, addr)) {
-				err = false;
-			}
-			break;
+			info(session, "Clearing GPNVM%d\n", addr);
+			return eefc_clear_gpnvm(fd, chip, addr);
 		}
+
+		case CMD_PEEK:
+		{
+			uint32_t value;
+			if (!samba_read_word(fd, addr, &value))
+				return false;
+			info(session, "0x%08x: 0x%08x\n", addr, value);
+			return true;
+		}
+
+		case CMD_POKE:
+		{
+			info(session, "Writing 0x%08x at 0x%08x\n", job->value, addr);
+			return samba_write_word(fd, addr, job->value);
+		}
+
+		case CMD_SLEEP:
+		{
+			info(session, "Sleeping %d ms\n", job->value);
+			struct timespec delay = {
+				.tv_sec = job->value / 1000,
+				.tv_nsec = (job->value % 1000) * 1000000L,
+			};
+			while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+				;
+			return true;
+		}
+
+		case CMD_SCRIPT:
+			return run_script(session);
 	}
 
-exit:
+	return false;
+}
+
+static void* session_run(void* arg)
+{
+	struct _session* session = arg;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	session->ok = session_open(session) && session_execute(session);
+	session->elapsed = elapsed_since(&start);
+	if (session->fd >= 0) {
+		struct _samba_counters none = { 0 };
+		print_recoveries(session, &none);
+	}
 	fflush(stdout);
-	samba_close(fd);
+	session_close(session);
+
+	return NULL;
+}
+
+static bool print_stats(const struct _session* sessions, int count,
+		const struct _options* options)
+{
+	if (options->stats) {
+		for (int i = 0; i < count; i++) {
+			if (!sessions[i].stats)
+				continue;
+			if (count > 1)
+				printf("\nStatistics for %s:\n", sessions[i].port);
+			else
+				printf("\nStatistics:\n");
+			stats_print(sessions[i].stats, stdout);
+		}
+	}
+
+	if (options->stats_json) {
+		bool is_stdout = !strcmp(options->stats_json, "-");
+		FILE* file = is_stdout ? stdout : fopen(options->stats_json, "w");
+		if (!file) {
+			fprintf(stderr, "Could not open '%s' for writing\n", options->stats_json);
+			return false;
+		}
+		fprintf(file, "{\"ports\": [");
+		for (int i = 0; i < count; i++) {
+			if (!sessions[i].stats)
+				continue;
+			fprintf(file, "%s{\"port\": \"%s\", \"device\": \"%s\", \"ok\": %s, "
+					"\"elapsed_ms\": %.3f, \"stats\": ", i ? ", " : "",
+					sessions[i].port,
+					sessions[i].chip ? sessions[i].chip->name : "unknown",
+					sessions[i].ok ? "true" : "false",
+					sessions[i].elapsed * 1e3);
+			stats_print_json(sessions[i].stats, file);
+			fprintf(file, "}");
+		}
+		fprintf(file, "]}\n");
+		if (!is_stdout)
+			fclose(file);
+	}
+
+	return true;
+}
+
+static bool run_gang(char* ports, const struct _options* options,
+		const struct _job* job, struct _image_loader* loader)
+{
+	struct _session sessions[MAX_PORTS];
+	int count = 0;
+	struct timespec start;
+
+	memset(sessions, 0, sizeof(sessions));
+	char* save;
+	for (char* port = strtok_r(ports, ",", &save); port; port = strtok_r(NULL, ",", &save)) {
+		if (count == MAX_PORTS) {
+			fprintf(stderr, "Error: too many ports (max %d)\n", MAX_PORTS);
+			return false;
+		}
+		sessions[count].port = port;
+		count++;
+	}
+
+	// one worker per device, all sharing the same read-only image
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < count; i++) {
+		struct _session* session = &sessions[i];
+		session->prefix = true;
+		session->fd = -1;
+		session->options = options;
+		session->job = job;
+		session->loader = loader;
+		if (options->stats || options->stats_json)
+			session->stats = stats_new();
+		if (pthread_create(&session->thread, NULL, session_run, session) != 0) {
+			fprintf(stderr, "%s: could not start worker\n", session->port);
+			session->thread = 0;
+		}
+	}
+
+	int passed = 0;
+	for (int i = 0; i < count; i++) {
+		if (sessions[i].thread)
+			pthread_join(sessions[i].thread, NULL);
+		if (sessions[i].ok)
+			passed++;
+	}
+	double elapsed = elapsed_since(&start);
+
+	printf("\n");
+	printf("Summary:\n");
+	for (int i = 0; i < count; i++) {
+		struct _session* session = &sessions[i];
+		printf("  %s: %s %s (%.2fs)\n", session->port,
+				session->chip ? session->chip->name : "unknown device",
+				session->ok ? "passed" : "FAILED", session->elapsed);
+	}
+	printf("%d of %d devices passed in %.2fs", passed, count, elapsed);
+	const struct _image* image = loader ? image_loader_wait(loader) : NULL;
+	if (image && elapsed > 0)
+		printf(", aggregate throughput %.1f KB/s",
+				(double)image->size * passed / 1024 / elapsed);
+	printf("\n");
+
+	bool ok = print_stats(sessions, count, options);
+	for (int i = 0; i < count; i++)
+		stats_free(sessions[i].stats);
+
+	return ok && passed == count;
+}
+
+// exit code of a daemon child when the device does not answer as identified
+#define DAEMON_STALE_SESSION 2
+
+struct _daemon_job {
+	struct _daemon_request request;
+	struct _options options;
+	struct _job job;
+	struct timespec start;
+	bool retried;
+	struct _daemon_job* next;
+};
+
+// Device kept open by the daemon, with its identification, running one job at
+// a time
+struct _daemon_port {
+	char* path;
+	struct _session session;
+	int io_mode;
+	pid_t pid;
+	struct _daemon_job* job;
+	struct _daemon_job* queue;
+};
+
+struct _daemon {
+	int server;
+	struct _daemon_port ports[MAX_PORTS];
+	int nb_ports;
+	struct _image_cache images;
+};
+
+static int _daemon_signal_pipe[2] = { -1, -1 };
+
+static void daemon_signal(int signum)
+{
+	int saved_errno = errno;
+	char c = signum;
+	if (write(_daemon_signal_pipe[1], &c, 1) < 0) {
+		// the pipe is full, the main loop is already woken up
+	}
+	errno = saved_errno;
+}
+
+static bool parse_daemon_job(struct _daemon_job* job)
+{
+	int argc = parse_options(job->request.argc, job->request.argv, &job->options);
+	if (argc < 0)
+		return false;
+	if (job->options.ports || job->options.daemon) {
+		fprintf(stderr, "Error: --ports and --daemon are not supported in daemon jobs\n");
+		return false;
+	}
+	if (argc < 3) {
+		fprintf(stderr, "Error: not enough arguments\n");
+		return false;
+	}
+	return parse_command(argc - 2, job->request.argv + 2, &job->job);
+}
+
+// The job output goes to the client while the daemon prepares it, to its
+// standard error if its standard output receives a dump
+static void redirect_output(const struct _daemon_request* request, bool dump,
+		int saved[2])
+{
+	fflush(stdout);
+	fflush(stderr);
+	saved[0] = dup(STDOUT_FILENO);
+	saved[1] = dup(STDERR_FILENO);
+	dup2(request->fds[dump ? 2 : 1], STDOUT_FILENO);
+	dup2(request->fds[2], STDERR_FILENO);
+}
+
+static void restore_output(int saved[2])
+{
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved[0], STDOUT_FILENO);
+	dup2(saved[1], STDERR_FILENO);
+	close(saved[0]);
+	close(saved[1]);
+}
+
+static void finish_daemon_job(struct _daemon_port* port, struct _daemon_job* job, bool ok)
+{
+	double elapsed = elapsed_since(&job->start);
+	const char* const* argv = (const char* const*)job->request.argv;
+	printf("%s: %s %s in %.3fs\n",
+			port ? port->path : (job->request.argc > 1 ? argv[1] : "?"),
+			job->request.argc > 2 ? argv[2] : "job",
+			ok ? "passed" : "FAILED", elapsed);
+	fflush(stdout);
+	daemon_reply(&job->request, ok, elapsed);
+	free(job);
+}
+
+// Run a job in a child process, which has a copy of the open session and of
+// the cached image, with the standard input and outputs of the client
+static void run_daemon_child(struct _daemon* daemon, struct _daemon_port* port,
+		struct _daemon_job* job, struct _image_loader* loader)
+{
+	for (int i = 0; i < 3; i++)
+		dup2(job->request.fds[i], i);
+	if (job_dumps_to_stdout(&job->job))
+		take_stdout();
+	close(daemon->server);
+	close(_daemon_signal_pipe[0]);
+	close(_daemon_signal_pipe[1]);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+
+	struct _session* session = &port->session;
+	const struct _options* options = &job->options;
+	session->options = options;
+	session->job = &job->job;
+	session->loader = loader;
+	session->applet_loaded = false;
+	session->locks.bits_valid = false;
+	if (options->stats || options->stats_json)
+		session->stats = stats_new();
+	samba_set_stats(session->fd, session->stats);
+	samba_set_read_window(session->fd, options->read_window ?
+			options->read_window : SAMBA_DEFAULT_READ_WINDOW);
+	samba_set_timeout(session->fd, options->timeout ?
+			options->timeout : SAMBA_DEFAULT_TIMEOUT_MS);
+	if (options->packet_size &&
+			!samba_set_packet_size(session->fd, options->packet_size))
+		_exit(1);
+	struct _samba_counters before;
+	samba_get_counters(session->fd, &before);
+
+	// the device may have been reset or replaced since it was identified
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	const struct _chip* chip;
+	if (!chipid_check_serie(session->fd, session->serie, &chip) || chip != session->chip) {
+		fprintf(stderr, "%s: device changed or disconnected\n", port->path);
+		_exit(DAEMON_STALE_SESSION);
+	}
+
+	session->ok = session_execute(session);
+	session->elapsed = elapsed_since(&start);
+	print_recoveries(session, &before);
+	fflush(stdout);
+	bool ok = print_stats(session, 1, options) && session->ok;
+	fflush(stdout);
+	fflush(stderr);
+	_exit(ok ? 0 : 1);
+}
+
+// Start the job on its port, opening and identifying the device first if it
+// is not open yet, or reopening it when the job asks for another I/O mode
+static bool start_daemon_job(struct _daemon* daemon, struct _daemon_port* port,
+		struct _daemon_job* job)
+{
+	int saved[2];
+	redirect_output(&job->request, job_dumps_to_stdout(&job->job), saved);
+
+	bool ok = true;
+	if (chdir(job->request.cwd) != 0) {
+		fprintf(stderr, "Could not change directory to '%s'\n", job->request.cwd);
+		ok = false;
+	}
+
+	struct _session* session = &port->session;
+	if (ok && session->fd >= 0 && port->io_mode != job->options.io_mode)
+		session_close(session);
+	if (ok && session->fd < 0) {
+		port->io_mode = job->options.io_mode;
+		memset(session, 0, sizeof(*session));
+		session->port = port->path;
+		session->fd = -1;
+		session->options = &job->options;
+		ok = session_open(session);
+		if (!ok)
+			session_close(session);
+	}
+
+	struct _image_loader* loader = NULL;
+	if (ok && job_needs_image(&job->job)) {
+		loader = image_cache_get(&daemon->images, job->job.filename);
+		ok = loader != NULL;
+	}
+
+	pid_t pid = -1;
+	if (ok) {
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid == 0)
+			run_daemon_child(daemon, port, job, loader);
+		if (pid < 0)
+			perror("Could not start job");
+	}
+	restore_output(saved);
+
+	if (pid < 0) {
+		finish_daemon_job(port, job, false);
+		return false;
+	}
+	port->pid = pid;
+	port->job = job;
+	return true;
+}
+
+static void start_next_daemon_job(struct _daemon* daemon, struct _daemon_port* port)
+{
+	while (!port->pid && port->queue) {
+		struct _daemon_job* job = port->queue;
+		port->queue = job->next;
+		start_daemon_job(daemon, port, job);
+	}
+}
+
+static void queue_daemon_job(struct _daemon_port* port, struct _daemon_job* job, bool first)
+{
+	struct _daemon_job** next = &port->queue;
+	while (!first && *next)
+		next = &(*next)->next;
+	job->next = *next;
+	*next = job;
+}
+
+static void accept_daemon_job(struct _daemon* daemon)
+{
+	struct _daemon_job* job = malloc(sizeof(*job));
+	if (!job)
+		return;
+	if (!daemon_receive(daemon->server, &job->request)) {
+		free(job);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	job->retried = false;
+
+	int saved[2];
+	redirect_output(&job->request, false, saved);
+	bool ok = parse_daemon_job(job);
+	restore_output(saved);
+	if (!ok) {
+		finish_daemon_job(NULL, job, false);
+		return;
+	}
+
+	const char* path = job->request.argv[1];
+	struct _daemon_port* port = NULL;
+	for (int i = 0; i < daemon->nb_ports && !port; i++)
+		if (!strcmp(daemon->ports[i].path, path))
+			port = &daemon->ports[i];
+	if (!port) {
+		if (daemon->nb_ports == MAX_PORTS) {
+			finish_daemon_job(NULL, job, false);
+			return;
+		}
+		port = &daemon->ports[daemon->nb_ports++];
+		memset(port, 0, sizeof(*port));
+		port->path = strdup(path);
+		port->session.fd = -1;
+	}
+
+	queue_daemon_job(port, job, false);
+	start_next_daemon_job(daemon, port);
+}
+
+static void reap_daemon_jobs(struct _daemon* daemon)
+{
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		struct _daemon_port* port = NULL;
+		for (int i = 0; i < daemon->nb_ports && !port; i++)
+			if (daemon->ports[i].pid == pid)
+				port = &daemon->ports[i];
+		if (!port)
+			continue;
+
+		struct _daemon_job* job = port->job;
+		port->pid = 0;
+		port->job = NULL;
+		bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		bool stale = WIFEXITED(status) && WEXITSTATUS(status) == DAEMON_STALE_SESSION;
+
+		// the device is opened and identified again after it changed or
+		// when a job was interrupted in an unknown state, the job
+		// being retried once in the first case
+		if (stale || !WIFEXITED(status))
+			session_close(&port->session);
+		if (stale && !job->retried) {
+			job->retried = true;
+			queue_daemon_job(port, job, true);
+		} else {
+			finish_daemon_job(port, job, ok);
+		}
+		start_next_daemon_job(daemon, port);
+	}
+}
+
+// Serve jobs sent by clients on a Unix socket, keeping the devices open
+static bool run_daemon(const char* path)
+{
+	struct _daemon* daemon = calloc(1, sizeof(*daemon));
+	if (!daemon)
+		return false;
+	daemon->server = daemon_listen(path);
+	if (daemon->server < 0) {
+		free(daemon);
+		return false;
+	}
+	if (pipe(_daemon_signal_pipe) != 0) {
+		close(daemon->server);
+		free(daemon);
+		return false;
+	}
+	for (int i = 0; i < 2; i++)
+		fcntl(_daemon_signal_pipe[i], F_SETFL, O_NONBLOCK);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = daemon_signal;
+	action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Listening on '%s'\n", path);
+	fflush(stdout);
+
+	bool running = true;
+	while (running) {
+		// the clients of running jobs are watched to stop the jobs
+		// when they disconnect
+		struct pollfd fds[2 + MAX_PORTS];
+		struct _daemon_port* ports[MAX_PORTS];
+		int nfds = 0;
+		fds[nfds].fd = daemon->server;
+		fds[nfds++].events = POLLIN;
+		fds[nfds].fd = _daemon_signal_pipe[0];
+		fds[nfds++].events = POLLIN;
+		for (int i = 0; i < daemon->nb_ports; i++) {
+			if (!daemon->ports[i].pid)
+				continue;
+			ports[nfds - 2] = &daemon->ports[i];
+			fds[nfds].fd = daemon->ports[i].job->request.client;
+			fds[nfds++].events = POLLIN;
+		}
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			char signals[16];
+			ssize_t count = read(_daemon_signal_pipe[0], signals, sizeof(signals));
+			for (ssize_t i = 0; i < count; i++)
+				if (signals[i] == SIGINT || signals[i] == SIGTERM)
+					running = false;
+			reap_daemon_jobs(daemon);
+			continue;
+		}
+		for (int i = 2; i < nfds; i++)
+			if (fds[i].revents && ports[i - 2]->pid)
+				kill(ports[i - 2]->pid, SIGTERM);
+		if (fds[0].revents & POLLIN)
+			accept_daemon_job(daemon);
+	}
+
+	// stop the running jobs, the clients of the queued jobs are told
+	// they failed
+	for (int i = 0; i < daemon->nb_ports; i++) {
+		struct _daemon_port* port = &daemon->ports[i];
+		if (port->pid) {
+			kill(port->pid, SIGTERM);
+			waitpid(port->pid, NULL, 0);
+			finish_daemon_job(port, port->job, false);
+		}
+		while (port->queue) {
+			struct _daemon_job* job = port->queue;
+			port->queue = job->next;
+			finish_daemon_job(port, job, false);
+		}
+		session_close(&port->session);
+		free(port->path);
+	}
+	image_cache_free(&daemon->images);
+	close(daemon->server);
+	unlink(path);
+	close(_daemon_signal_pipe[0]);
+	close(_daemon_signal_pipe[1]);
+	free(daemon);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	char* port = NULL;
+	bool err = true;
+	struct _options options;
+
+	memset(&options, 0, sizeof(options));
+
+	// the client sends its command line to the daemon as is, a dump to the
+	// standard output leaves it to the data
+	for (int i = 1; i + 1 < argc; i++) {
+		if (!strcmp(argv[i], "--connect")) {
+			const char* path = argv[i + 1];
+			memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(*argv));
+			bool dump = false;
+			for (int j = 1; j + 1 < argc - 2; j++)
+				if (!strcmp(argv[j], "read") && is_stdio(argv[j + 1]))
+					dump = true;
+			return daemon_client(path, argc - 2, argv, dump ? stderr : stdout);
+		}
+	}
+
+	// parse options
+	argc = parse_options(argc, argv, &options);
+	if (argc < 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (options.daemon) {
+		if (argc != 1 || options.ports) {
+			fprintf(stderr, "Error: --daemon takes no other argument\n");
+			usage(argv[0]);
+			return -1;
+		}
+		return run_daemon(options.daemon) ? 0 : -1;
+	}
+
+	// in multi-port mode, there is no <port> argument: leave an empty
+	// slot for it (the --ports option freed two)
+	if (options.ports) {
+		memmove(&argv[2], &argv[1], (argc - 1) * sizeof(*argv));
+		argv[1] = NULL;
+		argc++;
+	}
+
+	// parse command line
+	if (argc < 3) {
+		fprintf(stderr, "Error: not enough arguments\n");
+		usage(argv[0]);
+		return -1;
+	}
+	port = argv[1];
+	struct _job job;
+	err = !parse_command(argc - 2, argv + 2, &job);
+	if (!err && options.ports && job.command == CMD_READ) {
+		fprintf(stderr, "Error: read is not supported on multiple ports\n");
+		err = true;
+	}
+	if (!err && options.ports && (job.command == CMD_SCRIPT ||
+				job.command == CMD_WRITE || job.command == CMD_VERIFY) &&
+			is_stdio(job.filename)) {
+		fprintf(stderr, "Error: the standard input is not supported on multiple ports\n");
+		err = true;
+	}
+	if (err) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (job_dumps_to_stdout(&job))
+		take_stdout();
+
+	// the image is loaded once and shared by all sessions, while they
+	// open and identify the devices
+	struct _image_loader loader;
+	struct _image_loader* image_loader = NULL;
+	if (job_needs_image(&job)) {
+		if (!image_loader_start(&loader, job.filename, false)) {
+			fprintf(stderr, "Operation failed\n");
+			return -1;
+		}
+		image_loader = &loader;
+	}
+	struct _layout layout;
+	if (job.command == CMD_FLASH) {
+		if (!layout_load(&layout, job.filename)) {
+			fprintf(stderr, "Operation failed\n");
+			return -1;
+		}
+		job.layout = &layout;
+	}
+
+	if (options.ports) {
+		char* ports = strdup(options.ports);
+		err = !run_gang(ports, &options, &job, image_loader);
+		free(ports);
+	} else {
+		struct _session session;
+		memset(&session, 0, sizeof(session));
+		session.port = port;
+		session.fd = -1;
+		session.options = &options;
+		session.job = &job;
+		session.loader = image_loader;
+		if (options.stats || options.stats_json)
+			session.stats = stats_new();
+		session_run(&session);
+		err = !print_stats(&session, 1, &options) || !session.ok;
+		stats_free(session.stats);
+	}
+
+	if (image_loader)
+		image_loader_free(image_loader);
+	if (job.layout)
+		layout_free(job.layout);
+
 	if (err) {
 		fprintf(stderr, "Operation failed\n");
 		return -1;
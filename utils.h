@@ -18,4 +18,6 @@
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
 
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
 #endif /* UTILS_H_ */